@@ -0,0 +1,139 @@
+// See LICENSE for license details
+
+#include "bigtoken_codec.h"
+
+#include <string.h>
+
+#define BIGTOKEN_CODEC_MAGIC 0x425A5431ULL << 32 // "BZT1"
+#define BIGTOKEN_CODEC_COUNT_MASK 0xFFFFFFFFULL
+#define BIGTOKEN_CODEC_LITERAL (1ULL << 63)
+#define BIGTOKEN_WORDS 8
+
+// clang-format off
+const bigtoken_format_t nic_bigtoken_format = {
+    "simplenic",
+    {0x49249ULL << 43, 0, 0, 0, 0, 0, 0, 0},
+    {0x49249ULL << 44, 0, 0, 0, 0, 0, 0, 0},
+};
+
+// manager_{ready,valid} are bits 36-42 and 43-49 of word 0,
+// client_{ready,valid} bits 18-24 and 25-31 of word 4
+const bigtoken_format_t ctc_bigtoken_format = {
+    "ctc",
+    {0x7FULL << 43, 0, 0, 0, 0x7FULL << 25, 0, 0, 0},
+    {0x7FULL << 36, 0, 0, 0, 0x7FULL << 18, 0, 0, 0},
+};
+// clang-format on
+
+static inline bool is_idle(const bigtoken_format_t &format,
+                           const uint64_t *token) {
+  for (int w = 0; w < BIGTOKEN_WORDS; w++)
+    if (token[w] & format.valid[w])
+      return false;
+  return true;
+}
+
+static inline bool same_kept(const bigtoken_format_t &format,
+                             const uint64_t *a,
+                             const uint64_t *b) {
+  for (int w = 0; w < BIGTOKEN_WORDS; w++)
+    if ((a[w] ^ b[w]) & format.keep[w])
+      return false;
+  return true;
+}
+
+size_t bigtoken_max_encoded(uint32_t count) {
+  // Alternating single idle and literal tokens is the worst case
+  return BIGTOKEN_CODEC_HEADER_BYTES +
+         (size_t)count * (BIGTOKEN_WORDS + 1) * sizeof(uint64_t);
+}
+
+size_t bigtoken_encode(const bigtoken_format_t &format,
+                       const void *tokens,
+                       uint32_t count,
+                       void *out) {
+  const uint64_t *in = (const uint64_t *)tokens;
+  uint64_t *o = (uint64_t *)out;
+  size_t n = 2;
+
+  uint32_t i = 0;
+  while (i < count) {
+    const uint64_t *token = in + (size_t)i * BIGTOKEN_WORDS;
+    uint32_t j = i + 1;
+    if (is_idle(format, token)) {
+      while (j < count && is_idle(format, in + (size_t)j * BIGTOKEN_WORDS) &&
+             same_kept(format, token, in + (size_t)j * BIGTOKEN_WORDS))
+        j++;
+      o[n++] = j - i;
+      for (int w = 0; w < BIGTOKEN_WORDS; w++)
+        if (format.keep[w])
+          o[n++] = token[w] & format.keep[w];
+    } else {
+      while (j < count && !is_idle(format, in + (size_t)j * BIGTOKEN_WORDS))
+        j++;
+      o[n++] = BIGTOKEN_CODEC_LITERAL | (j - i);
+      memcpy(o + n, token, (size_t)(j - i) * BIGTOKEN_WORDS * sizeof(uint64_t));
+      n += (size_t)(j - i) * BIGTOKEN_WORDS;
+    }
+    i = j;
+  }
+
+  o[0] = BIGTOKEN_CODEC_MAGIC | count;
+  o[1] = n;
+  return n * sizeof(uint64_t);
+}
+
+size_t bigtoken_encoded_size(const void *in, uint32_t count) {
+  const uint64_t *w = (const uint64_t *)in;
+  if (w[0] != (BIGTOKEN_CODEC_MAGIC | count) || w[1] < 2 ||
+      w[1] * sizeof(uint64_t) > bigtoken_max_encoded(count))
+    return 0;
+  return w[1] * sizeof(uint64_t);
+}
+
+bool bigtoken_decode(const bigtoken_format_t &format,
+                     const void *in,
+                     size_t len,
+                     void *tokens,
+                     uint32_t count) {
+  const uint64_t *w = (const uint64_t *)in;
+  size_t total = bigtoken_encoded_size(in, count);
+  if (!total || total > len)
+    return false;
+  size_t words = total / sizeof(uint64_t);
+  uint64_t *out = (uint64_t *)tokens;
+
+  int kept_words = 0;
+  for (int k = 0; k < BIGTOKEN_WORDS; k++)
+    kept_words += format.keep[k] != 0;
+
+  size_t n = 2;
+  uint32_t i = 0;
+  while (i < count) {
+    if (n >= words)
+      return false;
+    uint64_t run = w[n++];
+    uint32_t len = run & BIGTOKEN_CODEC_COUNT_MASK;
+    if (len == 0 || len > count - i)
+      return false;
+    uint64_t *token = out + (size_t)i * BIGTOKEN_WORDS;
+    if (run & BIGTOKEN_CODEC_LITERAL) {
+      size_t literal = (size_t)len * BIGTOKEN_WORDS;
+      if (n + literal > words)
+        return false;
+      memcpy(token, w + n, literal * sizeof(uint64_t));
+      n += literal;
+    } else {
+      if (n + kept_words > words)
+        return false;
+      uint64_t idle[BIGTOKEN_WORDS] = {};
+      for (int k = 0; k < BIGTOKEN_WORDS; k++)
+        if (format.keep[k])
+          idle[k] = w[n++] & format.keep[k];
+      for (uint32_t t = 0; t < len; t++)
+        memcpy(token + (size_t)t * BIGTOKEN_WORDS, idle, sizeof(idle));
+    }
+    i += len;
+  }
+  return n == words;
+}
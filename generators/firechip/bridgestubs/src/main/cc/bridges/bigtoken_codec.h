@@ -0,0 +1,58 @@
+// See LICENSE for license details
+
+#ifndef __BIGTOKEN_CODEC_H
+#define __BIGTOKEN_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Run-length encoding of a round of 64-byte big tokens for host-to-host
+ * links. A token is idle when none of its valid bits are set; its payload is
+ * then meaningless and only the bits in keep (e.g. ready signals) have to
+ * survive. Runs of idle tokens with the same kept bits shrink to a run
+ * header plus one word per keep word in use; tokens carrying data are sent
+ * verbatim. An encoded round, as 64-bit words:
+ *
+ *   BIGTOKEN_CODEC_MAGIC | token count
+ *   total words, including these two
+ *   runs: idle    count, then the kept words
+ *         literal BIGTOKEN_CODEC_LITERAL | count, then count * 8 words
+ *
+ * Decoding restores idle tokens as zero apart from their kept bits.
+ */
+struct bigtoken_format_t {
+  const char *name;
+  uint64_t valid[8];
+  uint64_t keep[8];
+};
+
+// simplenic big tokens (nic_bigtoken.h); ready bits are kept
+extern const bigtoken_format_t nic_bigtoken_format;
+// ctc PCIePackets (CTCBridge.scala); client and manager ready bits are kept
+extern const bigtoken_format_t ctc_bigtoken_format;
+
+#define BIGTOKEN_CODEC_HEADER_BYTES 16
+
+// Largest encoding of count tokens
+size_t bigtoken_max_encoded(uint32_t count);
+
+// Encode count tokens into out, which must hold bigtoken_max_encoded(count)
+// bytes. Returns the encoded size.
+size_t bigtoken_encode(const bigtoken_format_t &format,
+                       const void *tokens,
+                       uint32_t count,
+                       void *out);
+
+// Total size of the encoded round starting with the header at in, or 0 if
+// in does not start with an encoded round of count tokens
+size_t bigtoken_encoded_size(const void *in, uint32_t count);
+
+// Decode a round of count tokens. Returns false if it is malformed.
+bool bigtoken_decode(const bigtoken_format_t &format,
+                     const void *in,
+                     size_t len,
+                     void *tokens,
+                     uint32_t count);
+
+#endif // __BIGTOKEN_CODEC_H
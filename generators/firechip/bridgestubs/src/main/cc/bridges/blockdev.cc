@@ -1,6 +1,7 @@
 // See LICENSE for license details
 
 #include "blockdev.h"
+#include <algorithm>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,24 +32,53 @@ char blockdev_t::KIND;
   {}
 #endif
 
+typedef std::chrono::steady_clock stats_clock;
+
+static inline unsigned hist_bin(uint64_t v) {
+  return v ? std::min(64 - __builtin_clzll(v), BLKDEV_HIST_BINS - 1) : 0;
+}
+
+// Maximum number of file operations in flight with +blkdev-aio
+#define BLKDEV_IO_DEPTH 64
+// Limits on how many adjacent requests are merged into one file operation
+#define BLKDEV_MERGE_OPS 64
+#define BLKDEV_MERGE_BYTES (4 << 20)
+
 /* Block Dev software driver constructor.
  * Setup software driver state:
  * Check if we have been given a file to use as a disk, record size and
  * number of sectors to pass to widget */
 blockdev_t::blockdev_t(simif_t &sim,
+                       StreamEngine &stream,
                        const BLOCKDEVBRIDGEMODULE_struct &mmio_addrs,
                        int blkdevno,
                        const std::vector<std::string> &args,
+                       int stream_to_cpu_idx,
+                       int stream_to_cpu_depth,
+                       int stream_from_cpu_idx,
+                       int stream_from_cpu_depth,
                        uint32_t num_trackers,
                        uint32_t latency_bits)
-    : bridge_driver_t(sim, &KIND), mmio_addrs(mmio_addrs) {
-  this->_file = nullptr;
+    : streaming_bridge_driver_t(sim, stream, &KIND), mmio_addrs(mmio_addrs),
+      stream_to_cpu_idx(stream_to_cpu_idx),
+      stream_to_cpu_depth(stream_to_cpu_depth),
+      stream_from_cpu_idx(stream_from_cpu_idx),
+      stream_from_cpu_depth(stream_from_cpu_depth), _blkdevno(blkdevno) {
   this->logfile = nullptr;
   _ntags = num_trackers;
-  long size;
   long mem_filesize = 0;
+  msync_policy_t msync_policy = msync_policy_t::NONE;
+  // Off unless asked for, so raw images keep being served from the mapping
+  const char *aio = "off";
+  const char *overlay = nullptr;
+  overlay_policy_t overlay_policy = overlay_policy_t::KEEP;
+  long cache_mb = 0;
+  bool cache_write_back = false;
+  unsigned readahead_blocks = 8;
+  size_t stripe_kb = 64;
 
   const char *logname = nullptr;
+  const char *stats_filename = nullptr;
 
   // construct arg parsing strings here. We basically append the bridge_driver
   // number to each of these base strings, to get args like +blkdev0 etc.
@@ -59,12 +89,28 @@ blockdev_t::blockdev_t(simif_t &sim,
   std::string blkdevwlatency_arg = std::string("+blkdev-wlatency") + num_equals;
   std::string blkdevrlatency_arg = std::string("+blkdev-rlatency") + num_equals;
   std::string blkdevlog_arg = std::string("+blkdev-log") + num_equals;
+  std::string blkdevmsync_arg = std::string("+blkdev-msync") + num_equals;
+  std::string blkdevaio_arg = std::string("+blkdev-aio") + num_equals;
+  std::string blkdevoverlay_arg = std::string("+blkdev-overlay") + num_equals;
+  std::string blkdevoverlaypolicy_arg =
+      std::string("+blkdev-overlay-policy") + num_equals;
+  std::string blkdevcache_arg = std::string("+blkdev-cache") + num_equals;
+  std::string blkdevcachepolicy_arg =
+      std::string("+blkdev-cache-policy") + num_equals;
+  std::string blkdevreadahead_arg =
+      std::string("+blkdev-readahead") + num_equals;
+  std::string blkdevmaxreqlen_arg =
+      std::string("+blkdev-max-req-len") + num_equals;
+  std::string blkdevstripe_arg = std::string("+blkdev-stripe") + num_equals;
+  std::string blkdevstats_arg = std::string("+blkdev-stats") + num_equals;
+  std::string blkdevstatsinterval_arg =
+      std::string("+blkdev-stats-interval") + num_equals;
 
   for (auto &arg : args) {
     if (arg.find(blkdev_arg) == 0) {
       filename = const_cast<char *>(arg.c_str()) + blkdev_arg.length();
     }
-    // Spoofs a file with fmemopen. Useful for testing
+    // A zeroed anonymous mapping of this many sectors. Useful for testing
     if (arg.find(blkdevinmem_arg) == 0) {
       mem_filesize =
           atoi(const_cast<char *>(arg.c_str()) + blkdevinmem_arg.length());
@@ -80,6 +126,66 @@ blockdev_t::blockdev_t(simif_t &sim,
     if (arg.find(blkdevlog_arg) == 0) {
       logname = const_cast<char *>(arg.c_str()) + blkdevlog_arg.length();
     }
+    if (arg.find(blkdevmsync_arg) == 0) {
+      msync_policy = parse_msync_policy(const_cast<char *>(arg.c_str()) +
+                                        blkdevmsync_arg.length());
+    }
+    if (arg.find(blkdevaio_arg) == 0) {
+      aio = const_cast<char *>(arg.c_str()) + blkdevaio_arg.length();
+    }
+    if (arg.find(blkdevoverlay_arg) == 0) {
+      overlay = const_cast<char *>(arg.c_str()) + blkdevoverlay_arg.length();
+    }
+    if (arg.find(blkdevoverlaypolicy_arg) == 0) {
+      overlay_policy = parse_overlay_policy(
+          const_cast<char *>(arg.c_str()) + blkdevoverlaypolicy_arg.length());
+    }
+    if (arg.find(blkdevcache_arg) == 0) {
+      cache_mb = atol(const_cast<char *>(arg.c_str()) + blkdevcache_arg.length());
+    }
+    if (arg.find(blkdevcachepolicy_arg) == 0) {
+      std::string policy = arg.substr(blkdevcachepolicy_arg.length());
+      if (policy == "writeback") {
+        cache_write_back = true;
+      } else if (policy == "writethrough") {
+        cache_write_back = false;
+      } else {
+        fprintf(stderr,
+                "Unknown blockdev cache policy \"%s\" (expected writethrough "
+                "or writeback)\n",
+                policy.c_str());
+        abort();
+      }
+    }
+    if (arg.find(blkdevreadahead_arg) == 0) {
+      readahead_blocks =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevreadahead_arg.length());
+    }
+    if (arg.find(blkdevmaxreqlen_arg) == 0) {
+      _max_req_len =
+          atoi(const_cast<char *>(arg.c_str()) + blkdevmaxreqlen_arg.length());
+    }
+    if (arg.find(blkdevstripe_arg) == 0) {
+      stripe_kb =
+          atol(const_cast<char *>(arg.c_str()) + blkdevstripe_arg.length());
+    }
+    if (arg.find(blkdevstats_arg) == 0) {
+      stats_filename =
+          const_cast<char *>(arg.c_str()) + blkdevstats_arg.length();
+    }
+    if (arg.find(blkdevstatsinterval_arg) == 0) {
+      _stats_interval = std::chrono::milliseconds(atol(
+          const_cast<char *>(arg.c_str()) + blkdevstatsinterval_arg.length()));
+    }
+  }
+
+  if (_max_req_len == 0 || _max_req_len > MAX_MAX_REQ_LEN) {
+    fprintf(stderr,
+            "Requested blockdev max request length (%u) must be between 1 "
+            "and %u sectors.\n",
+            _max_req_len,
+            MAX_MAX_REQ_LEN);
+    abort();
   }
 
   uint32_t max_latency = (1UL << latency_bits) - 1;
@@ -107,42 +213,95 @@ blockdev_t::blockdev_t(simif_t &sim,
     }
   }
 
-  if (filename) {
-    _file = fopen(filename, "r+");
-    if (!_file) {
-      fprintf(stderr, "Could not open %s\n", filename);
+  if (stats_filename) {
+    _stats_file = fopen(stats_filename, "w");
+    if (_stats_file == nullptr) {
+      fprintf(stderr, "Could not open %s\n", stats_filename);
       abort();
     }
-    if (fseek(_file, 0, SEEK_END)) {
-      perror("fseek");
-      abort();
-    }
-    size = ftell(_file);
-    if (size < 0) {
-      perror("ftell");
+    fprintf(_stats_file,
+            "elapsed_s,ticks,reads,writes,sectors_read,sectors_written,"
+            "read_bytes_per_s,write_bytes_per_s,beats_in,beats_out,file_ops,"
+            "merged_ops,avg_read_depth,avg_write_depth,max_read_depth,"
+            "max_write_depth\n");
+    // Histograms and per-tag service times only make sense as totals, so
+    // they go to a second file at the end of the simulation
+    _hist_filename = std::string(stats_filename) + ".hist";
+  }
+
+  image_format_t format =
+      filename ? detect_image_format(filename) : image_format_t::RAW;
+  if (filename && overlay && format == image_format_t::RAW) {
+    // +blkdev is the shared base, writes go to the overlay
+    _image = std::make_unique<overlay_image_t>(
+        filename, overlay, overlay_policy, msync_policy);
+  } else if (filename && overlay) {
+    if (format == image_format_t::COMPRESSED &&
+        overlay_policy == overlay_policy_t::COMMIT) {
+      fprintf(stderr,
+              "Cannot commit an overlay to compressed image %s\n",
+              filename);
       abort();
     }
+    // Committed writes to the base must be on disk before the delta goes
+    auto base = open_disk_image(filename,
+                                overlay_policy == overlay_policy_t::COMMIT
+                                    ? msync_policy_t::SYNC
+                                    : msync_policy_t::NONE,
+                                stripe_kb << 10);
+    _image = std::make_unique<overlay_image_t>(
+        std::move(base), filename, overlay, overlay_policy, msync_policy);
+  } else if (filename && format == image_format_t::COMPRESSED) {
+    // Fail now rather than on the guest's first write
+    fprintf(stderr,
+            "Compressed image %s is read-only, give it a +blkdev-overlay%d\n",
+            filename,
+            blkdevno);
+    abort();
+  } else if (filename) {
+    // A comma-separated list of files is striped across them
+    _image = open_disk_image(filename, msync_policy, stripe_kb << 10);
   } else if (mem_filesize > 0) {
-    size = mem_filesize << SECTOR_SHIFT;
-    _file = fmemopen(nullptr, size, "r+");
-    if (!_file) {
-      perror("fmemopen");
-      abort();
-    }
-  } else {
-    size = 0;
+    _image = std::make_unique<mmap_image_t>(mem_filesize << SECTOR_SHIFT);
+  }
+  if (_image && cache_mb > 0) {
+    // Cache in front of whichever image was selected above
+    _image = std::make_unique<cached_image_t>(std::move(_image),
+                                              "blockdev" +
+                                                  std::to_string(blkdevno),
+                                              cache_mb << 20,
+                                              cache_write_back,
+                                              readahead_blocks);
+  }
+  _nsectors = _image ? _image->size() >> SECTOR_SHIFT : 0;
+
+  // Only raw and striped images can be accessed in the background; the
+  // others are always synchronous
+  if (_image && strcmp(aio, "off")) {
+    _io = _image->make_io_engine(
+        aio, msync_policy == msync_policy_t::SYNC, BLKDEV_IO_DEPTH);
+  }
+  if (_io) {
+    printf("[INFO] blockdev%d: using %s I/O engine\n", blkdevno, _io->name());
   }
-  _nsectors = size >> SECTOR_SHIFT;
 
   write_trackers.resize(_ntags);
+  read_responses.resize(_ntags);
+  for (auto &tracker : write_trackers)
+    tracker.data.resize(_max_req_len * SECTOR_BEATS);
+  for (auto &resp : read_responses)
+    resp.data.resize(_max_req_len * SECTOR_BEATS);
+  _tag_stats.resize(_ntags);
 }
 
 blockdev_t::~blockdev_t() {
-  if (filename) {
-    fclose(_file);
-  }
+  // In-flight ops point into our response and tracker buffers
+  if (_io)
+    _io->drain();
   if (logfile)
     fclose(logfile);
+  if (_stats_file)
+    fclose(_stats_file);
 }
 
 /* "init" for blockdev widget that gets called right before target_reset.
@@ -154,19 +313,49 @@ void blockdev_t::init() {
   write(mmio_addrs.bdev_max_req_len, max_request_length());
   write(mmio_addrs.read_latency, read_latency);
   write(mmio_addrs.write_latency, write_latency);
+  _stats_start = _stats_last_dump = stats_clock::now();
 }
 
-/* Take a read request, get data from the disk file, and fill the beats
- * into the response queue from which data will be written to the block device
- * widget on the FPGA */
+/* Flush the disk image according to the +blkdev-msync policy */
+void blockdev_t::finish() {
+  if (_io)
+    _io->drain();
+  if (_image)
+    _image->sync();
+  dump_stats(true);
+  dump_histograms();
+  report_bandwidth("read", _stats.sectors_read, _read_first, _read_last);
+  report_bandwidth("written", _stats.sectors_written, _write_first, _write_last);
+}
+
+/* Print the host bandwidth of one direction, from its first request to its
+ * last completion, to compare drivers and image backends on the same
+ * workload (e.g. tests/blkdev-bandwidth.c) */
+void blockdev_t::report_bandwidth(const char *kind,
+                                  uint64_t sectors,
+                                  stats_clock::time_point first,
+                                  stats_clock::time_point last) {
+  double secs = std::chrono::duration<double>(last - first).count();
+  if (!sectors || secs <= 0)
+    return;
+  double mb = (double)(sectors << SECTOR_SHIFT) / (1 << 20);
+  printf("[INFO] blockdev%d: %.1f MB %s in %.3f s of host time, %.1f MB/s\n",
+         _blkdevno,
+         mb,
+         kind,
+         secs,
+         mb / secs);
+}
+
+/* Take a read request and copy its sectors from the disk image into a
+ * response, from which data will be written to the block device widget on the
+ * FPGA. With an I/O engine the read is only started here and the response
+ * waits at its place in the queue until the data arrives. */
 void blockdev_t::do_read(struct blkdev_request &req) {
-  uint64_t offset, nbeats;
-  uint64_t blk_data[MAX_REQ_LEN * SECTOR_BEATS];
+  uint64_t offset;
 
   offset = req.offset;
   offset <<= SECTOR_SHIFT;
-  nbeats = req.len;
-  nbeats *= SECTOR_BEATS;
 
   /* Check that the request is valid. */
   if ((req.offset + req.len) > nsectors()) {
@@ -180,37 +369,44 @@ void blockdev_t::do_read(struct blkdev_request &req) {
     fprintf(stderr, "Read request cannot have 0 length\n");
     abort();
   }
-  if (req.len > MAX_REQ_LEN) {
+  if (req.len > _max_req_len) {
     fprintf(stderr,
             "Read request length too large: %u > %u\n",
             req.len,
-            MAX_REQ_LEN);
+            _max_req_len);
     abort();
   }
   if (req.tag >= _ntags) {
     fprintf(stderr, "Read request tag %d too large.\n", req.tag);
     abort();
   }
-
-  /* Seek to correct place in the file. */
-  if (fseek(_file, offset, SEEK_SET)) {
-    fprintf(stderr, "Could not seek to %" PRIx64 "\n", offset);
+  if (read_responses[req.tag].size) {
+    fprintf(stderr, "Read request tag %d is still in use.\n", req.tag);
     abort();
   }
 
-  /* Perform the read from file. */
-  if (fread(blk_data, SECTOR_SIZE, req.len, _file) < req.len) {
-    fprintf(stderr, "Cannot read data at %" PRIx64 "\n", offset);
-    abort();
-  }
-
-  /* Populate response queue from data that has been read from file. Response
-   * queue will be consumed when writing to FPGA. */
-  for (uint64_t i = 0; i < nbeats; i++) {
-    struct blkdev_data resp;
-    resp.data = blk_data[i];
-    resp.tag = req.tag;
-    read_responses.push(resp);
+  /* Copy the sectors straight into the tag's response buffer. Responses will
+   * be consumed in request order when writing to FPGA. */
+  struct blkdev_read_response &resp = read_responses[req.tag];
+  read_order.push_back(req.tag);
+  resp.tag = req.tag;
+  resp.sent = 0;
+  resp.size = req.len;
+  resp.size *= SECTOR_BEATS;
+  resp.start_tick = _stats.ticks;
+  if (_stats.reads++ == 0)
+    _read_first = stats_clock::now();
+  _stats.sectors_read += req.len;
+  _stats.read_size_hist[hist_bin(req.len)]++;
+  resp.io.write = false;
+  resp.io.offset = offset;
+  resp.io.buf = resp.data.data();
+  resp.io.len = (size_t)req.len << SECTOR_SHIFT;
+  if (_io) {
+    start_io(resp.io);
+  } else {
+    _image->read(offset, resp.data.data(), resp.io.len);
+    resp.io.done = true;
   }
 }
 
@@ -239,8 +435,11 @@ void blockdev_t::do_write(struct blkdev_request &req) {
     fprintf(stderr, "Write request cannot have 0 length\n");
     abort();
   }
-  if (req.len > MAX_REQ_LEN) {
-    fprintf(stderr, "Write request too large: %u > %u\n", req.len, MAX_REQ_LEN);
+  if (req.len > _max_req_len) {
+    fprintf(stderr,
+            "Write request too large: %u > %u\n",
+            req.len,
+            _max_req_len);
     abort();
   }
 
@@ -250,27 +449,44 @@ void blockdev_t::do_write(struct blkdev_request &req) {
   tracker.count = 0;
   tracker.size = req.len;
   tracker.size *= SECTOR_BEATS;
+  tracker.start_tick = _stats.ticks;
+  writes_outstanding++;
+  if (_stats.writes++ == 0)
+    _write_first = stats_clock::now();
+  _stats.sectors_written += req.len;
+  _stats.write_size_hist[hist_bin(req.len)]++;
 }
 
 /* Confirm that a write_tracker has been setup for a chunk of data that
  * we have received from the block device widget, to be written to file */
-bool blockdev_t::can_accept(struct blkdev_data &data) {
-  return write_trackers[data.tag].size > 0;
-}
-
-void blockdev_t::handle_data(struct blkdev_data &data) {
-  if (data.tag >= _ntags) {
-    /* Check that data.tag is in range.
+bool blockdev_t::can_accept(uint32_t tag) {
+  if (tag >= _ntags) {
+    /* Check that the tag is in range.
      * This check must happen before we index into write_trackers */
-    fprintf(stderr, "Data tag %d too large.\n", data.tag);
+    fprintf(stderr, "Data tag %d too large.\n", tag);
     abort();
   }
+  return write_trackers[tag].size > 0;
+}
 
-  struct blkdev_write_tracker &tracker = write_trackers[data.tag];
+/* Copy a run of data beats for one tag into its write tracker. */
+void blockdev_t::handle_data(uint32_t tag,
+                             const uint64_t *data,
+                             size_t nbeats) {
+  struct blkdev_write_tracker &tracker = write_trackers[tag];
+
+  if (tracker.count + nbeats > tracker.size) {
+    fprintf(stderr,
+            "Write data for tag %d exceeds request length (%" PRIu64
+            " beats)\n",
+            tag,
+            tracker.size);
+    abort();
+  }
 
   /* Copy data into the write tracker */
-  tracker.data[tracker.count] = data.data;
-  tracker.count++;
+  memcpy(&tracker.data[tracker.count], data, nbeats * sizeof(uint64_t));
+  tracker.count += nbeats;
 
   if (tracker.count < tracker.size) {
     /* We are still waiting to receive all the data for this write
@@ -278,18 +494,21 @@ void blockdev_t::handle_data(struct blkdev_data &data) {
     return;
   }
 
-  /* Seek to the right place to begin the write to file. */
-  if (fseek(_file, tracker.offset, SEEK_SET)) {
-    fprintf(stderr, "Could not seek to %" PRIx64 "\n", tracker.offset);
-    abort();
+  if (_io) {
+    /* Start the write; the ack goes out once it has completed. */
+    tracker.io.write = true;
+    tracker.io.offset = tracker.offset;
+    tracker.io.buf = tracker.data.data();
+    tracker.io.len = tracker.count * sizeof(uint64_t);
+    pending_writes.push_back(tag);
+    start_io(tracker.io);
+    _image->mark_dirty();
+    return;
   }
 
-  /* Perform the write to file. */
-  if (fwrite(tracker.data, sizeof(uint64_t), tracker.count, _file) <
-      tracker.count) {
-    fprintf(stderr, "Cannot write data at %" PRIx64 "\n", tracker.offset);
-    abort();
-  }
+  /* Copy the whole request into the image. */
+  _image->write(
+      tracker.offset, tracker.data.data(), tracker.count * sizeof(uint64_t));
 
   /* Clear the tracker state */
   tracker.offset = 0;
@@ -298,10 +517,87 @@ void blockdev_t::handle_data(struct blkdev_data &data) {
 
   /* Send an ack to the block device.
    * TODO: should a block device do this?  Biancolin: Yes.*/
-  write_acks.push(data.tag);
+  write_acks.push(tag);
+}
+
+static bool overlaps(const blkdev_io_op &a, const blkdev_io_op &b) {
+  return a.offset < b.offset + b.len && b.offset < a.offset + a.len;
+}
+
+/* Queue an op for the I/O engine. Ops may complete in any order, so an op
+ * that conflicts with one still in flight or queued (either of them a write)
+ * first waits for everything outstanding to finish. This only happens when
+ * the target has overlapping requests outstanding, which is rare. */
+void blockdev_t::start_io(blkdev_io_op &op) {
+  bool hazard = false;
+  for (auto tag : read_order) {
+    blkdev_io_op &pending = read_responses[tag].io;
+    if (&pending != &op && !pending.done && op.write && overlaps(op, pending))
+      hazard = true;
+  }
+  for (auto tag : pending_writes) {
+    blkdev_io_op &pending = write_trackers[tag].io;
+    if (&pending != &op && !pending.done && overlaps(op, pending))
+      hazard = true;
+  }
+  if (hazard) {
+    blkdev_printf("[disk] waiting on overlapping I/O at %llx\n", op.offset);
+    flush_io();
+    _io->drain();
+  }
+  op.done = false;
+  op.merged.clear();
+  io_batch.push_back(&op);
 }
 
-/* Read all pending request data from the widget */
+/* Submit the queued ops. A run of reads or writes for adjacent sectors,
+ * typically a large transfer the target split across several tags, becomes
+ * one vectored file operation. Ops are only merged with their neighbours in
+ * request order, so the order in which requests reach the file is kept. */
+void blockdev_t::flush_io() {
+  for (size_t i = 0; i < io_batch.size();) {
+    blkdev_io_op *head = io_batch[i++];
+    uint64_t end = head->offset + head->len;
+    while (i < io_batch.size() && io_batch[i]->write == head->write &&
+           io_batch[i]->offset == end &&
+           head->merged.size() + 1 < BLKDEV_MERGE_OPS &&
+           end + io_batch[i]->len - head->offset <= BLKDEV_MERGE_BYTES) {
+      end += io_batch[i]->len;
+      head->merged.push_back(io_batch[i++]);
+    }
+    if (!head->merged.empty()) {
+      blkdev_printf("[disk] merged %zu %s ops at %llx, %llu bytes\n",
+                    head->merged.size() + 1,
+                    head->write ? "write" : "read",
+                    head->offset,
+                    end - head->offset);
+    }
+    _stats.file_ops++;
+    _stats.merged_ops += head->merged.size();
+    _io->submit(head);
+  }
+  io_batch.clear();
+}
+
+/* Collect finished file operations and ack completed writes in the order
+ * they were received */
+void blockdev_t::complete_io() {
+  _io->reap(false);
+  while (!pending_writes.empty() &&
+         write_trackers[pending_writes.front()].io.done) {
+    uint32_t tag = pending_writes.front();
+    struct blkdev_write_tracker &tracker = write_trackers[tag];
+    tracker.offset = 0;
+    tracker.count = 0;
+    tracker.size = 0;
+    write_acks.push(tag);
+    pending_writes.pop_front();
+  }
+}
+
+/* Read all pending requests and request data from the widget. Requests are
+ * handled as they arrive, so that write data can usually be copied straight
+ * into its tracker. */
 void blockdev_t::recv() {
   /* Read all pending requests from the widget */
   while (read(mmio_addrs.bdev_req_valid)) {
@@ -320,16 +616,74 @@ void blockdev_t::recv() {
                   req.tag);
   }
 
-  /* Read all pending data beats from the widget */
-  while (read(mmio_addrs.bdev_data_valid)) {
-    /* Take a data chunk from the FPGA and put it in SW processing queues */
-    struct blkdev_data data;
-    data.data = (((uint64_t)read(mmio_addrs.bdev_data_data_upper)) << 32) |
-                (read(mmio_addrs.bdev_data_data_lower) & 0xFFFFFFFF);
-    data.tag = read(mmio_addrs.bdev_data_tag);
-    write(mmio_addrs.bdev_data_ready, true);
-    req_data.push(data);
-    blkdev_printf("[disk] got data. data %llx, tag %x\n", data.data, data.tag);
+  /* Do software processing of request queues. (requests coming from the
+   * block dev widget) */
+  while (!requests.empty()) {
+    struct blkdev_request &req = requests.front();
+    if (req.write) {
+      /* if write request, setup a write tracker */
+      do_write(req);
+    } else {
+      /* if read request, perform read from file and put data into
+       * read_responses queue. */
+      do_read(req);
+    }
+    requests.pop();
+  }
+
+  /* Write data still waiting for its request goes first */
+  while (!req_data.empty() && can_accept(req_data.front().tag)) {
+    handle_data(req_data.front().tag, &req_data.front().data, 1);
+    req_data.pop();
+  }
+
+  /* Pull all pending data beats from the widget's stream */
+  uint32_t beats_sent = read(mmio_addrs.bdev_data_beats);
+  uint32_t beats_pulled_before = data_beats_pulled;
+  page_aligned_sized_array(beat_buf, stream_to_cpu_depth * STREAM_WIDTH_BYTES);
+  while (beats_sent != data_beats_pulled) {
+    size_t bytes_received = pull(stream_to_cpu_idx,
+                                 beat_buf,
+                                 stream_to_cpu_depth * STREAM_WIDTH_BYTES,
+                                 0);
+    if (bytes_received == 0) {
+      /* Not visible to the host yet, try again on the next tick */
+      break;
+    }
+
+    size_t nbeats = bytes_received / STREAM_WIDTH_BYTES;
+    auto *beats = (struct blkdev_stream_beat *)beat_buf;
+    for (size_t b = 0; b < nbeats; b++) {
+      /* Copy each run of same-tag data into its tracker, or queue it if
+       * the request has not been seen yet */
+      for (int i = 0, run; i < beats[b].count; i += run) {
+        uint32_t tag = beats[b].tags[i];
+        for (run = 1; i + run < beats[b].count && beats[b].tags[i + run] == tag;
+             run++)
+          ;
+        blkdev_printf("[disk] got data. %d beats, tag %x\n", run, tag);
+        if (req_data.empty() && can_accept(tag)) {
+          handle_data(tag, &beats[b].data[i], run);
+          continue;
+        }
+        for (int j = i; j < i + run; j++) {
+          struct blkdev_data data;
+          data.data = beats[b].data[j];
+          data.tag = tag;
+          req_data.push(data);
+        }
+      }
+    }
+    data_beats_pulled += nbeats;
+    _stats.beats_in += nbeats;
+  }
+  if (data_beats_pulled != beats_pulled_before) {
+    write(mmio_addrs.bdev_data_beats_pulled, data_beats_pulled);
+  }
+
+  /* Start the file operations for everything received above */
+  if (_io) {
+    flush_io();
   }
 }
 
@@ -344,23 +698,82 @@ void blockdev_t::send() {
     write(mmio_addrs.bdev_wack_valid, true);
     blkdev_printf("[disk] sending W ack. tag %x\n", tag);
     write_acks.pop();
+
+    uint64_t ticks = _stats.ticks - write_trackers[tag].start_tick;
+    blkdev_tag_stats_t &ts = _tag_stats[tag];
+    ts.writes++;
+    ts.write_ticks += ticks;
+    ts.write_ticks_max = std::max(ts.write_ticks_max, ticks);
+    _stats.write_ticks_hist[hist_bin(ticks)]++;
+    writes_outstanding--;
+    _write_last = stats_clock::now();
   }
 
-  /* Send as much read reponse data as as the blockdev widget will accept */
-  while (!read_responses.empty() && read(mmio_addrs.bdev_rresp_ready)) {
-    struct blkdev_data resp;
-    resp = read_responses.front();
-    write(mmio_addrs.bdev_rresp_data_upper, (resp.data >> 32) & 0xFFFFFFFF);
-    write(mmio_addrs.bdev_rresp_data_lower, resp.data & 0xFFFFFFFF);
-    write(mmio_addrs.bdev_rresp_tag, resp.tag);
-    write(mmio_addrs.bdev_rresp_valid, true);
-    blkdev_printf(
-        "[disk] sending R resp. data %llx, tag %x\n", resp.data, resp.tag);
-    read_responses.pop();
+  /* Pack as much read reponse data as fits in the stream into beats.
+   * Responses go out in request order, so stop at one still being read. */
+  page_aligned_sized_array(beat_buf,
+                           stream_from_cpu_depth * STREAM_WIDTH_BYTES);
+  auto *beats = (struct blkdev_stream_beat *)beat_buf;
+  int nbeats = 0;
+  auto next = read_order.begin();
+  uint64_t sent = next != read_order.end() ? read_responses[*next].sent : 0;
+  while (nbeats < stream_from_cpu_depth && next != read_order.end() &&
+         read_responses[*next].io.done) {
+    struct blkdev_stream_beat &beat = beats[nbeats++];
+    memset(&beat, 0, sizeof(beat));
+    while (beat.count < BLKDEV_STREAM_ENTRIES && next != read_order.end()) {
+      struct blkdev_read_response &resp = read_responses[*next];
+      if (!resp.io.done)
+        break;
+      size_t n = std::min<uint64_t>(BLKDEV_STREAM_ENTRIES - beat.count,
+                                    resp.size - sent);
+      memcpy(&beat.data[beat.count], &resp.data[sent], n * sizeof(uint64_t));
+      memset(&beat.tags[beat.count], resp.tag, n);
+      beat.count += n;
+      sent += n;
+      if (sent == resp.size) {
+        ++next;
+        sent = 0;
+      }
+    }
+  }
+
+  /* Send as many beats as the widget will accept, then retire the data
+   * that made it */
+  if (nbeats) {
+    size_t bytes_sent = push(stream_from_cpu_idx,
+                             beat_buf,
+                             nbeats * STREAM_WIDTH_BYTES,
+                             0);
+    for (size_t b = 0; b < bytes_sent / STREAM_WIDTH_BYTES; b++) {
+      uint64_t n = beats[b].count;
+      while (n) {
+        struct blkdev_read_response &front = read_responses[read_order.front()];
+        uint64_t consumed = std::min(n, front.size - front.sent);
+        blkdev_printf("[disk] sending R resp. %llu beats, tag %x\n",
+                      consumed,
+                      front.tag);
+        front.sent += consumed;
+        n -= consumed;
+        if (front.sent == front.size) {
+          uint64_t ticks = _stats.ticks - front.start_tick;
+          blkdev_tag_stats_t &ts = _tag_stats[front.tag];
+          ts.reads++;
+          ts.read_ticks += ticks;
+          ts.read_ticks_max = std::max(ts.read_ticks_max, ticks);
+          _stats.read_ticks_hist[hist_bin(ticks)]++;
+          _read_last = stats_clock::now();
+          front.size = 0;
+          read_order.pop_front();
+        }
+      }
+    }
+    _stats.beats_out += bytes_sent / STREAM_WIDTH_BYTES;
   }
 
   /* Mark if finished */
-  resp_data_pending = !read_responses.empty() || !write_acks.empty();
+  resp_data_pending = !read_order.empty() || !write_acks.empty() ||
+                      !pending_writes.empty();
 }
 
 bool blockdev_t::idle() {
@@ -371,47 +784,122 @@ bool blockdev_t::idle() {
  * No target time is modelled here; the widget will stall stimulation if
  * we have not yet serviced a transaction that is scheduled to be released. */
 void blockdev_t::tick() {
+  _stats.ticks++;
+  dump_stats(false);
 
   /* If there's nothing to do, early out and save a bunch of MMIO */
   if (idle()) {
     return;
   }
 
+  _stats.depth_samples++;
+  _stats.read_depth_sum += read_order.size();
+  _stats.write_depth_sum += writes_outstanding;
+  _stats.read_depth_max =
+      std::max<uint64_t>(_stats.read_depth_max, read_order.size());
+  _stats.write_depth_max =
+      std::max<uint64_t>(_stats.write_depth_max, writes_outstanding);
+
   /* If there's pending response data from the last invocation of tick(),
    * write that back first as it might be locking up the simulator */
   if (resp_data_pending) {
     this->send();
   }
 
-  /* Collect all of the requests sitting in the widget queues */
+  /* Collect and process all of the requests and write data sitting in the
+   * widget queues */
   this->recv();
 
-  /* Do software processing of request queues. (requests coming from the
-   * block dev widget) */
-  while (!requests.empty()) {
-    struct blkdev_request &req = requests.front();
-    if (req.write) {
-      /* if write request, setup a write tracker */
-      do_write(req);
-    } else {
-      /* if read request, perform read from file and put data into
-       * read_responses queue. */
-      do_read(req);
-    }
-    requests.pop();
-  }
-
-  /* Do software processing of write data queues. (data coming from the
-   * block dev widget).
-   *
-   * If there is data in req_data (from the FPGA) and a tracker has been
-   * properly setup for this write, then call handle_data for this beat
-   * of the write. */
-  while (!req_data.empty() && can_accept(req_data.front())) {
-    handle_data(req_data.front());
-    req_data.pop();
+  if (_io) {
+    complete_io();
   }
 
   /* Write state back to block device widget */
   this->send();
 }
+
+/* Append a row of totals and interval rates to the +blkdev-stats file, at
+ * most once per +blkdev-stats-interval unless forced */
+void blockdev_t::dump_stats(bool force) {
+  if (!_stats_file)
+    return;
+
+  auto now = stats_clock::now();
+  if (!force && now - _stats_last_dump < _stats_interval)
+    return;
+
+  double interval_s =
+      std::chrono::duration<double>(now - _stats_last_dump).count();
+  uint64_t read_bytes = (_stats.sectors_read - _stats_last.sectors_read)
+                        << SECTOR_SHIFT;
+  uint64_t write_bytes = (_stats.sectors_written - _stats_last.sectors_written)
+                         << SECTOR_SHIFT;
+  double samples = _stats.depth_samples ? _stats.depth_samples : 1;
+
+  fprintf(_stats_file,
+          "%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+          ",%.0f,%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+          ",%.2f,%.2f,%" PRIu64 ",%" PRIu64 "\n",
+          std::chrono::duration<double>(now - _stats_start).count(),
+          _stats.ticks,
+          _stats.reads,
+          _stats.writes,
+          _stats.sectors_read,
+          _stats.sectors_written,
+          interval_s > 0 ? read_bytes / interval_s : 0.0,
+          interval_s > 0 ? write_bytes / interval_s : 0.0,
+          _stats.beats_in,
+          _stats.beats_out,
+          _stats.file_ops,
+          _stats.merged_ops,
+          _stats.read_depth_sum / samples,
+          _stats.write_depth_sum / samples,
+          _stats.read_depth_max,
+          _stats.write_depth_max);
+  fflush(_stats_file);
+
+  _stats_last = _stats;
+  _stats_last_dump = now;
+}
+
+/* Write the request size and service time histograms and the per-tag
+ * service times next to the +blkdev-stats file */
+void blockdev_t::dump_histograms() {
+  if (_hist_filename.empty())
+    return;
+
+  FILE *f = fopen(_hist_filename.c_str(), "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Could not open %s\n", _hist_filename.c_str());
+    abort();
+  }
+
+  fprintf(f,
+          "bin_start,read_sectors,write_sectors,read_ticks,write_ticks\n");
+  for (int i = 0; i < BLKDEV_HIST_BINS; i++) {
+    fprintf(f,
+            "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            i ? (uint64_t)1 << (i - 1) : 0,
+            _stats.read_size_hist[i],
+            _stats.write_size_hist[i],
+            _stats.read_ticks_hist[i],
+            _stats.write_ticks_hist[i]);
+  }
+
+  fprintf(f,
+          "\ntag,reads,avg_read_ticks,max_read_ticks,writes,avg_write_ticks,"
+          "max_write_ticks\n");
+  for (uint32_t tag = 0; tag < _ntags; tag++) {
+    const blkdev_tag_stats_t &ts = _tag_stats[tag];
+    fprintf(f,
+            "%u,%" PRIu64 ",%.1f,%" PRIu64 ",%" PRIu64 ",%.1f,%" PRIu64 "\n",
+            tag,
+            ts.reads,
+            ts.reads ? (double)ts.read_ticks / ts.reads : 0.0,
+            ts.read_ticks_max,
+            ts.writes,
+            ts.writes ? (double)ts.write_ticks / ts.writes : 0.0,
+            ts.write_ticks_max);
+  }
+  fclose(f);
+}
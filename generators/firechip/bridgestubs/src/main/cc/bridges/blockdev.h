@@ -2,10 +2,21 @@
 #ifndef __BLOCKDEV_H
 #define __BLOCKDEV_H
 
+#include <chrono>
+#include <deque>
+#include <memory>
 #include <queue>
 #include <stdio.h>
+#include <string>
 #include <vector>
 
+#include "bridges/blockdev/async_io.h"
+#include "bridges/blockdev/cached_image.h"
+#include "bridges/blockdev/compressed_image.h"
+#include "bridges/blockdev/disk_image.h"
+#include "bridges/blockdev/overlay_image.h"
+#include "bridges/blockdev/sparse_image.h"
+#include "bridges/blockdev/striped_image.h"
 #include "core/bridge_driver.h"
 
 struct BLOCKDEVBRIDGEMODULE_struct {
@@ -19,16 +30,8 @@ struct BLOCKDEVBRIDGEMODULE_struct {
   uint64_t bdev_req_len;
   uint64_t bdev_req_tag;
   uint64_t bdev_req_ready;
-  uint64_t bdev_data_valid;
-  uint64_t bdev_data_data_upper;
-  uint64_t bdev_data_data_lower;
-  uint64_t bdev_data_tag;
-  uint64_t bdev_data_ready;
-  uint64_t bdev_rresp_data_upper;
-  uint64_t bdev_rresp_data_lower;
-  uint64_t bdev_rresp_tag;
-  uint64_t bdev_rresp_valid;
-  uint64_t bdev_rresp_ready;
+  uint64_t bdev_data_beats;
+  uint64_t bdev_data_beats_pulled;
   uint64_t bdev_wack_tag;
   uint64_t bdev_wack_valid;
   uint64_t bdev_wack_ready;
@@ -40,7 +43,10 @@ struct BLOCKDEVBRIDGEMODULE_struct {
 #define SECTOR_SIZE 512
 #define SECTOR_SHIFT 9
 #define SECTOR_BEATS (SECTOR_SIZE / 8)
-#define MAX_REQ_LEN 16
+// Default and largest request length in sectors (+blkdev-max-req-len). Each
+// tag keeps a read and a write buffer of this size.
+#define DEFAULT_MAX_REQ_LEN 16
+#define MAX_MAX_REQ_LEN 4096
 
 struct blkdev_request {
   bool write;
@@ -54,59 +60,172 @@ struct blkdev_data {
   uint32_t tag;
 };
 
+// Write data and read responses travel over the bridge streams packed into
+// 64-byte beats of up to seven data beats each (see BlockDevStreamBeat in
+// BlockDevBridgeModule.scala)
+#define BLKDEV_STREAM_ENTRIES 7
+
+struct blkdev_stream_beat {
+  uint64_t data[BLKDEV_STREAM_ENTRIES];
+  uint8_t count;
+  uint8_t tags[BLKDEV_STREAM_ENTRIES];
+};
+static_assert(sizeof(blkdev_stream_beat) ==
+              streaming_bridge_driver_t::STREAM_WIDTH_BYTES);
+
+// log2 histograms: bin 0 counts zeros, bin i > 0 counts [2^(i-1), 2^i)
+#define BLKDEV_HIST_BINS 32
+
+// Running totals behind +blkdev-stats
+struct blkdev_stats_t {
+  uint64_t ticks = 0;
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  uint64_t sectors_read = 0;
+  uint64_t sectors_written = 0;
+  uint64_t beats_in = 0;   // stream beats of write data pulled
+  uint64_t beats_out = 0;  // stream beats of read data pushed
+  uint64_t file_ops = 0;   // operations handed to the I/O engine
+  uint64_t merged_ops = 0; // requests carried by another request's operation
+  // Outstanding requests, sampled on every tick that has work to do
+  uint64_t depth_samples = 0;
+  uint64_t read_depth_sum = 0;
+  uint64_t write_depth_sum = 0;
+  uint64_t read_depth_max = 0;
+  uint64_t write_depth_max = 0;
+  // Request sizes in sectors and service times in ticks, from the request
+  // being read off the widget until its data or ack has been sent back
+  uint64_t read_size_hist[BLKDEV_HIST_BINS] = {};
+  uint64_t write_size_hist[BLKDEV_HIST_BINS] = {};
+  uint64_t read_ticks_hist[BLKDEV_HIST_BINS] = {};
+  uint64_t write_ticks_hist[BLKDEV_HIST_BINS] = {};
+};
+
+struct blkdev_tag_stats_t {
+  uint64_t reads = 0;
+  uint64_t read_ticks = 0;
+  uint64_t read_ticks_max = 0;
+  uint64_t writes = 0;
+  uint64_t write_ticks = 0;
+  uint64_t write_ticks_max = 0;
+};
+
+// Data for one read request, sent back to the widget once the read has
+// completed. There is one per tag, as a tag is only reused once all of its
+// data has been returned; size is 0 while the tag is free.
+struct blkdev_read_response {
+  uint32_t tag;
+  uint64_t sent;
+  uint64_t size;
+  uint64_t start_tick;
+  blkdev_io_op io;
+  std::vector<uint64_t> data; // max request length worth of beats
+};
+
 struct blkdev_write_tracker {
   uint64_t offset;
   uint64_t count;
   uint64_t size;
-  uint64_t data[MAX_REQ_LEN * SECTOR_BEATS];
+  uint64_t start_tick;
+  blkdev_io_op io;
+  std::vector<uint64_t> data; // max request length worth of beats
 };
 
-class blockdev_t : public bridge_driver_t {
+class blockdev_t : public streaming_bridge_driver_t {
 public:
   /// The identifier for the bridge type used for casts.
   static char KIND;
 
   blockdev_t(simif_t &sim,
+             StreamEngine &stream,
              const BLOCKDEVBRIDGEMODULE_struct &mmio_addrs,
              int blkdevno,
              const std::vector<std::string> &args,
+             int stream_to_cpu_idx,
+             int stream_to_cpu_depth,
+             int stream_from_cpu_idx,
+             int stream_from_cpu_depth,
              uint32_t num_trackers,
              uint32_t latency_bits);
   ~blockdev_t() override;
 
   uint32_t nsectors(void) { return _nsectors; }
-  uint32_t max_request_length(void) { return MAX_REQ_LEN; }
+  uint32_t max_request_length(void) { return _max_req_len; }
 
   void init() override;
   void tick() override;
+  void finish() override;
 
   void send();
   void recv();
 
 private:
   const BLOCKDEVBRIDGEMODULE_struct mmio_addrs;
+  const int stream_to_cpu_idx;
+  const int stream_to_cpu_depth;
+  const int stream_from_cpu_idx;
+  const int stream_from_cpu_depth;
+  // Stream beats of write data pulled so far, compared against the widget's
+  // count of beats sent to tell if there is anything to pull. Written back
+  // to the widget, which counts beats not yet pulled in bdev_reqs_pending.
+  uint32_t data_beats_pulled = 0;
 
   // Set if, on the previous tick, we couldn't write back all of our response
   // data
   bool resp_data_pending = false;
 
+  const int _blkdevno;
   uint32_t _ntags;
   uint32_t _nsectors;
-  FILE *_file, *logfile;
+  uint32_t _max_req_len = DEFAULT_MAX_REQ_LEN;
+  std::unique_ptr<disk_image_t> _image;
+  // Set if file I/O is overlapped with simulation (+blkdev-aio)
+  std::unique_ptr<blkdev_io_engine_t> _io;
+  FILE *logfile;
   char *filename = nullptr;
   std::queue<blkdev_request> requests;
+  // Write data that arrived ahead of its request
   std::queue<blkdev_data> req_data;
-  std::queue<blkdev_data> read_responses;
+  std::vector<blkdev_read_response> read_responses;
+  // Tags of outstanding reads, in request order
+  std::deque<uint32_t> read_order;
   std::queue<uint32_t> write_acks;
+  // Tags of writes handed to _io, acked in order as they complete
+  std::deque<uint32_t> pending_writes;
+  // Ops started during this tick, submitted together by flush_io() so that
+  // adjacent requests become a single file operation
+  std::vector<blkdev_io_op *> io_batch;
 
   std::vector<blkdev_write_tracker> write_trackers;
+  // Writes requested but not yet acked
+  uint32_t writes_outstanding = 0;
+
+  blkdev_stats_t _stats, _stats_last;
+  std::vector<blkdev_tag_stats_t> _tag_stats;
+  FILE *_stats_file = nullptr;
+  std::string _hist_filename;
+  std::chrono::milliseconds _stats_interval{1000};
+  std::chrono::steady_clock::time_point _stats_start, _stats_last_dump;
+  // Host time from the first request of each kind to the last one done,
+  // behind the host bandwidth reported by finish()
+  std::chrono::steady_clock::time_point _read_first, _read_last;
+  std::chrono::steady_clock::time_point _write_first, _write_last;
 
   void do_read(struct blkdev_request &req);
   void do_write(struct blkdev_request &req);
-  bool can_accept(struct blkdev_data &data);
-  void handle_data(struct blkdev_data &data);
+  bool can_accept(uint32_t tag);
+  void handle_data(uint32_t tag, const uint64_t *data, size_t nbeats);
+  void start_io(blkdev_io_op &op);
+  void flush_io();
+  void complete_io();
   // Returns true if no widget interaction is required
   bool idle();
+  void dump_stats(bool force);
+  void report_bandwidth(const char *kind,
+                        uint64_t sectors,
+                        std::chrono::steady_clock::time_point first,
+                        std::chrono::steady_clock::time_point last);
+  void dump_histograms();
 
   // Default timing model parameters
   uint32_t read_latency = 4096;
@@ -0,0 +1,389 @@
+// See LICENSE for license details
+
+#include "async_io.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Hosts whose kernel headers predate io_uring only get the thread pool
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define BLKDEV_IO_URING
+#endif
+
+#define BLKDEV_IO_THREADS 4
+
+static void io_failed(blkdev_io_op *op, int err) {
+  fprintf(stderr,
+          "Cannot %s data at %" PRIx64 ": %s\n",
+          op->write ? "write" : "read",
+          op->offset,
+          strerror(err));
+  abort();
+}
+
+// Gather the buffers of an op and the ops merged into it. Returns the total
+// length of the transfer.
+static size_t build_iov(blkdev_io_op *op) {
+  op->done = false;
+  op->iov.clear();
+  op->iov.push_back({op->buf, op->len});
+  size_t len = op->len;
+  for (auto *m : op->merged) {
+    m->done = false;
+    op->iov.push_back({m->buf, m->len});
+    len += m->len;
+  }
+  return len;
+}
+
+static void mark_done(blkdev_io_op *op) {
+  op->done = true;
+  for (auto *m : op->merged)
+    m->done = true;
+}
+
+// Carry out an op, minus its first skip bytes, with blocking vectored I/O
+static void transfer(int fd, bool dsync, blkdev_io_op *op, size_t skip) {
+  std::vector<struct iovec> iov = op->iov;
+  size_t i = 0;
+  auto consume = [&](size_t n) {
+    while (i < iov.size() && n >= iov[i].iov_len)
+      n -= iov[i++].iov_len;
+    if (n) {
+      iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+      iov[i].iov_len -= n;
+    }
+  };
+
+  consume(skip);
+  uint64_t offset = op->offset + skip;
+  while (i < iov.size()) {
+    int cnt = std::min<size_t>(iov.size() - i, IOV_MAX);
+    ssize_t n = op->write ? pwritev(fd, &iov[i], cnt, offset)
+                          : preadv(fd, &iov[i], cnt, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      io_failed(op, n ? errno : EIO);
+    offset += n;
+    consume(n);
+  }
+  if (op->write && dsync && fdatasync(fd)) {
+    perror("fdatasync");
+    abort();
+  }
+}
+
+#ifdef BLKDEV_IO_URING
+
+class uring_engine_t : public blkdev_io_engine_t {
+public:
+  uring_engine_t(int fd, bool dsync) : fd(fd), dsync(dsync) {}
+  ~uring_engine_t() override;
+
+  // Returns false if the kernel refuses to set up a ring
+  bool setup(unsigned depth);
+
+  const char *name() const override { return "io_uring"; }
+  void submit(blkdev_io_op *op) override;
+  size_t reap(bool wait) override;
+  size_t inflight() const override { return _inflight; }
+
+private:
+  void queue(blkdev_io_op *op);
+
+  int fd;
+  bool dsync;
+  int ring_fd = -1;
+  unsigned entries = 0;
+  unsigned to_submit = 0;
+  size_t _inflight = 0;
+
+  void *sq_ring = MAP_FAILED, *cq_ring = MAP_FAILED;
+  size_t sq_ring_sz = 0, cq_ring_sz = 0;
+  struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+  size_t sqes_sz = 0;
+
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+bool uring_engine_t::setup(unsigned depth) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+  if (ring_fd < 0)
+    return false;
+  entries = p.sq_entries;
+
+  sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap)
+    sq_ring_sz = cq_ring_sz = std::max(sq_ring_sz, cq_ring_sz);
+
+  sq_ring = mmap(nullptr,
+                 sq_ring_sz,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE,
+                 ring_fd,
+                 IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    return false;
+  cq_ring = single_mmap ? sq_ring
+                        : mmap(nullptr,
+                               cq_ring_sz,
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE,
+                               ring_fd,
+                               IORING_OFF_CQ_RING);
+  if (cq_ring == MAP_FAILED)
+    return false;
+  sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *)mmap(nullptr,
+                                     sqes_sz,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE,
+                                     ring_fd,
+                                     IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+
+  uint8_t *sq = (uint8_t *)sq_ring;
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  uint8_t *cq = (uint8_t *)cq_ring;
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+uring_engine_t::~uring_engine_t() {
+  if (ring_fd >= 0 && sqes != MAP_FAILED)
+    drain();
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_sz);
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_sz);
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_sz);
+  if (ring_fd >= 0)
+    close(ring_fd);
+}
+
+void uring_engine_t::queue(blkdev_io_op *op) {
+  // Every queued op holds a CQ slot too, so bounding in-flight ops by the SQ
+  // size also keeps the CQ from overflowing.
+  while (_inflight >= entries)
+    reap(true);
+
+  unsigned tail = *sq_tail;
+  unsigned idx = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = op->offset;
+  sqe->addr = (uint64_t)op->iov.data();
+  sqe->len = op->iov.size();
+  sqe->rw_flags = (op->write && dsync) ? RWF_DSYNC : 0;
+  sqe->user_data = (uint64_t)op;
+  sq_array[idx] = idx;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  to_submit++;
+  _inflight++;
+}
+
+void uring_engine_t::submit(blkdev_io_op *op) {
+  if (op->merged.size() >= IOV_MAX) {
+    fprintf(stderr, "Too many merged blockdev ops (%zu)\n", op->merged.size());
+    abort();
+  }
+  build_iov(op);
+  queue(op);
+}
+
+size_t uring_engine_t::reap(bool wait) {
+  wait = wait && _inflight > 0;
+  if (to_submit || wait) {
+    int ret = syscall(__NR_io_uring_enter,
+                      ring_fd,
+                      to_submit,
+                      wait ? 1 : 0,
+                      wait ? IORING_ENTER_GETEVENTS : 0,
+                      nullptr,
+                      0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("io_uring_enter");
+      abort();
+    }
+    if (ret > 0)
+      to_submit -= ret;
+  }
+
+  size_t completed = 0;
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  std::vector<blkdev_io_op *> retry;
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    blkdev_io_op *op = (blkdev_io_op *)cqe->user_data;
+    _inflight--;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+      retry.push_back(op);
+    } else if (cqe->res <= 0) {
+      io_failed(op, cqe->res ? -cqe->res : EIO);
+    } else {
+      size_t len = 0;
+      for (auto &v : op->iov)
+        len += v.iov_len;
+      // Short transfers are rare enough to finish off synchronously
+      if ((size_t)cqe->res < len)
+        transfer(fd, dsync, op, cqe->res);
+      mark_done(op);
+      completed++;
+    }
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+  for (auto *op : retry)
+    queue(op);
+  return completed;
+}
+
+#endif // BLKDEV_IO_URING
+
+class thread_engine_t : public blkdev_io_engine_t {
+public:
+  thread_engine_t(int fd, bool dsync);
+  ~thread_engine_t() override;
+
+  const char *name() const override { return "threads"; }
+  void submit(blkdev_io_op *op) override;
+  size_t reap(bool wait) override;
+  size_t inflight() const override { return _inflight; }
+
+private:
+  void run();
+
+  int fd;
+  bool dsync;
+  size_t _inflight = 0;
+
+  std::mutex mutex;
+  std::condition_variable work_cv, done_cv;
+  std::deque<blkdev_io_op *> work;
+  std::vector<blkdev_io_op *> completed;
+  bool stop = false;
+  std::vector<std::thread> workers;
+};
+
+thread_engine_t::thread_engine_t(int fd, bool dsync) : fd(fd), dsync(dsync) {
+  for (int i = 0; i < BLKDEV_IO_THREADS; i++)
+    workers.emplace_back(&thread_engine_t::run, this);
+}
+
+thread_engine_t::~thread_engine_t() {
+  drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  work_cv.notify_all();
+  for (auto &t : workers)
+    t.join();
+}
+
+void thread_engine_t::run() {
+  while (true) {
+    blkdev_io_op *op;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      work_cv.wait(lock, [this] { return stop || !work.empty(); });
+      if (work.empty())
+        return;
+      op = work.front();
+      work.pop_front();
+    }
+    transfer(fd, dsync, op, 0);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      completed.push_back(op);
+    }
+    done_cv.notify_one();
+  }
+}
+
+void thread_engine_t::submit(blkdev_io_op *op) {
+  build_iov(op);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    work.push_back(op);
+  }
+  _inflight++;
+  work_cv.notify_one();
+}
+
+size_t thread_engine_t::reap(bool wait) {
+  std::vector<blkdev_io_op *> finished;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (wait && _inflight)
+      done_cv.wait(lock, [this] { return !completed.empty(); });
+    finished.swap(completed);
+  }
+  for (auto *op : finished)
+    mark_done(op);
+  _inflight -= finished.size();
+  return finished.size();
+}
+
+std::unique_ptr<blkdev_io_engine_t> blkdev_io_engine_t::create(
+    const char *kind, int fd, bool dsync, unsigned depth) {
+  bool want_uring = !strcmp(kind, "auto") || !strcmp(kind, "uring");
+  if (!want_uring && strcmp(kind, "threads")) {
+    fprintf(stderr,
+            "Unknown blockdev I/O engine \"%s\" (expected auto, uring, "
+            "threads or off)\n",
+            kind);
+    abort();
+  }
+
+  if (want_uring) {
+#ifdef BLKDEV_IO_URING
+    auto uring = std::make_unique<uring_engine_t>(fd, dsync);
+    if (uring->setup(depth))
+      return uring;
+    if (!strcmp(kind, "uring")) {
+      perror("io_uring_setup");
+      abort();
+    }
+#else
+    if (!strcmp(kind, "uring")) {
+      fprintf(stderr, "This driver was built without io_uring support\n");
+      abort();
+    }
+#endif
+  }
+  return std::make_unique<thread_engine_t>(fd, dsync);
+}
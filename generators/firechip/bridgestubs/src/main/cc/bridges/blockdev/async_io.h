@@ -0,0 +1,60 @@
+// See LICENSE for license details
+#ifndef __ASYNC_IO_H
+#define __ASYNC_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <vector>
+
+// One read or write against the image file. The op (and its buffer) must
+// stay alive until the engine marks it done.
+struct blkdev_io_op {
+  bool write;
+  uint64_t offset;
+  void *buf;
+  size_t len;
+  bool done;
+  // Ops of the same kind for the file range directly following this one.
+  // They are carried out by the same vectored read/write and marked done
+  // along with it.
+  std::vector<blkdev_io_op *> merged;
+  // Engine scratch: the buffers of this op and the merged ones
+  std::vector<struct iovec> iov;
+};
+
+/**
+ * Overlaps block device file I/O with simulation. Ops are submitted from the
+ * driver thread and completed in any order; reap() marks finished ops done
+ * on the driver thread, so op state never needs to be shared.
+ *
+ * Two engines exist: io_uring (raw syscalls, no liburing dependency) and a
+ * small pool of threads doing pread/pwrite, used when io_uring is not
+ * available on the host (old kernels, seccomp'd containers).
+ */
+class blkdev_io_engine_t {
+public:
+  virtual ~blkdev_io_engine_t() = default;
+
+  virtual const char *name() const = 0;
+  // Start op together with everything in op->merged
+  virtual void submit(blkdev_io_op *op) = 0;
+  // Mark completed ops done. With wait set, blocks until at least one op
+  // completes (if any are in flight). Returns the number of ops completed.
+  virtual size_t reap(bool wait) = 0;
+  virtual size_t inflight() const = 0;
+
+  void drain() {
+    while (inflight())
+      reap(true);
+  }
+
+  // kind is "auto", "uring" or "threads". "auto" tries io_uring first.
+  // With dsync set, writes only complete once they are on stable storage.
+  static std::unique_ptr<blkdev_io_engine_t>
+  create(const char *kind, int fd, bool dsync, unsigned depth);
+};
+
+#endif // __ASYNC_IO_H
@@ -0,0 +1,245 @@
+// See LICENSE for license details
+
+#include "cached_image.h"
+#include "bridges/host_placement.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Read-ahead starts after this many reads in a row continue the last one
+#define SEQUENTIAL_THRESHOLD 2
+
+cached_image_t::cached_image_t(std::unique_ptr<disk_image_t> backing,
+                               const std::string &name,
+                               size_t cache_bytes,
+                               bool write_back,
+                               unsigned readahead_blocks)
+    : backing(std::move(backing)), name(name), write_back_policy(write_back),
+      readahead(readahead_blocks) {
+  _size = this->backing->size();
+
+  size_t nblocks = std::max(cache_bytes / BLOCK_BYTES, (size_t)4);
+  // Read-ahead must not be able to flush the whole cache
+  readahead = std::min(readahead, (unsigned)(nblocks / 4));
+
+  arena = (uint8_t *)placed_alloc(nblocks * BLOCK_BYTES, false);
+  if (!arena) {
+    fprintf(stderr,
+            "Could not allocate %zu MB blockdev cache\n",
+            (nblocks * BLOCK_BYTES) >> 20);
+    abort();
+  }
+  entries.resize(nblocks);
+  for (size_t i = 0; i < nblocks; i++) {
+    entries[i].data = arena + i * BLOCK_BYTES;
+    entries[i].lru = lru.insert(lru.end(), i);
+  }
+
+  if (readahead)
+    prefetch_thread = std::thread(&cached_image_t::prefetcher, this);
+}
+
+cached_image_t::~cached_image_t() {
+  if (prefetch_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    prefetch_cv.notify_all();
+    prefetch_thread.join();
+  }
+  sync();
+  print_stats();
+  free(arena);
+}
+
+void cached_image_t::print_stats() const {
+  uint64_t accesses = hits + misses;
+  printf("[INFO] %s cache: %" PRIu64 " hits (%" PRIu64
+         " from read-ahead), %" PRIu64 " misses, %.1f%% hit rate, %" PRIu64
+         " blocks prefetched, %" PRIu64 " evictions, %" PRIu64
+         " write-backs\n",
+         name.c_str(),
+         hits,
+         readahead_hits,
+         misses,
+         accesses ? 100.0 * hits / accesses : 0.0,
+         prefetches,
+         evictions,
+         write_backs);
+}
+
+cached_image_t::entry_t *
+cached_image_t::lookup(std::unique_lock<std::mutex> &lock, uint64_t block) {
+  auto it = index.find(block);
+  if (it == index.end())
+    return nullptr;
+  entry_t &e = entries[it->second];
+  // Loading entries cannot be evicted, so e stays this block
+  loaded_cv.wait(lock, [&] { return e.state != state_t::LOADING; });
+  return &e;
+}
+
+cached_image_t::entry_t &
+cached_image_t::allocate(std::unique_lock<std::mutex> &lock, uint64_t block) {
+  while (true) {
+    // Unused and least recently used entries are at the back
+    for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+      entry_t &e = entries[*it];
+      if (e.state == state_t::LOADING)
+        continue;
+      if (e.state == state_t::VALID) {
+        write_back(e);
+        index.erase(e.block);
+        evictions++;
+      }
+      e.block = block;
+      e.state = state_t::EMPTY;
+      e.dirty = false;
+      e.prefetched = false;
+      index[block] = *it;
+      touch(e);
+      return e;
+    }
+    // Everything is being loaded (only possible with a tiny cache)
+    loaded_cv.wait(lock);
+  }
+}
+
+void cached_image_t::fill(std::unique_lock<std::mutex> &lock, entry_t &e) {
+  e.state = state_t::LOADING;
+  lock.unlock();
+  {
+    std::lock_guard<std::mutex> guard(backing_mutex);
+    backing->read(e.block * BLOCK_BYTES, e.data, block_len(e.block));
+  }
+  lock.lock();
+  e.state = state_t::VALID;
+  loaded_cv.notify_all();
+}
+
+void cached_image_t::touch(entry_t &e) { lru.splice(lru.begin(), lru, e.lru); }
+
+void cached_image_t::write_back(entry_t &e) {
+  if (!e.dirty)
+    return;
+  std::lock_guard<std::mutex> guard(backing_mutex);
+  backing->write(e.block * BLOCK_BYTES, e.data, block_len(e.block));
+  e.dirty = false;
+  write_backs++;
+}
+
+void cached_image_t::note_access(uint64_t first, uint64_t last) {
+  bool sequential = first == last_block || first == last_block + 1;
+  sequential_run = sequential ? sequential_run + 1 : 0;
+  last_block = last;
+  if (!sequential)
+    prefetch_horizon = 0;
+  if (!readahead || sequential_run < SEQUENTIAL_THRESHOLD)
+    return;
+
+  uint64_t nblocks = (_size + BLOCK_BYTES - 1) / BLOCK_BYTES;
+  uint64_t from = std::max(last + 1, prefetch_horizon);
+  uint64_t to = std::min(last + 1 + readahead, nblocks);
+  for (uint64_t block = from; block < to; block++) {
+    if (!index.count(block))
+      prefetch_queue.push_back(block);
+  }
+  if (from < to) {
+    prefetch_horizon = to;
+    prefetch_cv.notify_one();
+  }
+}
+
+void cached_image_t::prefetcher() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    prefetch_cv.wait(lock, [this] { return stop || !prefetch_queue.empty(); });
+    if (stop)
+      return;
+    uint64_t block = prefetch_queue.front();
+    prefetch_queue.pop_front();
+    if (index.count(block))
+      continue;
+    entry_t &e = allocate(lock, block);
+    e.prefetched = true;
+    prefetches++;
+    fill(lock, e);
+  }
+}
+
+void cached_image_t::read(uint64_t offset, void *dst, size_t len) {
+  std::unique_lock<std::mutex> lock(mutex);
+  uint8_t *out = (uint8_t *)dst;
+  uint64_t first = offset / BLOCK_BYTES;
+  uint64_t last = (offset + len - 1) / BLOCK_BYTES;
+  for (uint64_t block = first; block <= last; block++) {
+    entry_t *e = lookup(lock, block);
+    if (e) {
+      hits++;
+      if (e->prefetched) {
+        readahead_hits++;
+        e->prefetched = false;
+      }
+    } else {
+      misses++;
+      e = &allocate(lock, block);
+      fill(lock, *e);
+    }
+    touch(*e);
+
+    uint64_t start = std::max(offset, block * BLOCK_BYTES);
+    uint64_t end = std::min(offset + len, block * BLOCK_BYTES + BLOCK_BYTES);
+    memcpy(out, e->data + (start - block * BLOCK_BYTES), end - start);
+    out += end - start;
+  }
+  note_access(first, last);
+}
+
+void cached_image_t::write(uint64_t offset, const void *src, size_t len) {
+  std::unique_lock<std::mutex> lock(mutex);
+  const uint8_t *in = (const uint8_t *)src;
+  uint64_t first = offset / BLOCK_BYTES;
+  uint64_t last = (offset + len - 1) / BLOCK_BYTES;
+  for (uint64_t block = first; block <= last; block++) {
+    uint64_t start = std::max(offset, block * BLOCK_BYTES);
+    uint64_t end = std::min(offset + len, block * BLOCK_BYTES + BLOCK_BYTES);
+
+    entry_t *e = lookup(lock, block);
+    if (!e && write_back_policy) {
+      // Write-allocate. Blocks that are only partly overwritten are read in
+      // first.
+      e = &allocate(lock, block);
+      if (end - start == block_len(block))
+        e->state = state_t::VALID;
+      else
+        fill(lock, *e);
+    }
+    if (e) {
+      memcpy(e->data + (start - block * BLOCK_BYTES), in, end - start);
+      e->dirty |= write_back_policy;
+      e->prefetched = false;
+      touch(*e);
+    }
+    in += end - start;
+  }
+
+  // Holding mutex keeps the prefetcher from loading a stale copy of these
+  // blocks in the meantime
+  if (!write_back_policy) {
+    std::lock_guard<std::mutex> guard(backing_mutex);
+    backing->write(offset, src, len);
+  }
+}
+
+void cached_image_t::sync() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &e : entries) {
+    if (e.state == state_t::VALID)
+      write_back(e);
+  }
+  std::lock_guard<std::mutex> guard(backing_mutex);
+  backing->sync();
+}
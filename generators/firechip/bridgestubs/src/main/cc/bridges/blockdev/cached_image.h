@@ -0,0 +1,99 @@
+// See LICENSE for license details
+#ifndef __CACHED_IMAGE_H
+#define __CACHED_IMAGE_H
+
+#include "disk_image.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * LRU cache of fixed-size blocks in front of another image, for images on
+ * slow (network) storage. Once a run of sequential reads is seen, the
+ * following blocks are fetched by a background thread so that the target
+ * finds them in the cache.
+ *
+ * Writes either go straight through to the backing image (write-through,
+ * no allocation) or are held in the cache until the block is evicted or the
+ * image is synced (write-back).
+ */
+class cached_image_t : public disk_image_t {
+public:
+  static constexpr size_t BLOCK_BYTES = 64 << 10;
+
+  cached_image_t(std::unique_ptr<disk_image_t> backing,
+                 const std::string &name,
+                 size_t cache_bytes,
+                 bool write_back,
+                 unsigned readahead_blocks);
+  ~cached_image_t() override;
+
+  void read(uint64_t offset, void *dst, size_t len) override;
+  void write(uint64_t offset, const void *src, size_t len) override;
+
+  void sync() override;
+
+  void print_stats() const;
+
+private:
+  enum class state_t { EMPTY, LOADING, VALID };
+
+  struct entry_t {
+    uint64_t block = 0;
+    uint8_t *data = nullptr;
+    state_t state = state_t::EMPTY;
+    bool dirty = false;
+    bool prefetched = false; // loaded by read-ahead and not yet used
+    std::list<size_t>::iterator lru;
+  };
+
+  size_t block_len(uint64_t block) const {
+    return std::min(BLOCK_BYTES, _size - block * BLOCK_BYTES);
+  }
+
+  // All of these expect mutex to be held. lookup() and fill() may drop it
+  // while waiting for a block to load.
+  entry_t *lookup(std::unique_lock<std::mutex> &lock, uint64_t block);
+  entry_t &allocate(std::unique_lock<std::mutex> &lock, uint64_t block);
+  void fill(std::unique_lock<std::mutex> &lock, entry_t &e);
+  void touch(entry_t &e);
+  void write_back(entry_t &e);
+  void note_access(uint64_t first, uint64_t last);
+
+  void prefetcher();
+
+  std::unique_ptr<disk_image_t> backing;
+  std::string name;
+  bool write_back_policy;
+  unsigned readahead;
+
+  std::mutex mutex;
+  std::condition_variable loaded_cv, prefetch_cv;
+  // Serializes access to the backing image between the driver and the
+  // prefetch thread
+  std::mutex backing_mutex;
+  uint8_t *arena = nullptr;
+  std::vector<entry_t> entries;
+  std::unordered_map<uint64_t, size_t> index;
+  std::list<size_t> lru; // most recently used first
+  std::deque<uint64_t> prefetch_queue;
+  // Sequential read detection
+  uint64_t last_block = UINT64_MAX;
+  unsigned sequential_run = 0;
+  uint64_t prefetch_horizon = 0; // first block not yet queued for read-ahead
+  bool stop = false;
+  std::thread prefetch_thread;
+
+  uint64_t hits = 0, misses = 0, readahead_hits = 0;
+  uint64_t prefetches = 0, evictions = 0, write_backs = 0;
+};
+
+#endif // __CACHED_IMAGE_H
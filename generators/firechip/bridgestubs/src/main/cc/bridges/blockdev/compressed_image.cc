@@ -0,0 +1,141 @@
+// See LICENSE for license details
+
+#include "compressed_image.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define COMPRESSED_HEADER_BYTES 4096
+
+struct compressed_header_t {
+  char magic[8];
+  uint64_t size;
+  uint64_t chunk_bytes;
+  uint64_t nchunks;
+};
+
+compressed_image_t::compressed_image_t(const char *filename,
+                                       size_t cache_chunks)
+    : name(filename), cache_chunks(std::max<size_t>(cache_chunks, 1)) {
+  _fd = open(filename, O_RDONLY);
+  if (_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    abort();
+  }
+
+  compressed_header_t header;
+  pread_all(_fd, &header, sizeof(header), 0, filename);
+  if (memcmp(header.magic, COMPRESSED_IMAGE_MAGIC, sizeof(header.magic)) ||
+      header.chunk_bytes == 0 || header.chunk_bytes % 512 ||
+      header.nchunks !=
+          (header.size + header.chunk_bytes - 1) / header.chunk_bytes) {
+    fprintf(stderr, "%s is not a valid compressed image\n", filename);
+    abort();
+  }
+  _size = header.size & ~(uint64_t)(512 - 1);
+  chunk_bytes = header.chunk_bytes;
+
+  index.resize(header.nchunks + 1);
+  pread_all(_fd,
+            index.data(),
+            index.size() * sizeof(uint64_t),
+            COMPRESSED_HEADER_BYTES,
+            filename);
+  for (uint64_t i = 0; i < header.nchunks; i++) {
+    if (index[i + 1] < index[i] || index[i + 1] - index[i] > chunk_len(i)) {
+      fprintf(stderr,
+              "Compressed image %s has a bad index entry for chunk %" PRIu64
+              "\n",
+              filename,
+              i);
+      abort();
+    }
+  }
+  compressed.resize(chunk_bytes);
+
+  printf("[INFO] Compressed image %s: %" PRIu64 " bytes in %" PRIu64
+         " bytes\n",
+         filename,
+         header.size,
+         index.back() - index.front());
+}
+
+compressed_image_t::~compressed_image_t() {
+  printf("[INFO] Compressed image %s: %" PRIu64 " chunk hits, %" PRIu64
+         " chunks decompressed\n",
+         name.c_str(),
+         hits,
+         misses);
+  close(_fd);
+}
+
+/* Return a chunk's data, decompressing it into the cache if needed */
+const uint8_t *compressed_image_t::get_chunk(uint64_t chunk) {
+  auto it = cache.find(chunk);
+  if (it != cache.end()) {
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->data.data();
+  }
+  misses++;
+
+  // Reuse the least recently used buffer once the cache is full
+  if (cache.size() >= cache_chunks) {
+    cache.erase(lru.back().chunk);
+    lru.splice(lru.begin(), lru, std::prev(lru.end()));
+  } else {
+    lru.emplace_front();
+    lru.front().data.resize(chunk_bytes);
+  }
+  entry_t &e = lru.front();
+  e.chunk = chunk;
+  cache[chunk] = lru.begin();
+
+  size_t len = chunk_len(chunk);
+  size_t stored = index[chunk + 1] - index[chunk];
+  if (stored == 0) {
+    memset(e.data.data(), 0, len);
+  } else if (stored == len) {
+    pread_all(_fd, e.data.data(), len, index[chunk], name.c_str());
+  } else {
+    pread_all(_fd, compressed.data(), stored, index[chunk], name.c_str());
+    uLongf out_len = len;
+    int ret = uncompress(e.data.data(), &out_len, compressed.data(), stored);
+    if (ret != Z_OK || out_len != len) {
+      fprintf(stderr,
+              "Could not decompress chunk %" PRIu64 " of %s (%d)\n",
+              chunk,
+              name.c_str(),
+              ret);
+      abort();
+    }
+  }
+  return e.data.data();
+}
+
+void compressed_image_t::read(uint64_t offset, void *dst, size_t len) {
+  uint8_t *out = (uint8_t *)dst;
+  while (len) {
+    uint64_t chunk = offset / chunk_bytes;
+    uint64_t in_chunk = offset % chunk_bytes;
+    size_t n = std::min<uint64_t>(len, chunk_bytes - in_chunk);
+    memcpy(out, get_chunk(chunk) + in_chunk, n);
+    out += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+void compressed_image_t::write(uint64_t offset, const void *, size_t) {
+  fprintf(stderr,
+          "Write to read-only compressed image %s at %" PRIx64
+          " (use +blkdev-overlay)\n",
+          name.c_str(),
+          offset);
+  abort();
+}
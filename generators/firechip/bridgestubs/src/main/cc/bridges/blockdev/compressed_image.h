@@ -0,0 +1,64 @@
+// See LICENSE for license details
+#ifndef __COMPRESSED_IMAGE_H
+#define __COMPRESSED_IMAGE_H
+
+#include "disk_image.h"
+
+#include <algorithm>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define COMPRESSED_IMAGE_MAGIC "FSZIMG01"
+
+/**
+ * Read-only image made of independently zlib-compressed chunks, for keeping
+ * archived disks small. Decompressed chunks are kept in a small LRU cache,
+ * as requests are much smaller than a chunk. Use +blkdev-overlay to give the
+ * target a writable view.
+ *
+ *   [0, 4K)                       header (magic, size in bytes, chunk size)
+ *   [4K, 4K + 8 * (nchunks + 1))  chunk index: chunk i is stored in
+ *                                 [index[i], index[i + 1])
+ *   [..., EOF)                    chunk data
+ *
+ * A chunk stored in 0 bytes is all zeros and one stored at full size is not
+ * compressed. scripts/blkdev-image.py creates these from raw images.
+ */
+class compressed_image_t : public disk_image_t {
+public:
+  compressed_image_t(const char *filename, size_t cache_chunks);
+  ~compressed_image_t() override;
+
+  compressed_image_t(const compressed_image_t &) = delete;
+  compressed_image_t &operator=(const compressed_image_t &) = delete;
+
+  void read(uint64_t offset, void *dst, size_t len) override;
+  void write(uint64_t offset, const void *src, size_t len) override;
+
+private:
+  struct entry_t {
+    uint64_t chunk;
+    std::vector<uint8_t> data;
+  };
+
+  size_t chunk_len(uint64_t chunk) const {
+    return std::min<uint64_t>(chunk_bytes, _size - chunk * chunk_bytes);
+  }
+  const uint8_t *get_chunk(uint64_t chunk);
+
+  std::string name;
+  int _fd = -1;
+  uint64_t chunk_bytes = 0;
+  std::vector<uint64_t> index;
+
+  size_t cache_chunks;
+  std::list<entry_t> lru; // most recently used first
+  std::unordered_map<uint64_t, std::list<entry_t>::iterator> cache;
+  std::vector<uint8_t> compressed; // staging buffer for one chunk
+
+  uint64_t hits = 0, misses = 0;
+};
+
+#endif // __COMPRESSED_IMAGE_H
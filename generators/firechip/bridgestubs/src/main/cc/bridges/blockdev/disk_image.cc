@@ -0,0 +1,193 @@
+// See LICENSE for license details
+
+#include "disk_image.h"
+#include "compressed_image.h"
+#include "sparse_image.h"
+#include "striped_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#define SECTOR_MASK ((size_t)512 - 1)
+// Decompressed chunks kept by compressed images
+#define COMPRESSED_CACHE_CHUNKS 64
+
+msync_policy_t parse_msync_policy(const char *policy) {
+  if (!strcmp(policy, "none"))
+    return msync_policy_t::NONE;
+  if (!strcmp(policy, "async"))
+    return msync_policy_t::ASYNC;
+  if (!strcmp(policy, "sync"))
+    return msync_policy_t::SYNC;
+  fprintf(stderr,
+          "Unknown blockdev msync policy \"%s\" (expected none, async or "
+          "sync)\n",
+          policy);
+  abort();
+}
+
+mmap_image_t::mmap_image_t(const char *filename, msync_policy_t policy)
+    : _policy(policy) {
+  _fd = open(filename, O_RDWR);
+  if (_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    abort();
+  }
+
+  struct stat st;
+  if (fstat(_fd, &st)) {
+    perror("fstat");
+    abort();
+  }
+  _size = st.st_size & ~SECTOR_MASK;
+  if (_size == 0)
+    return;
+
+  void *data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    abort();
+  }
+  _data = (uint8_t *)data;
+  // Guest accesses are mostly sequential runs of sectors
+  madvise(_data, _size, MADV_SEQUENTIAL);
+}
+
+mmap_image_t::mmap_image_t(size_t size) {
+  _size = size;
+  if (_size == 0)
+    return;
+
+  void *data = mmap(nullptr,
+                    _size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    abort();
+  }
+  _data = (uint8_t *)data;
+}
+
+mmap_image_t::~mmap_image_t() {
+  sync();
+  if (_data)
+    munmap(_data, _size);
+  if (_fd >= 0)
+    close(_fd);
+}
+
+void mmap_image_t::read(uint64_t offset, void *dst, size_t len) {
+  memcpy(dst, _data + offset, len);
+}
+
+void mmap_image_t::write(uint64_t offset, const void *src, size_t len) {
+  memcpy(_data + offset, src, len);
+  _dirty = true;
+}
+
+void mmap_image_t::sync() {
+  if (_fd < 0 || !_dirty || _policy == msync_policy_t::NONE)
+    return;
+
+  int flags = _policy == msync_policy_t::SYNC ? MS_SYNC : MS_ASYNC;
+  if (msync(_data, _size, flags)) {
+    perror("msync");
+    abort();
+  }
+  _dirty = false;
+}
+
+image_format_t detect_image_format(const char *filename) {
+  if (strchr(filename, ','))
+    return image_format_t::STRIPED;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    abort();
+  }
+  char magic[8];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  close(fd);
+
+  if (n == sizeof(magic) && !memcmp(magic, SPARSE_IMAGE_MAGIC, sizeof(magic)))
+    return image_format_t::SPARSE;
+  if (n == sizeof(magic) &&
+      !memcmp(magic, COMPRESSED_IMAGE_MAGIC, sizeof(magic)))
+    return image_format_t::COMPRESSED;
+  return image_format_t::RAW;
+}
+
+std::unique_ptr<disk_image_t> open_disk_image(const char *filename,
+                                              msync_policy_t policy,
+                                              size_t stripe_bytes) {
+  switch (detect_image_format(filename)) {
+  case image_format_t::SPARSE:
+    return std::make_unique<sparse_image_t>(filename, policy);
+  case image_format_t::COMPRESSED:
+    return std::make_unique<compressed_image_t>(filename,
+                                                COMPRESSED_CACHE_CHUNKS);
+  case image_format_t::STRIPED: {
+    std::vector<std::string> files;
+    std::string list(filename);
+    for (size_t start = 0, end; start <= list.size(); start = end + 1) {
+      end = list.find(',', start);
+      if (end == std::string::npos)
+        end = list.size();
+      files.push_back(list.substr(start, end - start));
+    }
+    return std::make_unique<striped_image_t>(files, stripe_bytes, policy);
+  }
+  case image_format_t::RAW:
+    break;
+  }
+  return std::make_unique<mmap_image_t>(filename, policy);
+}
+
+void pread_all(int fd, void *buf, size_t len, uint64_t offset, const char *name) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      fprintf(stderr,
+              "Could not read %s: %s\n",
+              name,
+              n ? strerror(errno) : "unexpected end of file");
+      abort();
+    }
+    p += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+void pwrite_all(
+    int fd, const void *buf, size_t len, uint64_t offset, const char *name) {
+  const uint8_t *p = (const uint8_t *)buf;
+  while (len) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      fprintf(stderr, "Could not write %s: %s\n", name, strerror(errno));
+      abort();
+    }
+    p += n;
+    offset += n;
+    len -= n;
+  }
+}
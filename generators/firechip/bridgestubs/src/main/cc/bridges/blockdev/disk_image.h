@@ -0,0 +1,111 @@
+// See LICENSE for license details
+#ifndef __DISK_IMAGE_H
+#define __DISK_IMAGE_H
+
+#include "async_io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+// What to do with dirty pages of a file-backed image when the simulation
+// finishes.
+enum class msync_policy_t {
+  NONE,  // leave write-back to the kernel (matches the old stdio behavior)
+  ASYNC, // schedule write-back but do not wait for it
+  SYNC,  // block until the image is on stable storage
+};
+
+// Parses none|async|sync. Aborts on anything else.
+msync_policy_t parse_msync_policy(const char *policy);
+
+// Backing store of a block device. Offsets and lengths are in bytes and
+// callers are expected to have bounds-checked the request.
+class disk_image_t {
+public:
+  virtual ~disk_image_t() = default;
+
+  size_t size() const { return _size; }
+  // A single file holding the whole image that may be accessed directly with
+  // pread/pwrite, or -1 if there is none
+  virtual int fd() const { return -1; }
+
+  virtual void read(uint64_t offset, void *dst, size_t len) = 0;
+  virtual void write(uint64_t offset, const void *src, size_t len) = 0;
+  // For writes that went to fd() directly rather than through write()
+  virtual void mark_dirty() {}
+
+  // Apply the msync policy. Called on finish and from the destructor.
+  virtual void sync() {}
+
+  // Engine for reading and writing the image in the background, or nullptr
+  // if it can only be accessed through read() and write()
+  virtual std::unique_ptr<blkdev_io_engine_t>
+  make_io_engine(const char *kind, bool dsync, unsigned depth) {
+    if (fd() < 0)
+      return nullptr;
+    return blkdev_io_engine_t::create(kind, fd(), dsync, depth);
+  }
+
+protected:
+  size_t _size = 0;
+};
+
+/**
+ * A block device image mapped into the driver's address space. Requests copy
+ * sectors straight between the mapping and the bridge's request buffers; the
+ * kernel page cache does the rest.
+ *
+ * An image is either a file opened read-write and mapped MAP_SHARED, or an
+ * anonymous zero-filled mapping (+blkdev-in-mem) for testing.
+ */
+class mmap_image_t : public disk_image_t {
+public:
+  // Map an existing file. Trailing bytes beyond the last full sector are not
+  // mapped.
+  mmap_image_t(const char *filename, msync_policy_t policy);
+  // Anonymous in-memory image of the given size in bytes
+  explicit mmap_image_t(size_t size);
+  ~mmap_image_t() override;
+
+  mmap_image_t(const mmap_image_t &) = delete;
+  mmap_image_t &operator=(const mmap_image_t &) = delete;
+
+  int fd() const override { return _fd; }
+
+  void read(uint64_t offset, void *dst, size_t len) override;
+  void write(uint64_t offset, const void *src, size_t len) override;
+  void mark_dirty() override { _dirty = true; }
+
+  void sync() override;
+
+private:
+  uint8_t *_data = nullptr;
+  int _fd = -1;
+  msync_policy_t _policy = msync_policy_t::NONE;
+  bool _dirty = false;
+};
+
+// Image file formats, told apart by the magic at the start of the file
+enum class image_format_t {
+  RAW,
+  SPARSE,     // sparse_image_t
+  COMPRESSED, // compressed_image_t
+  STRIPED,    // striped_image_t: a comma-separated list of raw files
+};
+
+image_format_t detect_image_format(const char *filename);
+
+// Open an image file with the backend for its format. stripe_bytes is the
+// chunk size of striped images.
+std::unique_ptr<disk_image_t> open_disk_image(const char *filename,
+                                              msync_policy_t policy,
+                                              size_t stripe_bytes = 64 << 10);
+
+// pread/pwrite exactly len bytes or abort, naming the file
+void pread_all(int fd, void *buf, size_t len, uint64_t offset, const char *name);
+void pwrite_all(
+    int fd, const void *buf, size_t len, uint64_t offset, const char *name);
+
+#endif // __DISK_IMAGE_H
@@ -0,0 +1,246 @@
+// See LICENSE for license details
+
+#include "overlay_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OVERLAY_SECTOR 512
+#define OVERLAY_HEADER_BYTES 4096
+#define OVERLAY_MAGIC "FSOVRLY1"
+
+struct overlay_header_t {
+  char magic[8];
+  uint64_t nsectors;
+};
+
+overlay_policy_t parse_overlay_policy(const char *policy) {
+  if (!strcmp(policy, "keep"))
+    return overlay_policy_t::KEEP;
+  if (!strcmp(policy, "discard"))
+    return overlay_policy_t::DISCARD;
+  if (!strcmp(policy, "commit"))
+    return overlay_policy_t::COMMIT;
+  fprintf(stderr,
+          "Unknown blockdev overlay policy \"%s\" (expected keep, discard or "
+          "commit)\n",
+          policy);
+  abort();
+}
+
+static void *map_file(int fd, size_t size, int prot, const char *name) {
+  void *data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", name, strerror(errno));
+    abort();
+  }
+  return data;
+}
+
+overlay_image_t::overlay_image_t(const char *base_path,
+                                 const char *delta,
+                                 overlay_policy_t policy,
+                                 msync_policy_t msync)
+    : delta_path(delta), policy(policy), msync_policy(msync) {
+  bool writable_base = policy == overlay_policy_t::COMMIT;
+  base_fd = open(base_path, writable_base ? O_RDWR : O_RDONLY);
+  if (base_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", base_path);
+    abort();
+  }
+  struct stat st;
+  if (fstat(base_fd, &st)) {
+    perror("fstat");
+    abort();
+  }
+  _size = st.st_size & ~((size_t)OVERLAY_SECTOR - 1);
+  uint64_t nsectors = _size / OVERLAY_SECTOR;
+  if (nsectors == 0) {
+    fprintf(stderr, "Base image %s is smaller than a sector\n", base_path);
+    abort();
+  }
+  base = (uint8_t *)map_file(base_fd,
+                             _size,
+                             PROT_READ | (writable_base ? PROT_WRITE : 0),
+                             base_path);
+  open_delta(base_path);
+}
+
+overlay_image_t::overlay_image_t(
+    std::unique_ptr<disk_image_t> base_img,
+    const char *base_name,
+    const char *delta,
+    overlay_policy_t policy,
+    msync_policy_t msync)
+    : delta_path(delta), policy(policy), msync_policy(msync),
+      base_image(std::move(base_img)) {
+  _size = base_image->size();
+  if (_size == 0) {
+    fprintf(stderr, "Base image %s is smaller than a sector\n", base_name);
+    abort();
+  }
+  open_delta(base_name);
+}
+
+/* Create or resume the delta file for a base of _size bytes */
+void overlay_image_t::open_delta(const char *base_path) {
+  const char *delta = delta_path.c_str();
+  uint64_t nsectors = _size / OVERLAY_SECTOR;
+  size_t bitmap_bytes = ((nsectors + 63) / 64) * sizeof(uint64_t);
+  delta_size = OVERLAY_HEADER_BYTES + _size + bitmap_bytes;
+
+  int flags = O_RDWR | O_CREAT;
+  if (policy == overlay_policy_t::DISCARD)
+    flags |= O_TRUNC;
+  delta_fd = open(delta, flags, 0644);
+  if (delta_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", delta);
+    abort();
+  }
+  struct stat st;
+  if (fstat(delta_fd, &st)) {
+    perror("fstat");
+    abort();
+  }
+  bool fresh = st.st_size == 0;
+  if (fresh && ftruncate(delta_fd, delta_size)) {
+    perror("ftruncate");
+    abort();
+  }
+  if (!fresh && (size_t)st.st_size != delta_size) {
+    fprintf(stderr,
+            "Overlay %s does not match base image %s (%zu bytes, expected "
+            "%zu)\n",
+            delta,
+            base_path,
+            (size_t)st.st_size,
+            delta_size);
+    abort();
+  }
+  this->delta =
+      (uint8_t *)map_file(delta_fd, delta_size, PROT_READ | PROT_WRITE, delta);
+
+  overlay_header_t *header = (overlay_header_t *)this->delta;
+  if (fresh) {
+    memcpy(header->magic, OVERLAY_MAGIC, sizeof(header->magic));
+    header->nsectors = nsectors;
+  } else if (memcmp(header->magic, OVERLAY_MAGIC, sizeof(header->magic)) ||
+             header->nsectors != nsectors) {
+    fprintf(stderr, "%s is not an overlay of %s\n", delta, base_path);
+    abort();
+  }
+  delta_data = this->delta + OVERLAY_HEADER_BYTES;
+  bitmap = (uint64_t *)(delta_data + _size);
+
+  if (!fresh) {
+    uint64_t held = 0;
+    for (size_t i = 0; i < bitmap_bytes / sizeof(uint64_t); i++)
+      held += __builtin_popcountll(bitmap[i]);
+    printf("[INFO] Resuming overlay %s (%" PRIu64 " of %" PRIu64
+           " sectors written)\n",
+           delta,
+           held,
+           nsectors);
+  }
+}
+
+overlay_image_t::~overlay_image_t() {
+  switch (policy) {
+  case overlay_policy_t::KEEP:
+    sync();
+    break;
+  case overlay_policy_t::COMMIT:
+    commit();
+    // fallthrough
+  case overlay_policy_t::DISCARD:
+    if (unlink(delta_path.c_str()))
+      perror("unlink");
+    break;
+  }
+  munmap(delta, delta_size);
+  if (base)
+    munmap(base, _size);
+  close(delta_fd);
+  if (base_fd >= 0)
+    close(base_fd);
+}
+
+void overlay_image_t::read(uint64_t offset, void *dst, size_t len) {
+  uint8_t *out = (uint8_t *)dst;
+  uint64_t sector = offset / OVERLAY_SECTOR;
+  uint64_t end = (offset + len) / OVERLAY_SECTOR;
+  // Copy runs of sectors that come from the same file
+  while (sector < end) {
+    bool from_delta = in_delta(sector);
+    uint64_t run = sector + 1;
+    while (run < end && in_delta(run) == from_delta)
+      run++;
+    size_t bytes = (run - sector) * OVERLAY_SECTOR;
+    if (from_delta) {
+      memcpy(out, delta_data + sector * OVERLAY_SECTOR, bytes);
+    } else if (base) {
+      memcpy(out, base + sector * OVERLAY_SECTOR, bytes);
+    } else {
+      base_image->read(sector * OVERLAY_SECTOR, out, bytes);
+    }
+    out += bytes;
+    sector = run;
+  }
+}
+
+void overlay_image_t::write(uint64_t offset, const void *src, size_t len) {
+  memcpy(delta_data + offset, src, len);
+  uint64_t end = (offset + len) / OVERLAY_SECTOR;
+  for (uint64_t sector = offset / OVERLAY_SECTOR; sector < end; sector++)
+    bitmap[sector / 64] |= 1ULL << (sector % 64);
+  dirty = true;
+}
+
+void overlay_image_t::sync() {
+  if (!dirty || msync_policy == msync_policy_t::NONE)
+    return;
+
+  int flags = msync_policy == msync_policy_t::SYNC ? MS_SYNC : MS_ASYNC;
+  if (msync(delta, delta_size, flags)) {
+    perror("msync");
+    abort();
+  }
+  dirty = false;
+}
+
+void overlay_image_t::commit() {
+  uint64_t nsectors = _size / OVERLAY_SECTOR;
+  uint64_t committed = 0;
+  for (uint64_t sector = 0; sector < nsectors; sector++) {
+    if (!in_delta(sector))
+      continue;
+    if (base) {
+      memcpy(base + sector * OVERLAY_SECTOR,
+             delta_data + sector * OVERLAY_SECTOR,
+             OVERLAY_SECTOR);
+    } else {
+      base_image->write(sector * OVERLAY_SECTOR,
+                        delta_data + sector * OVERLAY_SECTOR,
+                        OVERLAY_SECTOR);
+    }
+    committed++;
+  }
+  // The delta is deleted next, so the base has to be on disk first. Other
+  // backends are opened with the sync msync policy for committing.
+  if (committed && base && msync(base, _size, MS_SYNC)) {
+    perror("msync");
+    abort();
+  }
+  if (committed && base_image)
+    base_image->sync();
+  printf("[INFO] Committed %" PRIu64 " sectors from overlay %s\n",
+         committed,
+         delta_path.c_str());
+}
@@ -0,0 +1,76 @@
+// See LICENSE for license details
+#ifndef __OVERLAY_IMAGE_H
+#define __OVERLAY_IMAGE_H
+
+#include "disk_image.h"
+
+#include <memory>
+#include <string>
+
+// What happens to an overlay's delta when the simulation exits
+enum class overlay_policy_t {
+  KEEP,    // leave the delta in place; the next run resumes from it
+  DISCARD, // start from an empty delta and delete it at exit
+  COMMIT,  // write the delta back into the base image, then delete it
+};
+
+// Parses keep|discard|commit. Aborts on anything else.
+overlay_policy_t parse_overlay_policy(const char *policy);
+
+/**
+ * Copy-on-write view of a shared base image. The base is mapped read-only
+ * (unless the delta is to be committed), so any number of simulations can
+ * share one copy in the host page cache. Writes go to a per-simulation delta
+ * file, which is sparse and only occupies space for sectors actually
+ * written:
+ *
+ *   [0, 4K)                 header (magic, sector count)
+ *   [4K, 4K + size)         sector data, at the same offset as in the base
+ *   [4K + size, ...)        bitmap of sectors held by the delta
+ *
+ * Sparse and compressed bases are read through their own backend instead of
+ * being mapped.
+ */
+class overlay_image_t : public disk_image_t {
+public:
+  overlay_image_t(const char *base,
+                  const char *delta,
+                  overlay_policy_t policy,
+                  msync_policy_t msync);
+  overlay_image_t(std::unique_ptr<disk_image_t> base_img,
+                  const char *base_name,
+                  const char *delta,
+                  overlay_policy_t policy,
+                  msync_policy_t msync);
+  ~overlay_image_t() override;
+
+  overlay_image_t(const overlay_image_t &) = delete;
+  overlay_image_t &operator=(const overlay_image_t &) = delete;
+
+  void read(uint64_t offset, void *dst, size_t len) override;
+  void write(uint64_t offset, const void *src, size_t len) override;
+
+  void sync() override;
+
+private:
+  bool in_delta(uint64_t sector) const {
+    return (bitmap[sector / 64] >> (sector % 64)) & 1;
+  }
+  void open_delta(const char *base_name);
+  void commit();
+
+  std::string delta_path;
+  overlay_policy_t policy;
+  msync_policy_t msync_policy;
+  int base_fd = -1, delta_fd = -1;
+  uint8_t *base = nullptr;
+  // Set instead of base for bases that are not raw images
+  std::unique_ptr<disk_image_t> base_image;
+  uint8_t *delta = nullptr;
+  size_t delta_size = 0;
+  uint8_t *delta_data = nullptr;
+  uint64_t *bitmap = nullptr;
+  bool dirty = false;
+};
+
+#endif // __OVERLAY_IMAGE_H
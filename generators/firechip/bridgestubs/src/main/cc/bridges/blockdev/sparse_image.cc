@@ -0,0 +1,140 @@
+// See LICENSE for license details
+
+#include "sparse_image.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define SPARSE_HEADER_BYTES 4096
+
+struct sparse_header_t {
+  char magic[8];
+  uint64_t size;
+  uint64_t chunk_bytes;
+  uint64_t nchunks;
+};
+
+static bool all_zero(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    if (data[i])
+      return false;
+  return true;
+}
+
+sparse_image_t::sparse_image_t(const char *filename, msync_policy_t policy)
+    : name(filename), policy(policy) {
+  _fd = open(filename, O_RDWR);
+  if (_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    abort();
+  }
+
+  sparse_header_t header;
+  pread_all(_fd, &header, sizeof(header), 0, filename);
+  if (memcmp(header.magic, SPARSE_IMAGE_MAGIC, sizeof(header.magic)) ||
+      header.chunk_bytes == 0 || header.chunk_bytes % 512 ||
+      header.nchunks !=
+          (header.size + header.chunk_bytes - 1) / header.chunk_bytes) {
+    fprintf(stderr, "%s is not a valid sparse image\n", filename);
+    abort();
+  }
+  _size = header.size & ~(uint64_t)(512 - 1);
+  chunk_bytes = header.chunk_bytes;
+
+  chunk_map.resize(header.nchunks);
+  pread_all(_fd,
+            chunk_map.data(),
+            chunk_map.size() * sizeof(uint64_t),
+            SPARSE_HEADER_BYTES,
+            filename);
+
+  // New chunks go after everything already in the file
+  file_end = SPARSE_HEADER_BYTES + chunk_map.size() * sizeof(uint64_t);
+  uint64_t allocated = 0;
+  for (auto off : chunk_map) {
+    if (off) {
+      file_end = std::max(file_end, off + chunk_bytes);
+      allocated++;
+    }
+  }
+  printf("[INFO] Sparse image %s: %" PRIu64 " of %zu chunks allocated\n",
+         filename,
+         allocated,
+         chunk_map.size());
+}
+
+sparse_image_t::~sparse_image_t() {
+  sync();
+  close(_fd);
+}
+
+void sparse_image_t::read(uint64_t offset, void *dst, size_t len) {
+  uint8_t *out = (uint8_t *)dst;
+  while (len) {
+    uint64_t chunk = offset / chunk_bytes;
+    uint64_t in_chunk = offset % chunk_bytes;
+    size_t n = std::min<uint64_t>(len, chunk_bytes - in_chunk);
+    if (chunk_map[chunk]) {
+      pread_all(_fd, out, n, chunk_map[chunk] + in_chunk, name.c_str());
+    } else {
+      memset(out, 0, n);
+    }
+    out += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+void sparse_image_t::write(uint64_t offset, const void *src, size_t len) {
+  const uint8_t *in = (const uint8_t *)src;
+  while (len) {
+    uint64_t chunk = offset / chunk_bytes;
+    uint64_t in_chunk = offset % chunk_bytes;
+    size_t n = std::min<uint64_t>(len, chunk_bytes - in_chunk);
+    if (!chunk_map[chunk] && !all_zero(in, n)) {
+      // Extend the file by a whole chunk so that the rest of it reads back
+      // as zeros, then point the map at it once the data is in place
+      uint64_t at = file_end;
+      file_end += chunk_bytes;
+      if (ftruncate(_fd, file_end)) {
+        perror("ftruncate");
+        abort();
+      }
+      pwrite_all(_fd, in, n, at + in_chunk, name.c_str());
+      chunk_map[chunk] = at;
+      pwrite_all(_fd,
+                 &chunk_map[chunk],
+                 sizeof(uint64_t),
+                 SPARSE_HEADER_BYTES + chunk * sizeof(uint64_t),
+                 name.c_str());
+      dirty = true;
+    } else if (chunk_map[chunk]) {
+      pwrite_all(_fd, in, n, chunk_map[chunk] + in_chunk, name.c_str());
+      dirty = true;
+    }
+    in += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+void sparse_image_t::sync() {
+  if (!dirty || policy == msync_policy_t::NONE)
+    return;
+
+  int ret = policy == msync_policy_t::SYNC
+                ? fdatasync(_fd)
+                : sync_file_range(_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  if (ret) {
+    perror("sync");
+    abort();
+  }
+  dirty = false;
+}
@@ -0,0 +1,48 @@
+// See LICENSE for license details
+#ifndef __SPARSE_IMAGE_H
+#define __SPARSE_IMAGE_H
+
+#include "disk_image.h"
+
+#include <string>
+#include <vector>
+
+#define SPARSE_IMAGE_MAGIC "FSSPARS1"
+
+/**
+ * Image file that only stores the chunks that have been written. Reads of
+ * unallocated chunks return zeros without touching the file, and a write of
+ * all zeros to one leaves it unallocated. The file does not depend on the
+ * host filesystem supporting holes, so it stays small when copied around:
+ *
+ *   [0, 4K)                 header (magic, size in bytes, chunk size)
+ *   [4K, 4K + 8 * nchunks)  allocation map: file offset of each chunk's
+ *                           data, or 0 for a hole
+ *   [..., EOF)              chunk data in allocation order
+ *
+ * scripts/blkdev-image.py creates these from raw images and back.
+ */
+class sparse_image_t : public disk_image_t {
+public:
+  sparse_image_t(const char *filename, msync_policy_t policy);
+  ~sparse_image_t() override;
+
+  sparse_image_t(const sparse_image_t &) = delete;
+  sparse_image_t &operator=(const sparse_image_t &) = delete;
+
+  void read(uint64_t offset, void *dst, size_t len) override;
+  void write(uint64_t offset, const void *src, size_t len) override;
+
+  void sync() override;
+
+private:
+  std::string name;
+  msync_policy_t policy;
+  int _fd = -1;
+  uint64_t chunk_bytes = 0;
+  std::vector<uint64_t> chunk_map;
+  uint64_t file_end = 0; // where the next chunk is allocated
+  bool dirty = false;
+};
+
+#endif // __SPARSE_IMAGE_H
@@ -0,0 +1,331 @@
+// See LICENSE for license details
+
+#include "striped_image.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Worker threads per stripe file
+#define STRIPE_THREADS 2
+
+namespace {
+
+// Part of an op that falls in one chunk
+struct piece_t {
+  blkdev_io_op *parent;
+  bool write;
+  uint64_t offset; // in the stripe file
+  uint8_t *buf;
+  size_t len;
+};
+
+/**
+ * Engine that splits each op into per-chunk pieces and hands them to the
+ * queue of the file holding the chunk. An op completes once all of its
+ * pieces have.
+ */
+class stripe_engine_t : public blkdev_io_engine_t {
+public:
+  stripe_engine_t(const std::vector<int> &fds,
+                  const std::vector<std::string> &names,
+                  size_t stripe_bytes,
+                  bool dsync);
+  ~stripe_engine_t() override;
+
+  const char *name() const override { return "per-stripe threads"; }
+  void submit(blkdev_io_op *op) override;
+  size_t reap(bool wait) override;
+  size_t inflight() const override { return _inflight; }
+
+  // Applies to writes submitted from now on
+  void set_dsync(bool dsync) { this->dsync = dsync; }
+
+private:
+  struct stripe_t {
+    int fd;
+    const char *name;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::deque<piece_t> work;
+    bool stop = false;
+    std::vector<std::thread> workers;
+  };
+
+  void split(blkdev_io_op *parent, blkdev_io_op *op);
+  void run(stripe_t &s);
+
+  size_t stripe_bytes;
+  std::atomic<bool> dsync;
+  size_t _inflight = 0;
+  std::vector<std::unique_ptr<stripe_t>> stripes;
+
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  std::unordered_map<blkdev_io_op *, size_t> remaining; // pieces per op
+  std::vector<blkdev_io_op *> completed;
+};
+
+stripe_engine_t::stripe_engine_t(const std::vector<int> &fds,
+                                 const std::vector<std::string> &names,
+                                 size_t stripe_bytes,
+                                 bool dsync)
+    : stripe_bytes(stripe_bytes), dsync(dsync) {
+  for (size_t i = 0; i < fds.size(); i++) {
+    stripes.emplace_back(new stripe_t);
+    stripes.back()->fd = fds[i];
+    stripes.back()->name = names[i].c_str();
+  }
+  for (auto &s : stripes)
+    for (int i = 0; i < STRIPE_THREADS; i++)
+      s->workers.emplace_back(&stripe_engine_t::run, this, std::ref(*s));
+}
+
+stripe_engine_t::~stripe_engine_t() {
+  drain();
+  for (auto &s : stripes) {
+    {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      s->stop = true;
+    }
+    s->work_cv.notify_all();
+  }
+  for (auto &s : stripes)
+    for (auto &t : s->workers)
+      t.join();
+}
+
+/* Queue the pieces of one op (either the submitted op or one merged into
+ * it) on their stripes */
+void stripe_engine_t::split(blkdev_io_op *parent, blkdev_io_op *op) {
+  uint64_t offset = op->offset;
+  uint8_t *buf = (uint8_t *)op->buf;
+  size_t len = op->len;
+  while (len) {
+    uint64_t chunk = offset / stripe_bytes;
+    uint64_t in_chunk = offset % stripe_bytes;
+    size_t n = std::min<uint64_t>(len, stripe_bytes - in_chunk);
+    stripe_t &s = *stripes[chunk % stripes.size()];
+    uint64_t file_offset = (chunk / stripes.size()) * stripe_bytes + in_chunk;
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      s.work.push_back({parent, op->write, file_offset, buf, n});
+    }
+    s.work_cv.notify_one();
+    offset += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+void stripe_engine_t::submit(blkdev_io_op *op) {
+  op->done = false;
+  size_t pieces = 0;
+  auto count = [&](blkdev_io_op *o) {
+    uint64_t first = o->offset / stripe_bytes;
+    uint64_t last = (o->offset + o->len - 1) / stripe_bytes;
+    pieces += last - first + 1;
+  };
+  count(op);
+  for (auto *m : op->merged) {
+    m->done = false;
+    count(m);
+  }
+  {
+    std::lock_guard<std::mutex> lock(done_mutex);
+    remaining[op] = pieces;
+  }
+  _inflight++;
+
+  split(op, op);
+  for (auto *m : op->merged)
+    split(op, m);
+}
+
+void stripe_engine_t::run(stripe_t &s) {
+  while (true) {
+    piece_t p;
+    {
+      std::unique_lock<std::mutex> lock(s.mutex);
+      s.work_cv.wait(lock, [&] { return s.stop || !s.work.empty(); });
+      if (s.work.empty())
+        return;
+      p = s.work.front();
+      s.work.pop_front();
+    }
+
+    if (p.write) {
+      pwrite_all(s.fd, p.buf, p.len, p.offset, s.name);
+      if (dsync && fdatasync(s.fd)) {
+        perror("fdatasync");
+        abort();
+      }
+    } else {
+      pread_all(s.fd, p.buf, p.len, p.offset, s.name);
+    }
+
+    bool finished;
+    {
+      std::lock_guard<std::mutex> lock(done_mutex);
+      auto it = remaining.find(p.parent);
+      finished = --it->second == 0;
+      if (finished) {
+        remaining.erase(it);
+        completed.push_back(p.parent);
+      }
+    }
+    if (finished)
+      done_cv.notify_one();
+  }
+}
+
+size_t stripe_engine_t::reap(bool wait) {
+  std::vector<blkdev_io_op *> finished;
+  {
+    std::unique_lock<std::mutex> lock(done_mutex);
+    if (wait && _inflight)
+      done_cv.wait(lock, [this] { return !completed.empty(); });
+    finished.swap(completed);
+  }
+  for (auto *op : finished) {
+    op->done = true;
+    for (auto *m : op->merged)
+      m->done = true;
+  }
+  _inflight -= finished.size();
+  return finished.size();
+}
+
+/**
+ * The engine of a striped image as handed to the driver. Both share the
+ * image's queues and workers; the driver thread is the only one using
+ * either.
+ */
+class stripe_engine_ref_t : public blkdev_io_engine_t {
+public:
+  explicit stripe_engine_ref_t(blkdev_io_engine_t &engine) : engine(engine) {}
+
+  const char *name() const override { return engine.name(); }
+  void submit(blkdev_io_op *op) override { engine.submit(op); }
+  size_t reap(bool wait) override { return engine.reap(wait); }
+  size_t inflight() const override { return engine.inflight(); }
+
+private:
+  blkdev_io_engine_t &engine;
+};
+
+} // namespace
+
+striped_image_t::striped_image_t(const std::vector<std::string> &files,
+                                 size_t stripe_bytes,
+                                 msync_policy_t policy)
+    : names(files), stripe_bytes(stripe_bytes), policy(policy) {
+  if (stripe_bytes == 0 || stripe_bytes % 512) {
+    fprintf(stderr,
+            "Blockdev stripe size (%zu) must be a non-zero multiple of 512\n",
+            stripe_bytes);
+    abort();
+  }
+
+  uint64_t chunks_per_file = UINT64_MAX;
+  for (auto &name : names) {
+    int fd = open(name.c_str(), O_RDWR);
+    if (fd < 0) {
+      fprintf(stderr, "Could not open %s\n", name.c_str());
+      abort();
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+      perror("fstat");
+      abort();
+    }
+    chunks_per_file = std::min<uint64_t>(chunks_per_file,
+                                         st.st_size / stripe_bytes);
+    fds.push_back(fd);
+  }
+  _size = chunks_per_file * stripe_bytes * fds.size();
+  if (_size == 0) {
+    fprintf(stderr,
+            "Striped image files must hold at least one %zu byte chunk each\n",
+            stripe_bytes);
+    abort();
+  }
+  printf("[INFO] Striped image: %zu files, %zu byte chunks, %" PRIu64
+         " bytes\n",
+         fds.size(),
+         stripe_bytes,
+         (uint64_t)_size);
+
+  engine = std::make_unique<stripe_engine_t>(fds, names, stripe_bytes, false);
+}
+
+striped_image_t::~striped_image_t() {
+  engine.reset();
+  sync();
+  for (int fd : fds)
+    close(fd);
+}
+
+/* Run a single op to completion on the stripe queues */
+void striped_image_t::transfer(bool write,
+                               uint64_t offset,
+                               void *buf,
+                               size_t len) {
+  blkdev_io_op op = {};
+  op.write = write;
+  op.offset = offset;
+  op.buf = buf;
+  op.len = len;
+  engine->submit(&op);
+  while (!op.done)
+    engine->reap(true);
+}
+
+void striped_image_t::read(uint64_t offset, void *dst, size_t len) {
+  transfer(false, offset, dst, len);
+}
+
+void striped_image_t::write(uint64_t offset, const void *src, size_t len) {
+  transfer(true, offset, const_cast<void *>(src), len);
+  dirty = true;
+}
+
+void striped_image_t::sync() {
+  if (!dirty || policy == msync_policy_t::NONE)
+    return;
+
+  for (int fd : fds) {
+    int ret = policy == msync_policy_t::SYNC
+                  ? fdatasync(fd)
+                  : sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    if (ret) {
+      perror("sync");
+      abort();
+    }
+  }
+  dirty = false;
+}
+
+std::unique_ptr<blkdev_io_engine_t>
+striped_image_t::make_io_engine(const char *kind, bool dsync, unsigned) {
+  if (strcmp(kind, "auto") && strcmp(kind, "threads")) {
+    fprintf(stderr,
+            "Striped blockdev images are serviced by per-stripe threads "
+            "(expected +blkdev-aio auto, threads or off, got \"%s\")\n",
+            kind);
+    abort();
+  }
+  static_cast<stripe_engine_t &>(*engine).set_dsync(dsync);
+  return std::make_unique<stripe_engine_ref_t>(*engine);
+}
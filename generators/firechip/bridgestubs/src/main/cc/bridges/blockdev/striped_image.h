@@ -0,0 +1,51 @@
+// See LICENSE for license details
+#ifndef __STRIPED_IMAGE_H
+#define __STRIPED_IMAGE_H
+
+#include "disk_image.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Image striped across several raw files, typically on different host
+ * disks. Chunk c of the image is chunk c / N of file c % N. All files
+ * contribute the same number of whole chunks; any excess in the larger ones
+ * is ignored.
+ *
+ * Every file has its own queue and worker threads, so a request spanning
+ * several chunks, or requests from several tags, keep all of the disks busy.
+ * The I/O engine handed to the driver uses the same queues.
+ */
+class striped_image_t : public disk_image_t {
+public:
+  striped_image_t(const std::vector<std::string> &files,
+                  size_t stripe_bytes,
+                  msync_policy_t policy);
+  ~striped_image_t() override;
+
+  striped_image_t(const striped_image_t &) = delete;
+  striped_image_t &operator=(const striped_image_t &) = delete;
+
+  void read(uint64_t offset, void *dst, size_t len) override;
+  void write(uint64_t offset, const void *src, size_t len) override;
+  void mark_dirty() override { dirty = true; }
+
+  void sync() override;
+
+  std::unique_ptr<blkdev_io_engine_t>
+  make_io_engine(const char *kind, bool dsync, unsigned depth) override;
+
+private:
+  void transfer(bool write, uint64_t offset, void *buf, size_t len);
+
+  std::vector<std::string> names;
+  std::vector<int> fds;
+  size_t stripe_bytes;
+  msync_policy_t policy;
+  bool dirty = false;
+  // Carries out read() and write(), and the ops of make_io_engine()'s engine
+  std::unique_ptr<blkdev_io_engine_t> engine;
+};
+
+#endif // __STRIPED_IMAGE_H
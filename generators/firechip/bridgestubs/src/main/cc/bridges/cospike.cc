@@ -2,22 +2,34 @@
 
 #include "cospike.h"
 #include "bridges/cospike/thread_pool.h"
+#include "bridges/cospike/trace_record.h"
+#include "bridges/host_placement.h"
 #include "cospike_impl.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <filesystem>
+#include <inttypes.h>
 #include <iostream>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <thread>
 #include <zlib.h>
 
 /* #define DEBUG */
-#define THROUGHPUT_TESTING
 
 char cospike_t::KIND;
 
+typedef std::chrono::steady_clock stats_clock;
+
+static inline uint64_t ns_since(stats_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             stats_clock::now() - start)
+      .count();
+}
+
 /**
  * Constructor for cospike
  */
@@ -69,32 +81,159 @@ cospike_t::cospike_t(simif_t &sim,
   this->cospike_exit_code = 0;
 
   const std::string cospiketrace_arg = std::string("+cospike-trace=");
+  const std::string drivercpus_arg = std::string("+cospike-driver-cpus=");
+  const std::string workercpus_arg = std::string("+cospike-worker-cpus=");
+  const std::string hugepages_arg = std::string("+cospike-hugepages");
+  const std::string stats_arg = std::string("+cospike-stats=");
+  const std::string statsinterval_arg =
+      std::string("+cospike-stats-interval=");
+  const char *stats_filename = nullptr;
+  const std::string unordered_arg = std::string("+cospike-unordered");
+  bool unordered = false;
+  const std::string history_arg = std::string("+cospike-history=");
+  size_t history_len = 64;
+  int num_threads = 0;
+  std::vector<int> driver_cpus, worker_cpus;
+  bool hugepages = false;
   for (auto &arg : args) {
     if (arg.find(cospiketrace_arg) == 0) {
       char *str = const_cast<char *>(arg.c_str()) + cospiketrace_arg.length();
-      int num_threads = atol(str);
-      this->_trace_printers.start(num_threads);
-
-      size_t max_input_bytes = stream_depth * STREAM_WIDTH_BYTES;
-      size_t buffer_bytes =
-          num_threads * max_input_bytes; // based on perf experiments
-      this->_trace_mempool =
-          new mempool_t(num_threads, buffer_bytes, max_input_bytes);
-
-      std::filesystem::create_directory("COSPIKE-TRACES");
-
-      FILE *config_file = fopen("COSPIKE-CONFIG", "w");
-      fprintf(config_file,
-              "num_threads: %d uncompressed_buffer_bytes: %lu\n",
-              num_threads,
-              buffer_bytes);
-      fclose(config_file);
-
-      FILE *bootrom_file = fopen("FIRESIM-BOOTROM", "w");
-      fprintf(bootrom_file, "%s\n", bootrom);
-      fclose(bootrom_file);
+      num_threads = atol(str);
+    }
+    if (arg.find(drivercpus_arg) == 0) {
+      driver_cpus = parse_cpu_list(arg.substr(drivercpus_arg.length()));
+    }
+    if (arg.find(workercpus_arg) == 0) {
+      worker_cpus = parse_cpu_list(arg.substr(workercpus_arg.length()));
+    }
+    if (arg.find(hugepages_arg) == 0) {
+      hugepages = true;
+    }
+    if (arg.find(stats_arg) == 0) {
+      stats_filename = const_cast<char *>(arg.c_str()) + stats_arg.length();
+    }
+    if (arg.find(unordered_arg) == 0) {
+      unordered = true;
+    }
+    if (arg.find(history_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + history_arg.length();
+      history_len = atol(str);
+    }
+    if (arg.find(statsinterval_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + statsinterval_arg.length();
+      this->_stats_interval = std::chrono::milliseconds(atol(str));
     }
   }
+
+  if (stats_filename) {
+    // one file per bridge, like tracerv's -C<N> suffix
+    std::string fname =
+        std::string(stats_filename) + "-C" + std::to_string(hartid);
+    this->_stats_file = fopen(fname.c_str(), "w");
+    if (!this->_stats_file) {
+      fprintf(stderr, "Could not open Cospike stats file: %s\n", fname.c_str());
+      abort();
+    }
+    fprintf(this->_stats_file,
+            "elapsed_s,ticks,records,records_per_s,bytes_pulled,"
+            "bytes_per_tick,pull_s,cosim_s,printer_queue_depth,"
+            "buffer_stalls,buffer_stall_s\n");
+  }
+
+  this->_history.resize(history_len);
+
+  // Multi-hart targets share one spike instance. Unless asked not to, feed
+  // it from a single worker in commit-time order. Recording needs no spike.
+  if (nharts > 1 && !unordered && num_threads == 0) {
+    this->_coordinator = &cospike_coordinator_t::instance();
+    this->_coordinator->attach(hartid, history_len);
+  }
+
+  if (num_threads > 0) {
+    // Without a placement of their own the printers get the CPUs left over
+    // by the driver rather than sharing its cores
+    if (worker_cpus.empty() && !driver_cpus.empty()) {
+      for (int cpu : thread_cpus(pthread_self())) {
+        if (std::find(driver_cpus.begin(), driver_cpus.end(), cpu) ==
+            driver_cpus.end())
+          worker_cpus.push_back(cpu);
+      }
+    }
+    this->_trace_printers.start(num_threads, worker_cpus);
+
+    size_t max_input_bytes = stream_depth * STREAM_WIDTH_BYTES;
+    size_t buffer_bytes =
+        num_threads * max_input_bytes; // based on perf experiments
+    this->_trace_mempool =
+        new mempool_t(num_threads, buffer_bytes, max_input_bytes, hugepages);
+
+    // First-touch the buffers from the printers' CPUs so that they are
+    // allocated on the NUMA node that compresses them.
+    std::thread toucher([&] {
+      pin_thread(pthread_self(), worker_cpus);
+      this->_trace_mempool->touch();
+    });
+    toucher.join();
+
+    std::filesystem::create_directory("COSPIKE-TRACES");
+
+    // Everything cospike-replay needs to rebuild the spike instance
+    FILE *config_file = fopen("COSPIKE-CONFIG", "w");
+    fprintf(config_file,
+            "num_threads: %d uncompressed_buffer_bytes: %lu\n",
+            num_threads,
+            buffer_bytes);
+    fprintf(config_file, "isa: %s\n", isa);
+    fprintf(config_file, "priv: %s\n", priv);
+    fprintf(config_file, "pmp_regions: %u\n", pmp_regions);
+    fprintf(config_file, "maxpglevels: %u\n", maxpglevels);
+    fprintf(config_file, "mem0_base: 0x%" PRIx64 "\n", mem0_base);
+    fprintf(config_file, "mem0_size: 0x%" PRIx64 "\n", mem0_size);
+    fprintf(config_file, "mem1_base: 0x%" PRIx64 "\n", mem1_base);
+    fprintf(config_file, "mem1_size: 0x%" PRIx64 "\n", mem1_size);
+    fprintf(config_file, "mem2_base: 0x%" PRIx64 "\n", mem2_base);
+    fprintf(config_file, "mem2_size: 0x%" PRIx64 "\n", mem2_size);
+    fprintf(config_file, "nharts: %u\n", nharts);
+    fprintf(config_file, "cause_width: %u\n", TO_BYTES(cause_width));
+    fclose(config_file);
+
+    FILE *bootrom_file = fopen("FIRESIM-BOOTROM", "w");
+    fprintf(bootrom_file, "%s\n", bootrom);
+    fclose(bootrom_file);
+  }
+
+  // The driver thread is the one constructing the bridges. Pinned last, as
+  // threads started from it afterwards inherit its CPUs.
+  pin_thread(pthread_self(), driver_cpus);
+
+  std::vector<int> cpus = thread_cpus(pthread_self());
+  printf("[INFO] Cospike[%u]: Driver thread on CPUs %s (NUMA node %d)\n",
+         hartid,
+         format_cpu_list(cpus).c_str(),
+         cpus_numa_node(cpus));
+  if (this->_trace_mempool) {
+    std::vector<int> printer_cpus = this->_trace_printers.cpus();
+    printf("[INFO] Cospike[%u]: %zu trace printer threads on CPUs %s (NUMA "
+           "node %d), %s trace buffers\n",
+           hartid,
+           this->_trace_printers.num_threads(),
+           format_cpu_list(printer_cpus).c_str(),
+           cpus_numa_node(printer_cpus),
+           hugepages ? "hugepage-backed" : "4K-page");
+  }
+}
+
+cospike_t::~cospike_t() {
+  if (this->_stats_file)
+    fclose(this->_stats_file);
+}
+
+int cospike_t::exit_code() {
+  if (cospike_failed)
+    return cospike_exit_code;
+  if (_coordinator)
+    return _coordinator->exit_code();
+  return 0;
 }
 
 /**
@@ -118,6 +257,8 @@ void cospike_t::init() {
                       this->_nharts,
                       (char *)this->_bootrom,
                       this->args);
+
+  this->_stats_start = this->_stats_last_dump = stats_clock::now();
 }
 
 /**
@@ -125,57 +266,38 @@ void cospike_t::init() {
  * This returns the return code of the co-sim functions.
  */
 int cospike_t::invoke_cospike(uint8_t *buf) {
-  trace_cfg_t &cfg = this->_trace_cfg;
-  uint64_t time = EXTRACT_ALIGNED(
-      int64_t, uint64_t, buf, cfg._time_width, cfg._time_offset);
-  bool valid = buf[cfg._valid_offset];
-  // this crazy to extract the right value then sign extend within the size
-  uint64_t iaddr = EXTRACT_ALIGNED(int64_t,
-                                   uint64_t,
-                                   buf,
-                                   cfg._iaddr_width,
-                                   cfg._iaddr_offset); // aka the pc
-  uint32_t insn = EXTRACT_ALIGNED(
-      int32_t, uint32_t, buf, cfg._insn_width, cfg._insn_offset);
-  bool exception = buf[cfg._exception_offset];
-  bool interrupt = buf[cfg._interrupt_offset];
-  uint64_t cause = EXTRACT_ALIGNED(
-      int64_t, uint64_t, buf, cfg._cause_width, cfg._cause_offset);
-  uint64_t wdata =
-      cfg._wdata_width != 0
-          ? EXTRACT_ALIGNED(
-                int64_t, uint64_t, buf, cfg._wdata_width, cfg._wdata_offset)
-          : 0;
-  uint8_t priv = buf[cfg._priv_offset];
+  commit_record_t rec;
+  decode_commit(this->_trace_cfg, buf, rec);
 
 #ifdef DEBUG
   fprintf(stderr,
           "C[%d] V(%d) PC(0x%lx) Insn(0x%x) EIC(%d:%d:%ld) Wdata(%d:0x%lx) "
           "Priv(%d)\n",
-          this->_hartid,
-          valid,
-          iaddr,
-          insn,
-          exception,
-          interrupt,
-          cause,
-          (this->_wdata_width != 0),
-          wdata,
-          priv);
+          rec.hartid,
+          rec.valid,
+          rec.iaddr,
+          rec.insn,
+          rec.exception,
+          rec.interrupt,
+          rec.cause,
+          rec.has_wdata,
+          rec.wdata,
+          rec.priv);
 #endif
 
-  if (valid || exception || cause) {
-    return cospike_cosim(time, // TODO: No cycle given
-                         this->_hartid,
-                         (cfg._wdata_width != 0),
-                         valid,
-                         iaddr,
-                         insn,
-                         exception,
-                         interrupt,
-                         cause,
-                         wdata,
-                         priv);
+  if (rec.needs_cosim()) {
+    this->_history.push(rec);
+    return cospike_cosim(rec.time, // TODO: No cycle given
+                         rec.hartid,
+                         rec.has_wdata,
+                         rec.valid,
+                         rec.iaddr,
+                         rec.insn,
+                         rec.exception,
+                         rec.interrupt,
+                         rec.cause,
+                         rec.wdata,
+                         rec.priv);
   } else {
     return 0;
   }
@@ -183,37 +305,73 @@ int cospike_t::invoke_cospike(uint8_t *buf) {
 
 size_t cospike_t::record_trace(size_t max_batch_bytes, size_t min_batch_bytes) {
   assert(!_trace_mempool->full());
+  auto pull_start = stats_clock::now();
   size_t bytes_received = pull(stream_idx,
                                _trace_mempool->next_empty(),
                                max_batch_bytes,
                                min_batch_bytes);
+  _stats.pull_ns += ns_since(pull_start);
   if (bytes_received > 0) {
     _trace_mempool->fill(bytes_received);
+    _stats.records += bytes_received / (this->_bits_per_trace / 8);
 
     // if the buffer is full, push it to the threadpool
-    if (_trace_mempool->full()) {
-      while (_trace_mempool->next_buffer_full()) {
-        ;
-      }
-      std::string ofname = "COSPIKE-TRACES/COSPIKE-TRACE-" +
-                           std::to_string(this->_hartid) + "-" +
-                           std::to_string(this->_file_idx++) + ".gz";
-      trace_t trace = {_trace_mempool->cur_buf(), this->_trace_cfg};
-      _trace_printers.queue_job(print_insn_logs, trace, ofname);
-      _trace_mempool->advance_buffer();
-    }
+    if (_trace_mempool->full())
+      this->queue_trace_buffer();
   }
   return bytes_received;
 }
 
+/* Hand the current trace buffer to the printers as the next chunk and move on
+ * to the following one, waiting for it to be written out if it is still
+ * queued. */
+void cospike_t::queue_trace_buffer() {
+  if (_trace_mempool->next_buffer_full()) {
+    auto stall_start = stats_clock::now();
+    while (_trace_mempool->next_buffer_full()) {
+      ;
+    }
+    _stats.buffer_stalls++;
+    _stats.buffer_stall_ns += ns_since(stall_start);
+  }
+  std::string ofname = "COSPIKE-TRACES/COSPIKE-TRACE-" +
+                       std::to_string(this->_hartid) + "-" +
+                       std::to_string(this->_file_idx++) + ".gz";
+  trace_t trace = {_trace_mempool->cur_buf(), this->_trace_cfg};
+  _trace_printers.queue_job(print_insn_logs, trace, ofname);
+  _trace_mempool->advance_buffer();
+}
+
 size_t cospike_t::run_cosim(size_t max_batch_bytes, size_t min_batch_bytes) {
   // TODO: as opt can mmap file and just load directly into it.
   page_aligned_sized_array(OUTBUF, max_batch_bytes);
+  auto pull_start = stats_clock::now();
   size_t bytes_received =
       pull(stream_idx, OUTBUF, max_batch_bytes, min_batch_bytes);
+  auto cosim_start = stats_clock::now();
+  _stats.pull_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        cosim_start - pull_start)
+                        .count();
 
   const size_t bytes_per_trace = this->_bits_per_trace / 8;
 
+  if (this->_coordinator) {
+    // decode here, check on the coordinator's thread
+    commit_record_t rec;
+    for (uint32_t offset = 0; offset < bytes_received;
+         offset += bytes_per_trace) {
+      decode_commit(this->_trace_cfg, ((uint8_t *)OUTBUF) + offset, rec);
+      if (rec.needs_cosim())
+        _batch.push_back(rec);
+    }
+    _stats.records += bytes_received / bytes_per_trace;
+    // Below the threshold a pull returns nothing, so only a short
+    // threshold-less pull shows that the stream is empty
+    bool drained = min_batch_bytes == 0 && bytes_received < max_batch_bytes;
+    this->_coordinator->submit(this->_hartid, _batch, drained);
+    return bytes_received;
+  }
+
   for (uint32_t offset = 0; offset < bytes_received;
        offset += bytes_per_trace) {
 #ifdef DEBUG
@@ -237,6 +395,7 @@ size_t cospike_t::run_cosim(size_t max_batch_bytes, size_t min_batch_bytes) {
       cospike_failed = true;
       cospike_exit_code = rval;
       printf("[ERROR] Cospike: Errored during simulation with %d\n", rval);
+      this->dump_history();
 
 #ifdef DEBUG
       fprintf(stderr, "Off(%lu) token(", offset / bytes_per_trace);
@@ -261,10 +420,30 @@ size_t cospike_t::run_cosim(size_t max_batch_bytes, size_t min_batch_bytes) {
 
       break;
     }
+    _stats.records++;
   }
+  _stats.cosim_ns += ns_since(cosim_start);
   return bytes_received;
 }
 
+/**
+ * Write the commits leading up to a mismatch to COSPIKE-HISTORY-<hartid>
+ */
+void cospike_t::dump_history() {
+  if (this->_history.capacity() == 0)
+    return;
+
+  std::string fname = "COSPIKE-HISTORY-" + std::to_string(this->_hartid);
+  FILE *f = fopen(fname.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Could not open Cospike history file: %s\n", fname.c_str());
+    return;
+  }
+  this->_history.dump(f);
+  fclose(f);
+  printf("[ERROR] Cospike: Commit history written to %s\n", fname.c_str());
+}
+
 /**
  * Read queue and co-simulate
  */
@@ -278,14 +457,64 @@ size_t cospike_t::process_tokens(int num_beats, size_t minimum_batch_beats) {
   } else {
     bytes_received = run_cosim(maximum_batch_bytes, minimum_batch_bytes);
   }
+  _stats.bytes_pulled += bytes_received;
   return bytes_received;
 }
 
+/**
+ * Append a row of interval rates to the stats file, at most once per
+ * +cospike-stats-interval unless forced
+ */
+void cospike_t::dump_stats(bool force) {
+  if (!this->_stats_file)
+    return;
+
+  auto now = stats_clock::now();
+  if (!force && now - _stats_last_dump < _stats_interval)
+    return;
+
+  double interval_s =
+      std::chrono::duration<double>(now - _stats_last_dump).count();
+  uint64_t ticks = _stats.ticks - _stats_last.ticks;
+  uint64_t records = _stats.records - _stats_last.records;
+  uint64_t bytes = _stats.bytes_pulled - _stats_last.bytes_pulled;
+  size_t queue_depth =
+      this->_trace_mempool ? this->_trace_printers.queue_depth() : 0;
+
+  fprintf(this->_stats_file,
+          "%.3f,%" PRIu64 ",%" PRIu64 ",%.0f,%" PRIu64 ",%.1f,%.3f,%.3f,%zu,"
+          "%" PRIu64 ",%.3f\n",
+          std::chrono::duration<double>(now - _stats_start).count(),
+          _stats.ticks,
+          _stats.records,
+          interval_s > 0 ? records / interval_s : 0.0,
+          _stats.bytes_pulled,
+          ticks ? (double)bytes / ticks : 0.0,
+          _stats.pull_ns / 1e9,
+          (this->_coordinator ? this->_coordinator->cosim_ns(this->_hartid)
+                              : _stats.cosim_ns) /
+              1e9,
+          queue_depth,
+          _stats.buffer_stalls,
+          _stats.buffer_stall_ns / 1e9);
+  fflush(this->_stats_file);
+
+  _stats_last = _stats;
+  _stats_last_dump = now;
+}
+
 /**
  * Move forward the simulation
  */
 void cospike_t::tick() {
-  this->process_tokens(this->stream_depth, this->stream_depth);
+  size_t bytes_received =
+      this->process_tokens(this->stream_depth, this->stream_depth);
+  // A hart committing less than a batch per tick would otherwise hold its
+  // commits back and the other harts with them
+  if (this->_coordinator && bytes_received == 0)
+    this->process_tokens(this->stream_depth, 0);
+  _stats.ticks++;
+  this->dump_stats(false);
 }
 
 /**
@@ -294,9 +523,24 @@ void cospike_t::tick() {
  */
 void cospike_t::flush() {
   // only flush if there wasn't a failure before
-  while (!cospike_failed && (this->process_tokens(this->stream_depth, 0) > 0))
+  while (!failed() && (this->process_tokens(this->stream_depth, 0) > 0))
     ;
 
-  if (this->_trace_mempool)
+  if (this->_coordinator)
+    this->_coordinator->detach(this->_hartid);
+
+  if (this->_trace_mempool) {
+    // Write out the partly filled last buffer too, then let the printers
+    // finish every queued chunk
+    if (_trace_mempool->cur_buf()->bytes() > 0)
+      this->queue_trace_buffer();
     this->_trace_printers.stop();
+
+    // Tells cospike-replay how many chunks to expect from this hart
+    FILE *config_file = fopen("COSPIKE-CONFIG", "a");
+    fprintf(config_file, "chunks_%u: %d\n", this->_hartid, this->_file_idx);
+    fclose(config_file);
+  }
+
+  this->dump_stats(true);
 }
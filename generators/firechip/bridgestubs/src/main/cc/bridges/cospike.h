@@ -2,13 +2,28 @@
 #ifndef __COSPIKE_H
 #define __COSPIKE_H
 
+#include "bridges/cospike/coordinator.h"
 #include "bridges/cospike/mem_pool.h"
 #include "bridges/cospike/thread_pool.h"
+#include "bridges/cospike/trace_record.h"
 #include "core/bridge_driver.h"
+#include <chrono>
+#include <stdio.h>
 #include <string>
 #include <vector>
 #include <zlib.h>
 
+// Running totals behind +cospike-stats
+struct cospike_stats_t {
+  uint64_t ticks = 0;
+  uint64_t records = 0;       // tokens checked or recorded
+  uint64_t bytes_pulled = 0;
+  uint64_t pull_ns = 0;       // time spent in pull()
+  uint64_t cosim_ns = 0;      // time spent in cospike_cosim
+  uint64_t buffer_stalls = 0; // waits for a free trace buffer
+  uint64_t buffer_stall_ns = 0;
+};
+
 class cospike_t : public streaming_bridge_driver_t {
 public:
   /// The identifier for the bridge type used for casts.
@@ -40,20 +55,26 @@ public:
             uint32_t stream_idx,
             uint32_t stream_depth);
 
-  ~cospike_t() override = default;
+  ~cospike_t() override;
 
   void init() override;
   void tick() override;
-  bool terminate() override { return cospike_failed; };
-  int exit_code() override { return (cospike_failed) ? cospike_exit_code : 0; };
+  bool terminate() override { return failed(); };
+  int exit_code() override;
   void finish() override { this->flush(); };
 
 private:
   size_t record_trace(size_t max_batch_bytes, size_t min_batch_bytes);
+  void queue_trace_buffer();
   size_t run_cosim(size_t max_batch_bytes, size_t min_batch_bytes);
   int invoke_cospike(uint8_t *buf);
   size_t process_tokens(int num_beats, size_t minimum_batch_beats);
   void flush();
+  void dump_stats(bool force);
+  void dump_history();
+  bool failed() {
+    return cospike_failed || (_coordinator && _coordinator->failed());
+  }
 
   std::vector<std::string> args;
 
@@ -87,6 +108,20 @@ private:
   int _file_idx = 0;
   threadpool_t<trace_t, std::string> _trace_printers;
   mempool_t *_trace_mempool = nullptr;
+
+  // set if harts are checked in commit-time order through the shared
+  // coordinator instead of directly from tick()
+  cospike_coordinator_t *_coordinator = nullptr;
+  std::vector<commit_record_t> _batch;
+
+  // last commits sent to cospike, written out on a mismatch
+  commit_history_t _history;
+
+  // throughput / latency instrumentation
+  FILE *_stats_file = nullptr;
+  std::chrono::milliseconds _stats_interval{1000};
+  std::chrono::steady_clock::time_point _stats_start, _stats_last_dump;
+  cospike_stats_t _stats, _stats_last;
 };
 
 #endif // __COSPIKE_H
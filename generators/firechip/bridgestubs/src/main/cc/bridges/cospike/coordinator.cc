@@ -0,0 +1,185 @@
+#include "coordinator.h"
+#include "cospike_impl.h"
+
+#include <chrono>
+#include <functional>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string>
+
+// Bound on commits held back by a lagging hart. Past it, the oldest commits
+// are checked regardless of the other harts (counted as forced merges).
+#define MAX_PENDING_RECORDS (1 << 20)
+
+cospike_coordinator_t &cospike_coordinator_t::instance() {
+  static cospike_coordinator_t coordinator;
+  return coordinator;
+}
+
+cospike_coordinator_t::~cospike_coordinator_t() {
+  if (worker.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (auto &h : harts)
+        h.second->attached = false;
+      dirty = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+}
+
+void cospike_coordinator_t::attach(uint32_t hartid, size_t history_len) {
+  std::unique_lock<std::mutex> lock(mutex);
+  harts[hartid] = std::make_unique<hart_t>();
+  if (history.capacity() < history_len)
+    history.resize(history_len);
+  if (!worker.joinable())
+    worker = std::thread(&cospike_coordinator_t::run, this);
+}
+
+void cospike_coordinator_t::submit(uint32_t hartid,
+                                   std::vector<commit_record_t> &batch,
+                                   bool drained) {
+  if (!failed()) {
+    std::unique_lock<std::mutex> lock(mutex);
+    hart_t &h = *harts.at(hartid);
+    for (auto &rec : batch)
+      h.pending.push(rec);
+    pending_records += batch.size();
+    if (!batch.empty()) {
+      h.frontier = batch.back().time;
+      newest = std::max(newest, h.frontier);
+    }
+    // A drained hart has caught up with the target, so its next commits are
+    // no older than anything submitted so far.
+    if (drained)
+      h.frontier = newest;
+    dirty = true;
+  }
+  cv.notify_one();
+  batch.clear();
+}
+
+void cospike_coordinator_t::detach(uint32_t hartid) {
+  std::unique_lock<std::mutex> lock(mutex);
+  harts.at(hartid)->attached = false;
+  dirty = true;
+  cv.notify_one();
+  if (all_detached() && worker.joinable()) {
+    lock.unlock();
+    worker.join();
+    if (forced_merges)
+      printf("[WARN] Cospike: %" PRIu64 " times a lagging hart held back too "
+             "many commits, which were checked out of time order\n",
+             forced_merges);
+  }
+}
+
+uint64_t cospike_coordinator_t::cosim_ns(uint32_t hartid) {
+  std::unique_lock<std::mutex> lock(mutex);
+  return harts.at(hartid)->cosim_ns;
+}
+
+bool cospike_coordinator_t::all_detached() {
+  for (auto &h : harts)
+    if (h.second->attached)
+      return false;
+  return true;
+}
+
+/* Pop every commit that is safe to check, in time order. Called with the
+ * mutex held. */
+void cospike_coordinator_t::merge_ready(
+    std::vector<std::pair<commit_record_t, hart_t *>> &ready) {
+  uint64_t watermark = UINT64_MAX;
+  for (auto &h : harts) {
+    if (h.second->attached)
+      watermark = std::min(watermark, h.second->frontier);
+  }
+  bool forced = pending_records > MAX_PENDING_RECORDS;
+  if (forced)
+    forced_merges++;
+
+  // (time, hartid) min-heap over the oldest pending commit of each hart
+  typedef std::pair<uint64_t, uint32_t> head_t;
+  std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+  for (auto &h : harts) {
+    if (!h.second->pending.empty())
+      heads.push({h.second->pending.front().time, h.first});
+  }
+
+  while (!heads.empty()) {
+    head_t head = heads.top();
+    if (head.first > watermark && !forced)
+      break;
+    heads.pop();
+
+    hart_t *h = harts[head.second].get();
+    ready.push_back({h->pending.front(), h});
+    h->pending.pop();
+    pending_records--;
+    if (forced && pending_records <= MAX_PENDING_RECORDS / 2)
+      forced = false;
+
+    if (!h->pending.empty())
+      heads.push({h->pending.front().time, head.second});
+  }
+}
+
+void cospike_coordinator_t::run() {
+  std::vector<std::pair<commit_record_t, hart_t *>> ready;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [this] { return dirty; });
+    dirty = false;
+    merge_ready(ready);
+    lock.unlock();
+
+    for (auto &r : ready) {
+      commit_record_t &rec = r.first;
+      history.push(rec);
+      auto start = std::chrono::steady_clock::now();
+      int rv = cospike_cosim(rec.time,
+                             rec.hartid,
+                             rec.has_wdata,
+                             rec.valid,
+                             rec.iaddr,
+                             rec.insn,
+                             rec.exception,
+                             rec.interrupt,
+                             rec.cause,
+                             rec.wdata,
+                             rec.priv);
+      r.second->cosim_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+      if (rv) {
+        rval = rv;
+        printf("[ERROR] Cospike: Hart %d errored during simulation with %d\n",
+               rec.hartid,
+               rv);
+        std::string fname = "COSPIKE-HISTORY-" + std::to_string(rec.hartid);
+        FILE *f = fopen(fname.c_str(), "w");
+        if (f) {
+          history.dump(f);
+          fclose(f);
+          printf("[ERROR] Cospike: Commit history written to %s\n",
+                 fname.c_str());
+        }
+        break;
+      }
+    }
+    ready.clear();
+
+    lock.lock();
+    if (failed()) {
+      // nothing more will be checked, drop what is queued
+      for (auto &h : harts)
+        h.second->pending = {};
+      pending_records = 0;
+    }
+    if (all_detached() && pending_records == 0)
+      return;
+  }
+}
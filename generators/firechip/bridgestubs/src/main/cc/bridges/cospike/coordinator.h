@@ -0,0 +1,71 @@
+#ifndef __COORDINATOR_H__
+#define __COORDINATOR_H__
+
+#include "trace_record.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/**
+ * Drives the spike instance shared by all cospike bridges of a multi-hart
+ * target. Each bridge decodes its stream into batches of commits and hands
+ * them over with submit(); a worker thread merges the per-hart batches by
+ * commit time (k-way heap) and calls cospike_cosim in that order, so the
+ * driver thread keeps pulling while spike is checking.
+ *
+ * A commit is only checked once no attached hart can still deliver an older
+ * one. Each hart bounds the merge at its frontier: the newest commit it
+ * submitted or, if its last pull drained the stream, the newest commit any
+ * hart had submitted at that point. Idle harts therefore hold the others back
+ * by at most one tick.
+ */
+class cospike_coordinator_t {
+public:
+  static cospike_coordinator_t &instance();
+
+  void attach(uint32_t hartid, size_t history_len);
+  // `drained` is set if the bridge emptied its stream with this batch
+  void submit(uint32_t hartid, std::vector<commit_record_t> &batch, bool drained);
+  // The hart sends no more commits. The last hart to detach waits until
+  // everything submitted has been checked.
+  void detach(uint32_t hartid);
+
+  bool failed() const { return rval != 0; }
+  int exit_code() const { return rval; }
+  uint64_t cosim_ns(uint32_t hartid);
+
+private:
+  cospike_coordinator_t() = default;
+  ~cospike_coordinator_t();
+
+  struct hart_t {
+    std::queue<commit_record_t> pending;
+    uint64_t frontier = 0;
+    bool attached = true;
+    std::atomic<uint64_t> cosim_ns{0};
+  };
+
+  void run();
+  void merge_ready(std::vector<std::pair<commit_record_t, hart_t *>> &ready);
+  bool all_detached();
+
+  std::map<uint32_t, std::unique_ptr<hart_t>> harts;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread worker;
+  bool dirty = false;
+  size_t pending_records = 0;
+  uint64_t newest = 0; // newest commit time submitted by any hart
+  uint64_t forced_merges = 0;
+  std::atomic<int> rval{0};
+  commit_history_t history;
+};
+
+#endif //__COORDINATOR_H__
@@ -1,13 +1,15 @@
 #include "mem_pool.h"
+#include "bridges/host_placement.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #define PAGE_SIZE_BYTES 4096
 
-buffer_t::buffer_t(size_t sz, size_t max_input_sz) {
+buffer_t::buffer_t(size_t sz, size_t max_input_sz, bool hugepages) {
   size_t remain_bytes = (sz % PAGE_SIZE_BYTES) == 0 ? 0 : PAGE_SIZE_BYTES;
   this->sz = (sz / PAGE_SIZE_BYTES) * PAGE_SIZE_BYTES + remain_bytes;
-  this->data = (uint8_t *)aligned_alloc(PAGE_SIZE_BYTES, this->sz);
+  this->data = (uint8_t *)placed_alloc(this->sz, hugepages);
   this->offset = 0;
   this->max_input_sz = max_input_sz;
 
@@ -20,6 +22,8 @@ bool buffer_t::almost_full() { return (sz - offset) < max_input_sz; }
 
 void buffer_t::clear() { offset = 0; }
 
+void buffer_t::touch() { memset(data, 0, sz); }
+
 uint8_t *buffer_t::next_empty() { return (data + offset); }
 
 void buffer_t::fill(size_t amount) {
@@ -31,11 +35,14 @@ uint8_t *buffer_t::get_data() { return data; }
 
 size_t buffer_t::bytes() { return offset; }
 
-mempool_t::mempool_t(int buf_cnt, size_t buf_sz, size_t max_input_sz) {
+mempool_t::mempool_t(int buf_cnt,
+                     size_t buf_sz,
+                     size_t max_input_sz,
+                     bool hugepages) {
   this->head = 0;
   this->count = buf_cnt;
   for (int i = 0; i < buf_cnt; i++) {
-    this->buffers.push_back(new buffer_t(buf_sz, max_input_sz));
+    this->buffers.push_back(new buffer_t(buf_sz, max_input_sz, hugepages));
   }
   printf("Allocating a total of %ld Bytes\n", buf_cnt * buf_sz);
 }
@@ -47,6 +54,12 @@ mempool_t::~mempool_t() {
   buffers.clear();
 }
 
+void mempool_t::touch() {
+  for (auto &b : buffers) {
+    b->touch();
+  }
+}
+
 bool mempool_t::full() {
   buffer_t *buf = buffers[head];
   return buf->almost_full();
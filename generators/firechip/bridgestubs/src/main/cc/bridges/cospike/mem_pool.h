@@ -7,11 +7,13 @@
 
 class buffer_t {
 public:
-  buffer_t(size_t sz, size_t max_input_sz);
+  buffer_t(size_t sz, size_t max_input_sz, bool hugepages = false);
   ~buffer_t();
 
   bool almost_full();
   void clear();
+  // Write every page so it is allocated on the calling thread's NUMA node
+  void touch();
   uint8_t *next_empty();
   void fill(size_t amount);
   uint8_t *get_data();
@@ -26,9 +28,13 @@ private:
 
 class mempool_t {
 public:
-  mempool_t(int buf_cnt, size_t buf_sz, size_t max_input_sz);
+  mempool_t(int buf_cnt,
+            size_t buf_sz,
+            size_t max_input_sz,
+            bool hugepages = false);
   ~mempool_t();
 
+  void touch();
   bool full();
   uint8_t *next_empty();
   void fill(size_t amount);
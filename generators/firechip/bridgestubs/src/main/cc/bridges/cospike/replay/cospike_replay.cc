@@ -0,0 +1,426 @@
+// See LICENSE for license details
+
+/* Offline cospike co-simulation
+ *
+ * Replays the commit traces recorded by the cospike bridge with
+ * +cospike-trace=N (COSPIKE-TRACES/COSPIKE-TRACE-<hart>-<idx>.gz) against
+ * spike, using the COSPIKE-CONFIG and FIRESIM-BOOTROM files written next to
+ * them. This lets the FPGA run at full speed while checking happens
+ * afterwards on spare host cores.
+ *
+ * Upcoming trace chunks are decompressed in parallel while the current one is
+ * being checked. By default all harts are replayed in one spike instance,
+ * merged in commit-time order. With -p every hart gets its own process (and
+ * spike instance), which is only valid if the harts do not communicate
+ * through memory.
+ */
+
+#include "../trace_record.h"
+#include "cospike_impl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+typedef std::vector<commit_record_t> chunk_t;
+
+static std::atomic<bool> old_format_warned(false);
+
+static std::string trace_path(const std::string &dir, int hartid, int idx) {
+  return dir + "/COSPIKE-TRACES/COSPIKE-TRACE-" + std::to_string(hartid) +
+         "-" + std::to_string(idx) + ".gz";
+}
+
+/* Decompress and parse a whole trace chunk. Runs on a prefetch thread. */
+static chunk_t load_chunk(std::string path, uint32_t cause_width) {
+  chunk_t chunk;
+  gzFile f = gzopen(path.c_str(), "rb");
+  if (!f) {
+    fprintf(stderr, "[ERROR] cospike-replay: Could not open %s\n", path.c_str());
+    exit(1);
+  }
+  gzbuffer(f, 1 << 20);
+
+  char line[256];
+  bool old_format = false;
+  while (gzgets(f, line, sizeof(line))) {
+    commit_record_t rec;
+    int fields = parse_commit(line, cause_width, rec);
+    if (fields == 0) {
+      fprintf(stderr,
+              "[ERROR] cospike-replay: Malformed record in %s: %s",
+              path.c_str(),
+              line);
+      exit(1);
+    }
+    old_format |= (fields < COMMIT_RECORD_FIELDS);
+    chunk.push_back(rec);
+  }
+  gzclose(f);
+
+  if (old_format && !old_format_warned.exchange(true)) {
+    fprintf(stderr,
+            "[WARN] cospike-replay: %s has no insn/priv fields, replay may "
+            "report false mismatches\n",
+            path.c_str());
+  }
+  return chunk;
+}
+
+/* The recorded commits of one hart, read in order with up to `prefetch`
+ * chunks being decompressed ahead of the one being consumed. `expected` is
+ * the number of chunks the recorder wrote, or -1 if it is unknown, in which
+ * case the stream ends at the first missing chunk. */
+class hart_stream_t {
+public:
+  hart_stream_t(const std::string &dir,
+                int hartid,
+                uint32_t cause_width,
+                size_t prefetch,
+                int expected)
+      : dir(dir), hartid(hartid), cause_width(cause_width),
+        prefetch(std::max(prefetch, (size_t)1)), expected(expected) {
+    refill();
+  }
+
+  bool next(commit_record_t &rec) {
+    while (pos == cur.size()) {
+      if (inflight.empty())
+        return false;
+      cur = inflight.front().get();
+      inflight.pop_front();
+      pos = 0;
+      refill();
+    }
+    rec = cur[pos++];
+    return true;
+  }
+
+  int chunks() const { return next_idx; }
+
+private:
+  void refill() {
+    while (inflight.size() < prefetch && next_idx != expected) {
+      std::string path = trace_path(dir, hartid, next_idx);
+      if (!std::filesystem::exists(path)) {
+        if (expected < 0)
+          return;
+        fprintf(stderr,
+                "[ERROR] cospike-replay: %s is missing, hart %d recorded %d "
+                "trace chunks\n",
+                path.c_str(),
+                hartid,
+                expected);
+        exit(1);
+      }
+      inflight.push_back(
+          std::async(std::launch::async, load_chunk, path, cause_width));
+      next_idx++;
+    }
+  }
+
+  const std::string dir;
+  const int hartid;
+  const uint32_t cause_width;
+  const size_t prefetch;
+  const int expected;
+
+  int next_idx = 0;
+  std::deque<std::future<chunk_t>> inflight;
+  chunk_t cur;
+  size_t pos = 0;
+};
+
+/* key: value pairs as written by cospike_t */
+static std::map<std::string, std::string> read_config(const std::string &dir) {
+  std::map<std::string, std::string> cfg;
+  std::string path = dir + "/COSPIKE-CONFIG";
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "[ERROR] cospike-replay: Could not open %s\n", path.c_str());
+    exit(1);
+  }
+  char key[256], value[4096];
+  while (fscanf(f, "%255s %4095s", key, value) == 2) {
+    size_t len = strlen(key);
+    if (len > 0 && key[len - 1] == ':')
+      key[len - 1] = '\0';
+    cfg[key] = value;
+  }
+  fclose(f);
+
+  const char *required[] = {"isa",
+                            "priv",
+                            "pmp_regions",
+                            "maxpglevels",
+                            "mem0_base",
+                            "mem0_size",
+                            "mem1_base",
+                            "mem1_size",
+                            "mem2_base",
+                            "mem2_size",
+                            "nharts",
+                            "cause_width"};
+  for (auto &k : required) {
+    if (cfg.find(k) == cfg.end()) {
+      fprintf(stderr,
+              "[ERROR] cospike-replay: %s has no '%s', re-record the trace "
+              "with a newer driver\n",
+              path.c_str(),
+              k);
+      exit(1);
+    }
+  }
+  return cfg;
+}
+
+static std::string read_bootrom(const std::string &dir) {
+  std::string path = dir + "/FIRESIM-BOOTROM";
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "[ERROR] cospike-replay: Could not open %s\n", path.c_str());
+    exit(1);
+  }
+  char *bootrom = nullptr;
+  size_t len = 0;
+  if (getline(&bootrom, &len, f) < 0) {
+    fprintf(stderr, "[ERROR] cospike-replay: %s is empty\n", path.c_str());
+    exit(1);
+  }
+  fclose(f);
+  bootrom[strcspn(bootrom, "\n")] = '\0';
+  std::string str(bootrom);
+  free(bootrom);
+  return str;
+}
+
+struct replay_opts_t {
+  std::string dir = ".";
+  size_t prefetch = 0;
+  size_t history = 64;
+  std::vector<std::string> plusargs;
+};
+
+/* Replay the given harts through a single spike instance in time order.
+ * Returns the first nonzero cospike_cosim code, or 0. */
+static int replay(const replay_opts_t &opts,
+                  std::map<std::string, std::string> &cfg,
+                  const std::string &bootrom,
+                  const std::vector<int> &harts) {
+  auto num = [&](const char *k) { return strtoull(cfg[k].c_str(), NULL, 0); };
+  std::vector<std::string> args = opts.plusargs;
+  cospike_set_sysinfo((char *)cfg["isa"].c_str(),
+                      (char *)cfg["priv"].c_str(),
+                      num("pmp_regions"),
+                      num("maxpglevels"),
+                      num("mem0_base"),
+                      num("mem0_size"),
+                      num("mem1_base"),
+                      num("mem1_size"),
+                      num("mem2_base"),
+                      num("mem2_size"),
+                      num("nharts"),
+                      (char *)bootrom.c_str(),
+                      args);
+
+  uint32_t cause_width = num("cause_width");
+  size_t prefetch = std::max(opts.prefetch / harts.size(), (size_t)1);
+  std::vector<hart_stream_t *> streams;
+  for (int h : harts) {
+    // Written when the simulation finishes, so a missing count means the
+    // recording was cut short
+    std::string key = "chunks_" + std::to_string(h);
+    int expected = -1;
+    if (cfg.find(key) != cfg.end()) {
+      expected = atoi(cfg[key].c_str());
+    } else {
+      fprintf(stderr,
+              "[WARN] cospike-replay: COSPIKE-CONFIG has no '%s', the trace "
+              "of hart %d may be truncated\n",
+              key.c_str(),
+              h);
+    }
+    streams.push_back(
+        new hart_stream_t(opts.dir, h, cause_width, prefetch, expected));
+  }
+
+  // k-way merge of the hart streams by commit time (ties by hart id)
+  typedef std::pair<commit_record_t, size_t> head_t;
+  auto later = [](const head_t &a, const head_t &b) {
+    if (a.first.time != b.first.time)
+      return a.first.time > b.first.time;
+    return a.first.hartid > b.first.hartid;
+  };
+  std::priority_queue<head_t, std::vector<head_t>, decltype(later)> heads(
+      later);
+  for (size_t i = 0; i < streams.size(); i++) {
+    commit_record_t rec;
+    if (streams[i]->next(rec))
+      heads.push({rec, i});
+  }
+
+  commit_history_t history;
+  history.resize(opts.history);
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t checked = 0;
+  int rval = 0;
+  while (!heads.empty()) {
+    head_t head = heads.top();
+    heads.pop();
+    commit_record_t &rec = head.first;
+
+    history.push(rec);
+    rval = cospike_cosim(rec.time,
+                         rec.hartid,
+                         rec.has_wdata,
+                         rec.valid,
+                         rec.iaddr,
+                         rec.insn,
+                         rec.exception,
+                         rec.interrupt,
+                         rec.cause,
+                         rec.wdata,
+                         rec.priv);
+    if (rval) {
+      printf("[ERROR] cospike-replay: Hart %d mismatch at time %" PRIu64
+             " pc 0x%" PRIx64 " (record %" PRIu64 ") with %d\n",
+             rec.hartid,
+             rec.time,
+             rec.iaddr,
+             checked,
+             rval);
+      printf("[ERROR] cospike-replay: Preceding commits:\n");
+      history.dump(stdout);
+      break;
+    }
+    checked++;
+
+    if (streams[head.second]->next(rec))
+      heads.push({rec, head.second});
+  }
+
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  for (size_t i = 0; i < streams.size(); i++) {
+    printf("[INFO] cospike-replay: Hart %d: %d trace chunks\n",
+           harts[i],
+           streams[i]->chunks());
+    delete streams[i];
+  }
+  printf("[INFO] cospike-replay: Checked %" PRIu64
+         " records in %.2fs (%.0f records/s)\n",
+         checked,
+         secs,
+         secs > 0 ? checked / secs : 0.0);
+  return rval;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-d dir] [-j threads] [-H hart[,hart...]] [-n history] "
+          "[-p] [+plusargs...]\n"
+          "  -d  directory holding COSPIKE-CONFIG, FIRESIM-BOOTROM and "
+          "COSPIKE-TRACES (default: .)\n"
+          "  -j  number of trace chunks decompressed ahead (default: host "
+          "cores)\n"
+          "  -H  harts to replay (default: all)\n"
+          "  -n  commits to print before a mismatch (default: 64)\n"
+          "  -p  replay each hart in its own process\n"
+          "  +plusargs are passed through to cospike\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  replay_opts_t opts;
+  opts.prefetch = std::thread::hardware_concurrency();
+  std::vector<int> harts;
+  bool per_hart_process = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:j:H:n:ph")) != -1) {
+    switch (opt) {
+    case 'd':
+      opts.dir = optarg;
+      break;
+    case 'j':
+      opts.prefetch = atol(optarg);
+      break;
+    case 'H':
+      for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+        harts.push_back(atoi(tok));
+      break;
+    case 'n':
+      opts.history = atol(optarg);
+      break;
+    case 'p':
+      per_hart_process = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    if (argv[i][0] != '+')
+      usage(argv[0]);
+    opts.plusargs.push_back(argv[i]);
+  }
+
+  auto cfg = read_config(opts.dir);
+  std::string bootrom = read_bootrom(opts.dir);
+  if (harts.empty()) {
+    for (int h = 0; h < atoi(cfg["nharts"].c_str()); h++)
+      harts.push_back(h);
+  }
+
+  if (!per_hart_process || harts.size() == 1)
+    return replay(opts, cfg, bootrom, harts) ? 1 : 0;
+
+  // spike state is global in cospike_impl, so isolate harts by process
+  opts.prefetch = std::max(opts.prefetch / harts.size(), (size_t)1);
+  std::map<pid_t, int> children;
+  fflush(stdout);
+  for (int h : harts) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (pid == 0) {
+      int rval = replay(opts, cfg, bootrom, {h});
+      fflush(stdout);
+      _exit(rval ? 1 : 0);
+    }
+    children[pid] = h;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < harts.size(); i++) {
+    int status;
+    pid_t pid = wait(&status);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok) {
+      printf("[ERROR] cospike-replay: Hart %d failed\n", children[pid]);
+      failed = 1;
+    }
+  }
+  printf("[INFO] cospike-replay: %s\n", failed ? "FAILED" : "PASSED");
+  return failed;
+}
@@ -1,4 +1,5 @@
 #include "thread_pool.h"
+#include "trace_record.h"
 #include <algorithm>
 #include <inttypes.h>
 #include <zlib.h>
@@ -11,44 +12,23 @@ void print_insn_logs(trace_t trace, const std::string &oname) {
 
   const size_t bytes_per_trace = cfg._bits_per_trace / 8;
 
+  commit_record_t rec;
   for (uint32_t offset = 0; offset < buf_bytes; offset += bytes_per_trace) {
-    uint8_t *cur_buf = buf + offset;
-    uint64_t time = EXTRACT_ALIGNED(
-        int64_t, uint64_t, cur_buf, cfg._time_width, cfg._time_offset);
-    bool valid = cur_buf[cfg._valid_offset];
-    // this crazy to extract the right value then sign extend within the size
-    uint64_t iaddr = EXTRACT_ALIGNED(int64_t,
-                                     uint64_t,
-                                     cur_buf,
-                                     cfg._iaddr_width,
-                                     cfg._iaddr_offset); // aka the pc
-    uint32_t insn = EXTRACT_ALIGNED(
-        int32_t, uint32_t, cur_buf, cfg._insn_width, cfg._insn_offset);
-    bool exception = cur_buf[cfg._exception_offset];
-    bool interrupt = cur_buf[cfg._interrupt_offset];
-    uint64_t cause = EXTRACT_ALIGNED(
-        int64_t, uint64_t, cur_buf, cfg._cause_width, cfg._cause_offset);
-    bool has_w = cfg._wdata_width != 0;
-    uint64_t wdata = cfg._wdata_width != 0 ? EXTRACT_ALIGNED(int64_t,
-                                                             uint64_t,
-                                                             cur_buf,
-                                                             cfg._wdata_width,
-                                                             cfg._wdata_offset)
-                                           : 0;
-    uint8_t priv = cur_buf[cfg._priv_offset];
-
-    if (valid || exception || cause) {
+    decode_commit(cfg, buf + offset, rec);
+    if (rec.needs_cosim()) {
       gzprintf(trace_file,
-               "%ld %lu %lx %d %d %d %d %d %lx\n",
-               cfg._hartid,
-               time,
-               iaddr,
-               valid,
-               exception,
-               interrupt,
-               (cfg._wdata_width != 0),
-               (int)cause,
-               wdata);
+               COMMIT_RECORD_FMT,
+               rec.hartid,
+               rec.time,
+               rec.iaddr,
+               rec.valid,
+               rec.exception,
+               rec.interrupt,
+               rec.has_wdata,
+               (int)rec.cause,
+               rec.wdata,
+               rec.insn,
+               rec.priv);
     }
   }
   gzclose(trace_file);
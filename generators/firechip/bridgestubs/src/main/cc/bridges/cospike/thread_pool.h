@@ -3,6 +3,7 @@
 
 /* https://stackoverflow.com/questions/15752659/thread-pooling-in-c11 */
 
+#include "bridges/host_placement.h"
 #include "mem_pool.h"
 #include <condition_variable>
 #include <cstdint>
@@ -128,15 +129,26 @@ class threadpool_t {
   using job_t = std::function<void(T, S)>;
 
 public:
-  void start(uint32_t max_concurrency) {
+  // Workers are restricted to cpus, if given
+  void start(uint32_t max_concurrency, const std::vector<int> &cpus = {}) {
     const uint32_t num_threads = std::max(
         std::thread::hardware_concurrency() / 16,
         std::min(std::thread::hardware_concurrency(), max_concurrency));
     for (uint32_t ii = 0; ii < num_threads; ++ii) {
       threads.emplace_back(std::thread(&threadpool_t::threadloop, this));
+      pin_thread(threads.back().native_handle(), cpus);
     }
   }
 
+  size_t num_threads() const { return threads.size(); }
+
+  // The CPUs the workers may run on
+  std::vector<int> cpus() {
+    if (threads.empty())
+      return {};
+    return thread_cpus(threads.front().native_handle());
+  }
+
   void queue_job(const job_t &job, const T &trace, S &oname) {
     {
       std::unique_lock<std::mutex> lock(queue_mutex);
@@ -147,6 +159,7 @@ public:
     mutex_condition.notify_one();
   }
 
+  // Runs the jobs still queued, then joins the workers
   void stop() {
     {
       std::unique_lock<std::mutex> lock(queue_mutex);
@@ -159,6 +172,11 @@ public:
     threads.clear();
   }
 
+  size_t queue_depth() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return jobs.size();
+  }
+
   bool busy() {
     bool poolbusy;
     {
@@ -178,7 +196,8 @@ private:
         std::unique_lock<std::mutex> lock(queue_mutex);
         mutex_condition.wait(
             lock, [this] { return !jobs.empty() || should_terminate; });
-        if (should_terminate) {
+        // Only stop once the queued jobs are done
+        if (jobs.empty()) {
           return;
         }
         job = jobs.front();
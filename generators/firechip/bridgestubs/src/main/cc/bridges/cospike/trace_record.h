@@ -0,0 +1,156 @@
+#ifndef __TRACE_RECORD_H__
+#define __TRACE_RECORD_H__
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <vector>
+
+// A single commit extracted from a cospike trace token. This is exactly the
+// set of values handed to cospike_cosim, so it can be replayed later.
+struct commit_record_t {
+  uint64_t time;
+  uint64_t iaddr;
+  uint64_t cause;
+  uint64_t wdata;
+  uint32_t insn;
+  int32_t hartid;
+  bool valid;
+  bool exception;
+  bool interrupt;
+  bool has_wdata;
+  uint8_t priv;
+
+  // Only tokens that retire or trap are checked against spike
+  bool needs_cosim() const { return valid || exception || cause; }
+};
+
+// Extract a commit from a trace token (the buffer must be aligned as pulled)
+static inline void
+decode_commit(const trace_cfg_t &cfg, uint8_t *buf, commit_record_t &rec) {
+  rec.time = EXTRACT_ALIGNED(
+      int64_t, uint64_t, buf, cfg._time_width, cfg._time_offset);
+  rec.valid = buf[cfg._valid_offset];
+  // this crazy to extract the right value then sign extend within the size
+  rec.iaddr = EXTRACT_ALIGNED(int64_t,
+                              uint64_t,
+                              buf,
+                              cfg._iaddr_width,
+                              cfg._iaddr_offset); // aka the pc
+  rec.insn = EXTRACT_ALIGNED(
+      int32_t, uint32_t, buf, cfg._insn_width, cfg._insn_offset);
+  rec.exception = buf[cfg._exception_offset];
+  rec.interrupt = buf[cfg._interrupt_offset];
+  rec.cause = EXTRACT_ALIGNED(
+      int64_t, uint64_t, buf, cfg._cause_width, cfg._cause_offset);
+  rec.has_wdata = cfg._wdata_width != 0;
+  rec.wdata = rec.has_wdata ? EXTRACT_ALIGNED(int64_t,
+                                              uint64_t,
+                                              buf,
+                                              cfg._wdata_width,
+                                              cfg._wdata_offset)
+                            : 0;
+  rec.priv = buf[cfg._priv_offset];
+  rec.hartid = cfg._hartid;
+}
+
+// Text format of a recorded commit (one per line in COSPIKE-TRACE-*.gz).
+// The first nine fields are the original trace format; insn and priv were
+// appended so that a recorded trace carries everything needed for replay.
+#define COMMIT_RECORD_FMT                                                      \
+  "%d %" PRIu64 " %" PRIx64 " %d %d %d %d %d %" PRIx64 " %x %d\n"
+#define COMMIT_RECORD_BASE_FIELDS 9
+#define COMMIT_RECORD_FIELDS 11
+
+// Parse one line written with COMMIT_RECORD_FMT. Only the cause code is
+// recorded, so interrupts get their cause sign-extended from cause_width
+// bytes like decode_commit does. Returns the number of fields found
+// (COMMIT_RECORD_BASE_FIELDS for traces without insn/priv), or 0 if the line
+// is malformed.
+static inline int
+parse_commit(const char *line, uint32_t cause_width, commit_record_t &rec) {
+  int hartid, valid, exception, interrupt, has_wdata, cause, priv = 0;
+  unsigned int insn = 0;
+  int n = sscanf(line,
+                 "%d %" SCNu64 " %" SCNx64 " %d %d %d %d %d %" SCNx64 " %x %d",
+                 &hartid,
+                 &rec.time,
+                 &rec.iaddr,
+                 &valid,
+                 &exception,
+                 &interrupt,
+                 &has_wdata,
+                 &cause,
+                 &rec.wdata,
+                 &insn,
+                 &priv);
+  if (n < COMMIT_RECORD_BASE_FIELDS)
+    return 0;
+
+  rec.hartid = hartid;
+  rec.valid = valid;
+  rec.exception = exception;
+  rec.interrupt = interrupt;
+  rec.has_wdata = has_wdata;
+  rec.cause = (uint32_t)cause;
+  if (interrupt)
+    rec.cause |= ~0ULL << (cause_width * 8 - 1);
+  rec.insn = insn;
+  rec.priv = priv;
+  return n;
+}
+
+// Ring of the last N commits sent to cospike. Pushing is a struct copy so it
+// can stay enabled at full speed; records are only formatted by dump(), when
+// a mismatch needs explaining.
+class commit_history_t {
+public:
+  void resize(size_t n) {
+    ring.assign(n, commit_record_t());
+    head = 0;
+    count = 0;
+  }
+
+  void push(const commit_record_t &rec) {
+    if (ring.empty())
+      return;
+    ring[head] = rec;
+    head = (head + 1 == ring.size()) ? 0 : head + 1;
+    count++;
+  }
+
+  // Oldest first, the most recent commit (the failing one) last
+  void dump(FILE *f) const {
+    size_t n = std::min(count, (uint64_t)ring.size());
+    size_t idx = (head + ring.size() - n) % std::max(ring.size(), (size_t)1);
+    fprintf(f, "# last %zu of %" PRIu64 " commits, oldest first\n", n, count);
+    for (size_t i = 0; i < n; i++) {
+      const commit_record_t &rec = ring[idx];
+      fprintf(f,
+              "C[%d] T(%" PRIu64 ") V(%d) PC(0x%" PRIx64 ") Insn(0x%08x) "
+              "EIC(%d:%d:0x%" PRIx64 ") Wdata(%d:0x%" PRIx64 ") Priv(%d)\n",
+              rec.hartid,
+              rec.time,
+              rec.valid,
+              rec.iaddr,
+              rec.insn,
+              rec.exception,
+              rec.interrupt,
+              rec.cause,
+              rec.has_wdata,
+              rec.wdata,
+              rec.priv);
+      idx = (idx + 1 == ring.size()) ? 0 : idx + 1;
+    }
+  }
+
+  size_t capacity() const { return ring.size(); }
+
+private:
+  std::vector<commit_record_t> ring;
+  size_t head = 0;
+  uint64_t count = 0;
+};
+
+#endif //__TRACE_RECORD_H__
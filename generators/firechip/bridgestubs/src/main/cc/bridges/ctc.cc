@@ -1,15 +1,19 @@
 // See LICENSE for license details
 
 #include "ctc.h"
+#include "bridges/bigtoken_codec.h"
 #include "core/simif.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
 
 #include <cassert>
+#include <cinttypes>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
 
@@ -21,7 +25,12 @@ char ctc_t::KIND;
 
 #define BUFWIDTH streaming_bridge_driver_t::STREAM_WIDTH_BYTES
 #define BUFBYTES (SIMLATENCY_BT * BUFWIDTH)
-#define EXTRABYTES 1 // Taken from NIC, leaving for future error checking
+#define EXTRABYTES 1 // Taken from NIC, holds WINDOWCHECK on the fifos
+
+#define WINDOWBYTES (window_bt * BUFWIDTH)
+// Follows every uncompressed window on the fifos, so that chips disagreeing
+// on the window size notice; never 0 like the bytes of idle tokens
+#define WINDOWCHECK ((char)(window_bt % 255 + 1))
 
 ctc_t::ctc_t(simif_t &simif,
               StreamEngine &stream,
@@ -39,7 +48,10 @@ ctc_t::ctc_t(simif_t &simif,
   // Read plusargs
   std::string macaddr_arg = std::string("+macaddr") + std::to_string(chipno) + std::string("=");
 
-  // Use macaddr as chip id for now
+  // Use macaddr as chip id for now, unless given by +ctcchip, which
+  // also covers every CTC port of a chip
+  const std::string chip_arg = std::string("+ctcchip=");
+  chip_id = 0;
   for (auto &arg : args) {
     if (arg.find(macaddr_arg) == 0) {
       int mac_octets[6];
@@ -64,6 +76,12 @@ ctc_t::ctc_t(simif_t &simif,
       }
     }
   }
+  for (auto &arg : args) {
+    if (arg.find(chip_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + chip_arg.length();
+      chip_id = atoi(str);
+    }
+  }
 
   const std::string num_equals = std::to_string(chip_id) + std::string("=");
   const std::string chip1_arg = std::string("+connectid") + num_equals;
@@ -81,9 +99,19 @@ ctc_t::ctc_t(simif_t &simif,
   const std::string chip0fifo_arg = std::string("+fifofile") + num_equals;
   const std::string chip1fifo_arg = std::string("+fifofile") + chip1no + std::string("=");
   const std::string latency_arg = std::string("+ctclatency") + num_equals;
+  const std::string compress_arg = std::string("+ctccompress") + num_equals;
+  const std::string ring_arg = std::string("+ctcring") + num_equals;
+  const std::string windows_arg = std::string("+ctcwindows") + num_equals;
+  const std::string router_arg = std::string("+ctcrouter") + num_equals;
 
   fifo0_path = "";
   fifo1_path = "";
+  fifo0_fd = -1;
+  fifo1_fd = -1;
+  compress = false;
+  ring_depth = 0;
+  windows = 1;
+  bool routed = false;
 
   for (auto &arg : args) {
     if(arg.find(chip0fifo_arg) == 0) {
@@ -96,46 +124,152 @@ ctc_t::ctc_t(simif_t &simif,
       char *str = const_cast<char *>(arg.c_str()) + latency_arg.length();
       this->LINKLATENCY = atoi(str);
     }
+    if(arg.find(compress_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + compress_arg.length();
+      compress = atoi(str) != 0;
+    }
+    if(arg.find(ring_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + ring_arg.length();
+      ring_depth = atoi(str);
+    }
+    if(arg.find(windows_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + windows_arg.length();
+      windows = atoi(str);
+    }
+    if(arg.find(router_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + router_arg.length();
+      routed = atoi(str) != 0;
+    }
+  }
+
+  if (routed) {
+    // Through firesim-ctc-router (see ctcrouter/ctc_router.h), port chipno
+    // leads to chip chipno, as in tests/multi-ctc-test.c
+    chip1_id = chipno;
+    if (!ring_depth)
+      ring_depth = 2;
+    printf("[CTC] CHIP%d: port %d routed to chip %d\n",
+           chip_id,
+           chipno,
+           chip1_id);
   }
 
   printf("[CTC] CHIP%d: got fifo0 path %s\n", chip_id, fifo0_path.c_str());
   printf("[CTC] CHIP%d: got fifo1 path %s\n", chip_id, fifo1_path.c_str());
 
   printf("[CTC] Link latency = %d\n", this->LINKLATENCY);
+  if (windows == 0 || SIMLATENCY_BT % windows != 0) {
+    printf("[CTC] CHIP%d: +ctcwindows%d=%u must divide the link latency of "
+           "%d big tokens\n",
+           chip_id,
+           chip_id,
+           windows,
+           SIMLATENCY_BT);
+    exit(1);
+  }
+  window_bt = SIMLATENCY_BT / windows;
+  // Both chips of a link must agree on the windows and compression
+  printf("[CTC] CHIP%d: %u windows of %u big tokens in flight\n",
+         chip_id,
+         windows,
+         window_bt);
+  if (compress)
+    printf("[CTC] CHIP%d: compressing link windows\n", chip_id);
+
+  if (stream_from_cpu_depth < SIMLATENCY_BT) {
+    // Workaround: pick a smaller latency, or up-size the queue.
+    printf("[CTC] CPU-to-FPGA stream undersized for requested link latency. "
+           "Available: %d Required: %d\n",
+           stream_from_cpu_depth,
+           SIMLATENCY_BT);
+    exit(1);
+  }
+  if (stream_to_cpu_depth < (int)window_bt) {
+    // Workaround: use more windows, or up-size the queue.
+    printf("[CTC] FPGA-to-CPU stream undersized for requested window. "
+           "Available: %d Required: %u\n",
+           stream_to_cpu_depth,
+           window_bt);
+    exit(1);
+  }
 
-  fifo0_path = fifo0_path + std::string("fifo") + std::to_string(chip_id);
-  fifo1_path = fifo1_path + std::string("fifo") + chip1no;
+  wire_bytes =
+      compress ? bigtoken_max_encoded(window_bt) : WINDOWBYTES + EXTRABYTES;
+  if (ring_depth) {
+    // Each chip names the ring it produces; both chips must use the same
+    // depth. It should be at least windows for them all to be in flight.
+    size_t slot_bytes = compress ? wire_bytes : WINDOWBYTES;
+    std::string tx_name = "/ctc" + std::to_string(chip_id) + "to" +
+                          std::to_string(chip1_id) + "_ring";
+    std::string rx_name = "/ctc" + std::to_string(chip1_id) + "to" +
+                          std::to_string(chip_id) +
+                          (routed ? "_routed_ring" : "_ring");
+    printf("[CTC] CHIP%d: %u-window shmem rings %s and %s\n",
+           chip_id,
+           ring_depth,
+           tx_name.c_str(),
+           rx_name.c_str());
+    tx_ring = std::make_unique<shmem_ring_t>(tx_name, ring_depth, slot_bytes);
+    rx_ring = std::make_unique<shmem_ring_t>(rx_name, ring_depth, slot_bytes);
+  } else {
+    fifo0_path = fifo0_path + std::string("fifo") + std::to_string(chip_id);
+    fifo1_path = fifo1_path + std::string("fifo") + chip1no;
+
+    printf("[CTC] CHIP%d: got fifo0 file %s\n", chip_id, fifo0_path.c_str());
+    printf("[CTC] CHIP%d: got fifo1 file %s\n", chip_id, fifo1_path.c_str());
 
-  printf("[CTC] CHIP%d: got fifo0 file %s\n", chip_id, fifo0_path.c_str());
-  printf("[CTC] CHIP%d: got fifo1 file %s\n", chip_id, fifo1_path.c_str());
+    mkfifo(fifo0_path.c_str(), 0666);
 
-  mkfifo(fifo0_path.c_str(), 0666);
+    tx_queue.reserve(windows * wire_bytes);
+    rx_queue.resize(windows * wire_bytes);
+  }
+  if (compress)
+    in_buf.resize(WINDOWBYTES);
 
   // For storing data that is pushed/pulled from the stream
-  buf = static_cast<char*>(aligned_alloc(64, BUFBYTES + EXTRABYTES));
-  memset(buf, 0, BUFBYTES + EXTRABYTES);
+  // (aligned_alloc needs a multiple of the alignment)
+  size_t buf_bytes = (BUFBYTES + EXTRABYTES + 63) & ~(size_t)63;
+  buf = static_cast<char*>(aligned_alloc(64, buf_bytes));
+  memset(buf, 0, buf_bytes);
 }
 
 ctc_t::~ctc_t() {
+  if (compress && rounds) {
+    uint64_t raw = rounds * WINDOWBYTES;
+    printf("[CTC] CHIP%d: compressed %" PRIu64 " windows to %.1f%% sent and "
+           "%.1f%% received of %" PRIu64 " bytes each way\n",
+           chip_id,
+           rounds,
+           100.0 * link_bytes_sent / raw,
+           100.0 * link_bytes_received / raw,
+           raw);
+  }
   free(buf);
 }
 
 void ctc_t::init() {
-  // Switch order between chips to prevent deadlock
-  if (chip_id > chip1_id) {
-    fifo0_fd = open(fifo0_path.c_str(), O_RDONLY);
-    printf("[CTC] CHIP%d: opened rd fifo0\n", chip_id);
-    fifo1_fd = open(fifo1_path.c_str(), O_WRONLY);
-    printf("[CTC] CHIP%d: opened wr fifo1\n", chip_id);
-  } else {
-    fifo1_fd = open(fifo1_path.c_str(), O_WRONLY);
-    printf("[CTC] CHIP%d: opened wr fifo1\n", chip_id);
-    fifo0_fd = open(fifo0_path.c_str(), O_RDONLY);
-    printf("[CTC] CHIP%d: opened rd fifo0\n", chip_id);
-  }
+  // The rings need no rendezvous: they exist once either chip maps them
+  if (!ring_depth) {
+    // Switch order between chips to prevent deadlock
+    if (chip_id > chip1_id) {
+      fifo0_fd = open(fifo0_path.c_str(), O_RDONLY);
+      printf("[CTC] CHIP%d: opened rd fifo0\n", chip_id);
+      fifo1_fd = open(fifo1_path.c_str(), O_WRONLY);
+      printf("[CTC] CHIP%d: opened wr fifo1\n", chip_id);
+    } else {
+      fifo1_fd = open(fifo1_path.c_str(), O_WRONLY);
+      printf("[CTC] CHIP%d: opened wr fifo1\n", chip_id);
+      fifo0_fd = open(fifo0_path.c_str(), O_RDONLY);
+      printf("[CTC] CHIP%d: opened rd fifo0\n", chip_id);
+    }
 
-  assert(fifo0_fd != -1 && "fifofile0 couldn't be opened\n");
-  assert(fifo1_fd != -1 && "fifofile1 couldn't be opened\n");
+    assert(fifo0_fd != -1 && "fifofile0 couldn't be opened\n");
+    assert(fifo1_fd != -1 && "fifofile1 couldn't be opened\n");
+
+    // tick() must not wait for the other chip, which may be windows behind
+    fcntl(fifo0_fd, F_SETFL, fcntl(fifo0_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fifo1_fd, F_SETFL, fcntl(fifo1_fd, F_GETFL) | O_NONBLOCK);
+  }
 
   // Taken from NIC
   auto token_bytes_to_send = SIMLATENCY_BT * BUFWIDTH;
@@ -154,60 +288,212 @@ void ctc_t::init() {
 
 }
 
+/* Move windows as far as they go without waiting: received windows into
+ * the stream, then the target's next windows to the other chip. Both chips
+ * simulate while windows are in flight rather than taking turns; a chip
+ * only stalls once it has used up the input the other chip has sent. */
 void ctc_t::tick() {
-  while(true) {
-    // Pull from the stream
-    uint32_t token_bytes_from_target = 0;
-    auto requested_token_bytes = BUFWIDTH * SIMLATENCY_BT; //Number of concatenated tokens * bytes per token
-    token_bytes_from_target =
-      pull(stream_to_cpu_idx,
-        buf,
-        requested_token_bytes,
-        requested_token_bytes // Copy only if the stream can provide
-                              // exactly as many bytes as we want
-      );
-
-    if (token_bytes_from_target == 0) {
-      return;
-    }
-    if (token_bytes_from_target != requested_token_bytes) {
-      printf("[CTC] Pulling from stream failed. Read %d bytes, expected %d bytes.\n", token_bytes_from_target, requested_token_bytes);
-      exit(1);
-    }
+  bool progress;
+  do {
+    progress = push_window();
+    progress |= fetch_window();
+    progress |= pull_window();
+    if (!tx_ring)
+      progress |= flush_tx();
+  } while (progress);
+}
 
-    // Write entire out buffer to the other chips's fifo
-    int bytes_written = ::write(fifo1_fd, buf, BUFBYTES + EXTRABYTES);
-    if (bytes_written != BUFBYTES + EXTRABYTES) {
-      printf("[CTC] Writing to fifo failed.\n");
-      exit(1);
+/* Pull a window from the stream, if the target has produced one, and queue
+ * it for the other chip. Returns false if there is none or no room for it,
+ * which holds the target back. */
+bool ctc_t::pull_window() {
+  char *slot = nullptr;
+  char *out = buf;
+  if (tx_ring) {
+    slot = tx_ring->try_reserve();
+    if (!slot)
+      return false;
+    // Straight into the ring when nothing needs encoding
+    if (!compress)
+      out = slot;
+  } else if (tx_queue.size() - tx_sent >= windows * wire_bytes) {
+    return false;
+  }
+
+  uint32_t token_bytes_from_target =
+    pull(stream_to_cpu_idx,
+      out,
+      WINDOWBYTES,
+      WINDOWBYTES // Copy only if the stream can provide
+                  // exactly as many bytes as we want
+    );
+  if (token_bytes_from_target == 0)
+    return false;
+  if (token_bytes_from_target != WINDOWBYTES) {
+    printf("[CTC] Pulling from stream failed. Read %d bytes, expected %d bytes.\n", token_bytes_from_target, WINDOWBYTES);
+    exit(1);
+  }
+
+  if (tx_ring) {
+    if (compress)
+      link_bytes_sent +=
+          bigtoken_encode(ctc_bigtoken_format, out, window_bt, slot);
+    tx_ring->publish();
+    return true;
+  }
+
+  // Drop what the fifo has taken, then append the window
+  tx_queue.erase(tx_queue.begin(), tx_queue.begin() + tx_sent);
+  tx_sent = 0;
+  size_t at = tx_queue.size();
+  if (compress) {
+    tx_queue.resize(at + bigtoken_max_encoded(window_bt));
+    size_t len =
+        bigtoken_encode(ctc_bigtoken_format, out, window_bt, &tx_queue[at]);
+    tx_queue.resize(at + len);
+    link_bytes_sent += len;
+  } else {
+    tx_queue.insert(tx_queue.end(), out, out + WINDOWBYTES);
+    tx_queue.push_back(WINDOWCHECK);
+  }
+  return true;
+}
+
+/* Write as much of tx_queue as the fifo takes. */
+bool ctc_t::flush_tx() {
+  if (tx_sent == tx_queue.size())
+    return false;
+  ssize_t n =
+      ::write(fifo1_fd, tx_queue.data() + tx_sent, tx_queue.size() - tx_sent);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return false;
+    printf("[CTC] Writing to fifo failed: %s\n", strerror(errno));
+    exit(1);
+  }
+  tx_sent += n;
+  return n > 0;
+}
+
+/* Take the other chip's next window, if it has arrived and the previous one
+ * has been pushed, and point in_window at it. */
+bool ctc_t::fetch_window() {
+  if (in_window)
+    return false;
+
+  if (rx_ring) {
+    char *slot = rx_ring->try_peek();
+    if (!slot)
+      return false;
+    if (!compress) {
+      // Released once pushed
+      in_window = slot;
+      return true;
     }
+    decode_window(slot, rx_ring->slot_bytes());
+    rx_ring->release();
+    in_window = in_buf.data();
+    return true;
+  }
 
-    // Read my own fifo until I read all the "in" chars
-    int bytes_read = ::read(fifo0_fd, buf, BUFBYTES + EXTRABYTES);
-    if (bytes_read != BUFBYTES + EXTRABYTES) {
+  // Drop the window pushed last, then read whatever has arrived
+  if (rx_consumed) {
+    memmove(rx_queue.data(),
+            rx_queue.data() + rx_consumed,
+            rx_filled - rx_consumed);
+    rx_filled -= rx_consumed;
+    rx_consumed = 0;
+  }
+  ssize_t n = 0;
+  if (rx_filled < rx_queue.size()) {
+    n = ::read(fifo0_fd,
+               rx_queue.data() + rx_filled,
+               rx_queue.size() - rx_filled);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
       printf("[CTC] Reading from fifo failed.\n");
-      exit(1); 
+      exit(1);
     }
+    if (n > 0)
+      rx_filled += n;
+  }
 
-    // Push to the stream
-    uint32_t token_bytes_to_target = 0;
-    token_bytes_to_target =
-      push(stream_from_cpu_idx,
-        buf,
-        BUFWIDTH * SIMLATENCY_BT,
-        BUFWIDTH * SIMLATENCY_BT);
+  size_t len = WINDOWBYTES + EXTRABYTES;
+  if (compress) {
+    // The header gives the length of the rest
+    if (rx_filled < BIGTOKEN_CODEC_HEADER_BYTES)
+      return n > 0;
+    len = bigtoken_encoded_size(rx_queue.data(), window_bt);
+    if (!len)
+      decode_window(rx_queue.data(), len); // Reports the bad header
+  }
+  if (rx_filled < len)
+    return n > 0;
 
-    if (token_bytes_to_target != BUFWIDTH * SIMLATENCY_BT) {
-      printf("[CTC] Pushing to stream failed. Wrote %d bytes, expected %d bytes.\n", token_bytes_to_target, BUFWIDTH * SIMLATENCY_BT);
-      exit(1);
-    }
+  if (compress) {
+    decode_window(rx_queue.data(), len);
+    in_window = in_buf.data();
+  } else {
+    if (rx_queue[WINDOWBYTES] != WINDOWCHECK)
+      bad_window();
+    in_window = rx_queue.data();
   }
+  rx_consumed = len;
+  return true;
+}
+
+/* Push in_window to the stream if it has room. Returns false if the target
+ * has yet to consume enough of the windows before it. */
+bool ctc_t::push_window() {
+  if (!in_window)
+    return false;
+  uint32_t token_bytes_to_target =
+    push(stream_from_cpu_idx,
+      const_cast<char *>(in_window),
+      WINDOWBYTES,
+      WINDOWBYTES);
+  if (token_bytes_to_target == 0)
+    return false;
+  if (token_bytes_to_target != WINDOWBYTES) {
+    printf("[CTC] Pushing to stream failed. Wrote %d bytes, expected %d bytes.\n", token_bytes_to_target, WINDOWBYTES);
+    exit(1);
+  }
+  if (rx_ring && !compress)
+    rx_ring->release();
+  in_window = nullptr;
+  rounds++;
+  return true;
+}
+
+/* Expand an encoded window of len bytes into in_buf. */
+void ctc_t::decode_window(const char *in, size_t len) {
+  if (!len || !bigtoken_decode(ctc_bigtoken_format,
+                               in,
+                               len,
+                               in_buf.data(),
+                               window_bt))
+    bad_window();
+  link_bytes_received += bigtoken_encoded_size(in, window_bt);
+}
+
+/* Give up on a window that does not match this chip's link settings. */
+void ctc_t::bad_window() {
+  printf("[CTC] CHIP%d: malformed window from chip %d; does it run with "
+         "+ctccompress%d=%d and +ctcwindows%d=%u?\n",
+         chip_id,
+         chip1_id,
+         chip1_id,
+         compress,
+         chip1_id,
+         windows);
+  exit(1);
 }
 
 void ctc_t::finish() {
   // Close the fifos
-  close(fifo0_fd);
-  close(fifo1_fd);
+  if (fifo0_fd >= 0)
+    close(fifo0_fd);
+  if (fifo1_fd >= 0)
+    close(fifo1_fd);
 }
 
 
@@ -4,6 +4,7 @@
 #define __CTC_H
 
 #include "bridges/serial_data.h"
+#include "bridges/shmem_ring.h"
 #include "core/bridge_driver.h"
 #include "core/stream_engine.h"
 
@@ -39,6 +40,14 @@ public:
   void finish() override;
 
 private:
+  // Each returns whether it moved a window or any bytes, and never blocks
+  bool pull_window();
+  bool flush_tx();
+  bool fetch_window();
+  bool push_window();
+  void decode_window(const char *in, size_t len);
+  [[noreturn]] void bad_window();
+
   const CTCBRIDGEMODULE_struct mmio_addrs;
   std::string fifo0_path;
   std::string fifo1_path;
@@ -50,6 +59,41 @@ private:
 
   int LINKLATENCY;
 
+  // The link latency is exchanged in windows of window_bt big tokens
+  // (+ctcwindows splits it into that many), so a chip can send its first
+  // window while still simulating the rest; up to windows of them are in
+  // flight each way
+  uint32_t windows;
+  uint32_t window_bt;
+  // Largest a window gets on the link
+  size_t wire_bytes;
+
+  // Shared-memory rings to and from the other chip (+ctcring), holding up
+  // to ring_depth windows each way; the fifos are used if ring_depth is 0
+  uint32_t ring_depth;
+  std::unique_ptr<shmem_ring_t> tx_ring;
+  std::unique_ptr<shmem_ring_t> rx_ring;
+
+  // The fifos are non-blocking: bytes the other chip has not taken yet wait
+  // in tx_queue from tx_sent on, and bytes of windows not yet complete or
+  // not yet pushed wait in rx_queue up to rx_filled
+  std::vector<char> tx_queue;
+  size_t tx_sent = 0;
+  std::vector<char> rx_queue;
+  size_t rx_filled = 0;
+  size_t rx_consumed = 0;
+
+  // The received window waiting for room in the stream: a slot of rx_ring,
+  // a part of rx_queue or in_buf
+  const char *in_window = nullptr;
+  std::vector<char> in_buf;
+
+  // Windows cross the link run-length encoded (+ctccompress), see
+  // bigtoken_codec.h
+  bool compress;
+  uint64_t rounds = 0;
+  uint64_t link_bytes_sent = 0, link_bytes_received = 0;
+
   const int stream_to_cpu_idx;
   const int stream_from_cpu_idx;
 };
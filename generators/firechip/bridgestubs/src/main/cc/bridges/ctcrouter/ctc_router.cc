@@ -0,0 +1,255 @@
+// See LICENSE for license details
+
+#include "ctc_router.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bridges/bigtoken_codec.h"
+#include "bridges/host_service.h"
+#include "bridges/shmem_ring.h"
+
+#define CTC_ROUTER_LINKS_PER_THREAD 16
+// Idle passes over its links before a worker starts sleeping between them
+#define CTC_ROUTER_SPIN_PASSES 1024
+#define CTC_ROUTER_SLEEP_US 20
+
+// As TOKENS_PER_BIGTOKEN and BUFWIDTH in ctc.cc
+#define CTC_BIGTOKEN_CYCLES 7
+#define CTC_BIGTOKEN_BYTES 64
+#define CTC_BIGTOKEN_WORDS 8
+
+struct ctc_router_t::link_t {
+  uint32_t from, to;
+  uint32_t latency;
+  std::unique_ptr<shmem_ring_t> rx_ring; // /ctc<from>to<to>_ring
+  std::unique_ptr<shmem_ring_t> tx_ring; // /ctc<from>to<to>_routed_ring
+
+  // Big tokens on their way through the router, oldest first; starts with
+  // the idle tokens making up the extra latency
+  std::vector<char> line;
+  size_t delay_bytes;
+
+  uint64_t windows = 0;
+  uint64_t flits = 0;
+};
+
+bool parse_ctc_router_latencies(const std::string &spec,
+                                std::vector<ctc_router_latency_t> &latencies) {
+  for (auto &item : split_list(spec)) {
+    ctc_router_latency_t latency;
+    char trailingjunk;
+    if (sscanf(item.c_str(),
+               "%u-%u:%u%c",
+               &latency.a,
+               &latency.b,
+               &latency.latency,
+               &trailingjunk) != 3) {
+      fprintf(stderr, "Bad router link latency \"%s\"\n", item.c_str());
+      return false;
+    }
+    latencies.push_back(latency);
+  }
+  return true;
+}
+
+// Flits the chip sent in count big tokens, both directions of the link
+static uint64_t count_flits(const char *tokens, uint32_t count) {
+  const uint64_t *words = (const uint64_t *)tokens;
+  uint64_t flits = 0;
+  for (size_t i = 0; i < (size_t)count * CTC_BIGTOKEN_WORDS; i++) {
+    uint64_t valid = ctc_bigtoken_format.valid[i % CTC_BIGTOKEN_WORDS];
+    flits += __builtin_popcountll(words[i] & valid);
+  }
+  return flits;
+}
+
+ctc_router_t::ctc_router_t(const ctc_router_config_t &config)
+    : config(config) {
+  uint32_t latency_bt = config.link_latency / CTC_BIGTOKEN_CYCLES;
+  if (latency_bt == 0 || config.windows == 0 ||
+      latency_bt % config.windows != 0) {
+    fprintf(stderr,
+            "Router link latency (%u) must be at least %d cycles and split "
+            "into %u windows of whole big tokens\n",
+            config.link_latency,
+            CTC_BIGTOKEN_CYCLES,
+            config.windows);
+    abort();
+  }
+  if (config.chips < 2) {
+    fprintf(stderr, "A CTC router needs at least two chips\n");
+    abort();
+  }
+  if (config.ring_depth == 0) {
+    fprintf(stderr, "Router ring depth must be at least 1\n");
+    abort();
+  }
+  window_bt = latency_bt / config.windows;
+  size_t window_bytes = (size_t)window_bt * CTC_BIGTOKEN_BYTES;
+  size_t slot_bytes =
+      config.compress ? bigtoken_max_encoded(window_bt) : window_bytes;
+
+  // Link latencies as given, both ways
+  std::vector<uint32_t> latency(config.chips * config.chips,
+                                config.link_latency);
+  for (auto &l : config.latencies) {
+    if (l.a >= config.chips || l.b >= config.chips) {
+      fprintf(stderr,
+              "Router link %u-%u: only %u chips\n",
+              l.a,
+              l.b,
+              config.chips);
+      abort();
+    }
+    if (l.latency < config.link_latency ||
+        (l.latency - config.link_latency) % CTC_BIGTOKEN_CYCLES != 0) {
+      fprintf(stderr,
+              "Router link %u-%u: latency %u must be %u plus a multiple of "
+              "%d cycles\n",
+              l.a,
+              l.b,
+              l.latency,
+              config.link_latency,
+              CTC_BIGTOKEN_CYCLES);
+      abort();
+    }
+    latency[l.a * config.chips + l.b] = l.latency;
+    latency[l.b * config.chips + l.a] = l.latency;
+  }
+
+  for (uint32_t from = 0; from < config.chips; from++) {
+    for (uint32_t to = 0; to < config.chips; to++) {
+      auto link = std::make_unique<link_t>();
+      link->from = from;
+      link->to = to;
+      link->latency = latency[from * config.chips + to];
+      link->delay_bytes = (size_t)(link->latency - config.link_latency) /
+                          CTC_BIGTOKEN_CYCLES * CTC_BIGTOKEN_BYTES;
+      link->line.reserve(link->delay_bytes + 2 * window_bytes);
+      link->line.resize(link->delay_bytes);
+
+      std::string name =
+          "/ctc" + std::to_string(from) + "to" + std::to_string(to);
+      link->rx_ring = std::make_unique<shmem_ring_t>(
+          name + "_ring", config.ring_depth, slot_bytes);
+      link->tx_ring = std::make_unique<shmem_ring_t>(
+          name + "_routed_ring", config.ring_depth, slot_bytes);
+      links.push_back(std::move(link));
+    }
+  }
+
+  groups = split_worker_groups(
+      links, config.threads, CTC_ROUTER_LINKS_PER_THREAD);
+
+  printf("[INFO] CTC router: %u chips, %u cycle%s links in %u windows of "
+         "%u big tokens, %u-window rings, %zu worker threads\n",
+         config.chips,
+         config.link_latency,
+         config.compress ? " compressed" : "",
+         config.windows,
+         window_bt,
+         config.ring_depth,
+         groups.size());
+  for (auto &l : config.latencies)
+    printf("[INFO] CTC router: chips %u and %u %u cycles apart\n",
+           l.a,
+           l.b,
+           l.latency);
+
+  for (unsigned g = 0; g < groups.size(); g++)
+    workers.emplace_back(&ctc_router_t::run, this, g);
+}
+
+ctc_router_t::~ctc_router_t() { shutdown(); }
+
+void ctc_router_t::shutdown() {
+  stop = true;
+  for (auto &t : workers)
+    t.join();
+  workers.clear();
+}
+
+/* Poll the links of one group until stopped, backing off to short sleeps
+ * while none of them move. */
+void ctc_router_t::run(unsigned group) {
+  unsigned idle = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    bool progress = false;
+    for (link_t *link : groups[group])
+      progress |= forward(*link);
+    if (progress) {
+      idle = 0;
+    } else if (++idle >= CTC_ROUTER_SPIN_PASSES) {
+      usleep(CTC_ROUTER_SLEEP_US);
+    }
+  }
+}
+
+/* Move one window into and one out of the link's line, as far as the rings
+ * allow. Returns whether either happened. */
+bool ctc_router_t::forward(link_t &link) {
+  bool progress = false;
+  size_t window_bytes = (size_t)window_bt * CTC_BIGTOKEN_BYTES;
+
+  // The line never needs more than the delay and one window to send
+  char *slot;
+  if (link.line.size() < link.delay_bytes + window_bytes &&
+      (slot = link.rx_ring->try_peek())) {
+    size_t at = link.line.size();
+    link.line.resize(at + window_bytes);
+    if (!config.compress) {
+      memcpy(&link.line[at], slot, window_bytes);
+    } else if (!bigtoken_decode(ctc_bigtoken_format,
+                                slot,
+                                link.rx_ring->slot_bytes(),
+                                &link.line[at],
+                                window_bt)) {
+      fprintf(stderr,
+              "Router link %u->%u: malformed window; does chip %u run with "
+              "+ctccompress%u=1 and +ctcwindows%u=%u?\n",
+              link.from,
+              link.to,
+              link.from,
+              link.from,
+              link.from,
+              config.windows);
+      abort();
+    }
+    link.rx_ring->release();
+    link.windows++;
+    link.flits += count_flits(&link.line[at], window_bt);
+    progress = true;
+  }
+
+  if (link.line.size() >= window_bytes &&
+      (slot = link.tx_ring->try_reserve())) {
+    if (config.compress)
+      bigtoken_encode(ctc_bigtoken_format, link.line.data(), window_bt, slot);
+    else
+      memcpy(slot, link.line.data(), window_bytes);
+    link.tx_ring->publish();
+    link.line.erase(link.line.begin(), link.line.begin() + window_bytes);
+    progress = true;
+  }
+  return progress;
+}
+
+void ctc_router_t::print_stats(FILE *out) const {
+  for (auto &link : links) {
+    if (!link->windows)
+      continue;
+    uint64_t slots = link->windows * window_bt * CTC_BIGTOKEN_CYCLES * 2;
+    fprintf(out,
+            "[INFO] CTC router link %u->%u (%u cycles): %" PRIu64
+            " windows, %" PRIu64 " flits (%.2f%% of flit slots)\n",
+            link->from,
+            link->to,
+            link->latency,
+            link->windows,
+            link->flits,
+            100.0 * link->flits / slots);
+  }
+}
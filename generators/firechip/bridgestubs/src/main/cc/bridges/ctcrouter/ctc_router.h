@@ -0,0 +1,89 @@
+// See LICENSE for license details
+
+#ifndef __CTC_ROUTER_H
+#define __CTC_ROUTER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ctc_router_latency_t {
+  // Chips at either end of the link; a == b is a chip's loopback port
+  uint32_t a, b;
+  // Cycles from a flit leaving one chip to it reaching the other, both ways
+  uint32_t latency;
+};
+
+struct ctc_router_config_t {
+  uint32_t chips = 0;
+  // Must match +ctclatency, +ctcwindows, +ctcring and +ctccompress of every
+  // chip
+  uint32_t link_latency = 0;
+  uint32_t windows = 1;
+  uint32_t ring_depth = 2;
+  bool compress = false;
+  // Links slower than link_latency; the rest run at link_latency
+  std::vector<ctc_router_latency_t> latencies;
+  // Worker threads; 0 picks one per CTC_ROUTER_LINKS_PER_THREAD links
+  unsigned threads = 0;
+};
+
+// Parse "a-b:cycles[,a-b:cycles...]". Returns false (and prints why) on bad
+// input.
+bool parse_ctc_router_latencies(const std::string &spec,
+                                std::vector<ctc_router_latency_t> &latencies);
+
+/**
+ * Connects the CTC ports of several chips simulated on one host, so that
+ * every chip can reach every other one. Chip c must have one CTC port per
+ * chip, ordered as in tests/multi-ctc-test.c: port p is mapped at
+ * (0x10 * (p + 1)) << 32 and leads to chip p, and port c loops back to chip
+ * c itself. Each chip runs with +ctcchip=c and +ctcrouter<c>=1.
+ *
+ * CTC links carry ready and valid bits every cycle, so the router switches
+ * circuits rather than packets: port p of chip c is wired to port c of
+ * chip p. Every directed link is a delay line between the chip's shared-
+ * memory rings, /ctc<c>to<p>_ring in and /ctc<c>to<p>_routed_ring out. A
+ * chip's own +ctclatency covers link_latency cycles; the router adds the
+ * rest of a slower link by starting its line with that many idle cycles.
+ *
+ * Links never wait on each other, so the chips run as far ahead as their
+ * inputs allow; each worker thread polls its group of links.
+ */
+class ctc_router_t {
+public:
+  // Maps the rings and starts the worker threads
+  explicit ctc_router_t(const ctc_router_config_t &config);
+  ~ctc_router_t();
+
+  ctc_router_t(const ctc_router_t &) = delete;
+  ctc_router_t &operator=(const ctc_router_t &) = delete;
+
+  // Stop and join the workers. Safe to call more than once.
+  void shutdown();
+
+  // Per-link window and flit counts; only consistent once the router is
+  // shut down
+  void print_stats(FILE *out) const;
+
+private:
+  struct link_t;
+
+  void run(unsigned group);
+  bool forward(link_t &link);
+
+  ctc_router_config_t config;
+  uint32_t window_bt;
+  std::vector<std::unique_ptr<link_t>> links;
+  std::vector<std::vector<link_t *>> groups;
+
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> workers;
+};
+
+#endif // __CTC_ROUTER_H
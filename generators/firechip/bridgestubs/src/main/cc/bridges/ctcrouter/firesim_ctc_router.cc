@@ -0,0 +1,82 @@
+// See LICENSE for license details
+
+/* Standalone CTC router
+ *
+ * Connects the CTC ports of several chips simulated on the same host, e.g.
+ * four chips with 700-cycle links, except 1400 cycles between chips 0 and 3:
+ *
+ *   firesim-ctc-router -n 4 -l 700 0-3:1400
+ *
+ * with chip c started with +ctcchip=c, +ctcrouter<c>=1 and the same
+ * +ctclatency<c>, +ctcwindows<c>, +ctcring<c> and +ctccompress<c>. Chip c
+ * reaches the memory of chip d at CTC port d, (0x10 * (d + 1)) << 32. Runs
+ * until interrupted, then prints per-link traffic.
+ */
+
+#include "ctc_router.h"
+
+#include "bridges/host_service.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s -n chips -l cycles [-w windows] [-d depth] [-c] "
+          "[-t threads] [a-b:cycles]...\n"
+          "  -n  chips, each with one CTC port per chip\n"
+          "  -l  link latency, as +ctclatency on the chips\n"
+          "  -w  windows per latency, as +ctcwindows on the chips "
+          "(default: 1)\n"
+          "  -d  ring depth, as +ctcring on the chips (default: 2)\n"
+          "  -c  compressed links, as +ctccompress on the chips\n"
+          "  -t  worker threads (default: one per 16 links)\n"
+          "  a-b:cycles sets the latency between chips a and b, which must\n"
+          "  exceed the link latency by a multiple of 7 cycles\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  ctc_router_config_t config;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:w:d:ct:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      config.chips = atoi(optarg);
+      break;
+    case 'l':
+      config.link_latency = atoi(optarg);
+      break;
+    case 'w':
+      config.windows = atoi(optarg);
+      break;
+    case 'd':
+      config.ring_depth = atoi(optarg);
+      break;
+    case 'c':
+      config.compress = true;
+      break;
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (!config.chips || !config.link_latency)
+    usage(argv[0]);
+  for (int i = optind; i < argc; i++)
+    if (!parse_ctc_router_latencies(argv[i], config.latencies))
+      usage(argv[0]);
+
+  block_termination_signals();
+
+  ctc_router_t router(config);
+  wait_for_termination_signal();
+
+  router.shutdown();
+  router.print_stats(stdout);
+  return 0;
+}
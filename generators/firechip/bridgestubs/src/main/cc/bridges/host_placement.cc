@@ -0,0 +1,214 @@
+// See LICENSE for license details
+
+#include "host_placement.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#define SMALLPAGE_BYTES 4096
+
+// From <linux/mempolicy.h>, to not depend on libnuma
+#define MPOL_BIND 2
+#define MPOL_MF_MOVE (1 << 1)
+
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    int lo, hi;
+    char trailingjunk;
+    if (sscanf(range.c_str(), "%d-%d%c", &lo, &hi, &trailingjunk) == 2) {
+      // range
+    } else if (sscanf(range.c_str(), "%d%c", &lo, &trailingjunk) == 1) {
+      hi = lo;
+    } else {
+      fprintf(stderr, "Invalid CPU list \"%s\"\n", list.c_str());
+      return {};
+    }
+    if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+      fprintf(stderr, "Invalid CPU range \"%s\"\n", range.c_str());
+      return {};
+    }
+    for (int cpu = lo; cpu <= hi; cpu++)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+std::string format_cpu_list(const std::vector<int> &cpus) {
+  std::string out;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+      j++;
+    if (!out.empty())
+      out += ",";
+    out += std::to_string(cpus[i]);
+    if (j > i)
+      out += "-" + std::to_string(cpus[j]);
+    i = j;
+  }
+  return out.empty() ? "any" : out;
+}
+
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus) {
+  if (cpus.empty())
+    return true;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (err) {
+    fprintf(stderr,
+            "Could not pin thread to CPUs %s: %s\n",
+            format_cpu_list(cpus).c_str(),
+            strerror(err));
+    return false;
+  }
+  return true;
+}
+
+std::vector<int> thread_cpus(pthread_t thread) {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(thread, sizeof(set), &set))
+    return cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set))
+      cpus.push_back(cpu);
+  return cpus;
+}
+
+int cpu_numa_node(int cpu) {
+  // /sys/devices/system/cpu/cpuN/ has a nodeM link for its NUMA node
+  std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  std::error_code ec;
+  for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string name = entry.path().filename().string();
+    int node;
+    char trailingjunk;
+    if (sscanf(name.c_str(), "node%d%c", &node, &trailingjunk) == 1)
+      return node;
+  }
+  return -1;
+}
+
+int cpus_numa_node(const std::vector<int> &cpus) {
+  int node = -1;
+  for (int cpu : cpus) {
+    int n = cpu_numa_node(cpu);
+    if (n < 0 || (node >= 0 && n != node))
+      return -1;
+    node = n;
+  }
+  return node;
+}
+
+int pci_numa_node(const std::string &bdf) {
+  std::ifstream f("/sys/bus/pci/devices/" + bdf + "/numa_node");
+  int node = -1;
+  if (!(f >> node))
+    return -1;
+  return node;
+}
+
+int numa_node_most_free() {
+  int best = -1;
+  long best_free = -1;
+  std::error_code ec;
+  for (auto &entry :
+       std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+    std::string name = entry.path().filename().string();
+    int node;
+    char trailingjunk;
+    if (sscanf(name.c_str(), "node%d%c", &node, &trailingjunk) != 1)
+      continue;
+    // "Node 0 MemFree:        7934 kB"
+    std::ifstream meminfo(entry.path() / "meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+      int n;
+      long kb;
+      if (sscanf(line.c_str(), "Node %d MemFree: %ld", &n, &kb) == 2) {
+        if (kb > best_free) {
+          best = node;
+          best_free = kb;
+        }
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+int parse_numa_node(const std::string &spec) {
+  int node = -1;
+  if (spec == "auto") {
+    node = cpus_numa_node(thread_cpus(pthread_self()));
+    if (node < 0)
+      node = numa_node_most_free();
+  } else if (spec.find("pci:") == 0) {
+    node = pci_numa_node(spec.substr(4));
+  } else {
+    char trailingjunk;
+    if (sscanf(spec.c_str(), "%d%c", &node, &trailingjunk) != 1)
+      node = -1;
+  }
+  if (node < 0)
+    fprintf(stderr, "Could not resolve NUMA node \"%s\"\n", spec.c_str());
+  return node;
+}
+
+bool bind_numa_node(void *addr, size_t bytes, int node) {
+  unsigned long mask[16] = {};
+  if (node < 0 || node >= (int)(sizeof(mask) * 8)) {
+    fprintf(stderr, "Invalid NUMA node %d\n", node);
+    return false;
+  }
+  mask[node / 64] |= 1UL << (node % 64);
+  if (syscall(SYS_mbind,
+              addr,
+              bytes,
+              MPOL_BIND,
+              mask,
+              sizeof(mask) * 8,
+              MPOL_MF_MOVE)) {
+    fprintf(stderr,
+            "Could not bind memory to NUMA node %d: %s\n",
+            node,
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void prefault(void *addr, size_t bytes, size_t page_bytes) {
+  // An atomic add of zero writes each page without racing a process that
+  // shares it
+  for (size_t off = 0; off < bytes; off += page_bytes)
+    __atomic_fetch_add((char *)addr + off, 0, __ATOMIC_RELAXED);
+}
+
+void *placed_alloc(size_t bytes, bool hugepages) {
+  size_t align = hugepages ? HUGEPAGE_BYTES : SMALLPAGE_BYTES;
+  size_t sz = ((bytes + align - 1) / align) * align;
+  void *data = aligned_alloc(align, sz);
+  if (data && hugepages && madvise(data, sz, MADV_HUGEPAGE)) {
+    perror("madvise(MADV_HUGEPAGE)");
+  }
+  return data;
+}
@@ -0,0 +1,56 @@
+// See LICENSE for license details
+
+#ifndef __HOST_PLACEMENT_H
+#define __HOST_PLACEMENT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ * Helpers for placing bridge driver threads and buffers on host CPUs and
+ * NUMA nodes. CPU sets use the Linux cpulist syntax ("0-3,8,10-11"). All
+ * NUMA queries read sysfs and degrade to "unknown" (-1 / empty) on hosts
+ * without NUMA information.
+ */
+
+// Parse a cpulist. Returns an empty vector (and prints why) on bad input.
+std::vector<int> parse_cpu_list(const std::string &list);
+std::string format_cpu_list(const std::vector<int> &cpus);
+
+// Restrict a thread to the given CPUs. An empty set leaves it unpinned.
+bool pin_thread(pthread_t thread, const std::vector<int> &cpus);
+// The CPUs a thread is currently allowed to run on
+std::vector<int> thread_cpus(pthread_t thread);
+
+// NUMA node of a CPU, or -1 if unknown
+int cpu_numa_node(int cpu);
+// NUMA node shared by all of the CPUs, or -1 if they span nodes or unknown
+int cpus_numa_node(const std::vector<int> &cpus);
+// NUMA node of a PCI device ("0000:17:00.0"), e.g. an FPGA, or -1
+int pci_numa_node(const std::string &bdf);
+// NUMA node with the most free memory, as scripts/numa_prefix picks, or -1
+int numa_node_most_free();
+
+// Resolve a NUMA node option: a node number, "auto" for the node of the
+// CPUs this thread may run on (falling back to numa_node_most_free()), or
+// "pci:<bdf>" for the node of a device. Returns -1 (and prints why) if it
+// cannot be resolved.
+int parse_numa_node(const std::string &spec);
+
+// Bind the pages of [addr, addr + bytes) to a NUMA node, moving any that
+// are already elsewhere. Prints why and returns false on failure.
+bool bind_numa_node(void *addr, size_t bytes, int node);
+
+// Fault in every page of [addr, addr + bytes) for writing without changing
+// its contents, so the first round does not pay for it
+void prefault(void *addr, size_t bytes, size_t page_bytes);
+
+static constexpr size_t HUGEPAGE_BYTES = 2 << 20;
+
+// Page-aligned allocation, optionally 2MB-aligned and advised to be backed
+// by transparent hugepages. Free with free().
+void *placed_alloc(size_t bytes, bool hugepages);
+
+#endif // __HOST_PLACEMENT_H
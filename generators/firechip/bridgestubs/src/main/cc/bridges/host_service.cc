@@ -0,0 +1,49 @@
+// See LICENSE for license details
+
+#include "host_service.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+
+std::vector<std::string> split_list(const std::string &spec) {
+  std::vector<std::string> items;
+  size_t pos = 0;
+  while (pos <= spec.size()) {
+    size_t end = spec.find(',', pos);
+    if (end == std::string::npos)
+      end = spec.size();
+    items.push_back(spec.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  return items;
+}
+
+size_t worker_group_size(size_t items, unsigned threads, unsigned per_thread) {
+  if (threads == 0)
+    threads = (items + per_thread - 1) / per_thread;
+  threads = std::min<size_t>(threads, items);
+  return (items + threads - 1) / threads;
+}
+
+static sigset_t termination_signals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  return signals;
+}
+
+void block_termination_signals() {
+  sigset_t signals = termination_signals();
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+}
+
+int wait_for_termination_signal() {
+  sigset_t signals = termination_signals();
+  int sig;
+  sigwait(&signals, &sig);
+  return sig;
+}
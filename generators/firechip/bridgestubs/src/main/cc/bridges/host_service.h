@@ -0,0 +1,47 @@
+// See LICENSE for license details
+
+#ifndef __HOST_SERVICE_H
+#define __HOST_SERVICE_H
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Pieces shared by the host-side services that move tokens between
+ * simulators over shared memory: the SimpleNIC switch (netswitch/) and the
+ * CTC router (ctcrouter/).
+ */
+
+// The items of a comma-separated list, empty ones included
+std::vector<std::string> split_list(const std::string &spec);
+
+// Items per worker for `threads` workers, or for one worker per `per_thread`
+// items if threads is 0, never more workers than items. items must not be 0.
+size_t worker_group_size(size_t items, unsigned threads, unsigned per_thread);
+
+// Split items into consecutive groups of worker_group_size(), one per worker
+template <class T>
+std::vector<std::vector<T *>>
+split_worker_groups(const std::vector<std::unique_ptr<T>> &items,
+                    unsigned threads,
+                    unsigned per_thread) {
+  std::vector<std::vector<T *>> groups;
+  size_t per_group = worker_group_size(items.size(), threads, per_thread);
+  for (size_t i = 0; i < items.size(); i++) {
+    if (i % per_group == 0)
+      groups.emplace_back();
+    groups.back().push_back(items[i].get());
+  }
+  return groups;
+}
+
+// Block SIGINT, SIGTERM and SIGHUP in the calling thread and so in the
+// threads it starts afterwards; call before starting the workers
+void block_termination_signals();
+// Wait on the calling thread for one of the blocked signals
+int wait_for_termination_signal();
+
+#endif // __HOST_SERVICE_H
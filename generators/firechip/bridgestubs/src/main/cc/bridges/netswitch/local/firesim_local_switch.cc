@@ -0,0 +1,91 @@
+// See LICENSE for license details
+
+/* Standalone SimpleNIC switch
+ *
+ * Connects the simplenic bridges of several simulators running on the same
+ * host, e.g.
+ *
+ *   firesim-local-switch -l 6405 node0 node1 node2:700
+ *
+ * with each simulator started with +shmemportname0=node<i> and the same
+ * +linklatency0, +nic-ring-depth0, +nic-compress0 and +nic-hugepages0.
+ * Runs until interrupted, then prints per-port packet counts.
+ */
+
+#include "../nic_switch.h"
+
+#include "../../host_placement.h"
+#include "../../host_service.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s -l cycles [-d depth] [-c] [-H dir] [-N node] [-s cycles] "
+          "[-t threads] [-q flits] port[:delay]...\n"
+          "  -l  link latency, as +linklatency on the NICs\n"
+          "  -d  ring depth, as +nic-ring-depth on the NICs (default: 2)\n"
+          "  -c  compressed links, as +nic-compress on the NICs\n"
+          "  -H  hugetlbfs mount, as +nic-hugepages on the NICs\n"
+          "  -N  NUMA node for the links: a number, auto or pci:<bdf>\n"
+          "  -s  switching latency in cycles (default: 10)\n"
+          "  -t  worker threads (default: one per 4 ports)\n"
+          "  -q  output queue limit in flits (default: 65536)\n"
+          "  port is the +shmemportname of a NIC, optionally with extra\n"
+          "  cycles of link delay for that port\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  nic_switch_config_t config;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:d:cH:N:s:t:q:h")) != -1) {
+    switch (opt) {
+    case 'l':
+      config.link_latency = atoi(optarg);
+      break;
+    case 'd':
+      config.ring_depth = atoi(optarg);
+      break;
+    case 'c':
+      config.compress = true;
+      break;
+    case 'H':
+      config.placement.hugepage_dir = optarg;
+      break;
+    case 'N':
+      config.placement.numa_node = parse_numa_node(optarg);
+      if (config.placement.numa_node < 0)
+        usage(argv[0]);
+      break;
+    case 's':
+      config.switch_latency = atoi(optarg);
+      break;
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    case 'q':
+      config.max_queue_flits = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (!config.link_latency || optind == argc)
+    usage(argv[0]);
+  for (int i = optind; i < argc; i++)
+    if (!parse_nic_switch_ports(argv[i], config.ports))
+      usage(argv[0]);
+
+  block_termination_signals();
+
+  nic_switch_t netswitch(config);
+  wait_for_termination_signal();
+
+  netswitch.shutdown();
+  netswitch.print_stats(stdout);
+  return 0;
+}
@@ -0,0 +1,408 @@
+// See LICENSE for license details
+
+#include "nic_switch.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "bridges/bigtoken_codec.h"
+#include "bridges/host_service.h"
+#include "bridges/nic_bigtoken.h"
+#include "bridges/shmem_ring.h"
+#include "bridges/shmem_sync.h"
+
+#define NIC_SWITCH_PORTS_PER_THREAD 4
+// Bytes after each ping-pong buffer holding its ready flag (EXTRABYTES in
+// simplenic.cc)
+#define NIC_SWITCH_FLAG_BYTES 4
+
+#define MAC_MASK 0xFFFFFFFFFFFFULL
+
+struct nic_switch_t::packet_t {
+  std::vector<uint64_t> flits;
+  uint64_t arrival; // switch cycle the last flit came in
+  uint32_t in_port;
+};
+
+struct nic_switch_t::port_t {
+  uint32_t index;
+  nic_switch_port_config_t config;
+
+  // Link to the NIC: rings if deeper than two rounds or compressed,
+  // ping-pong buffers otherwise
+  std::unique_ptr<shmem_ring_t> rx_ring; // /port_nts, NIC to switch
+  std::unique_ptr<shmem_ring_t> tx_ring; // /port_stn, switch to NIC
+  char *rx_bufs[2] = {nullptr, nullptr};
+  char *tx_bufs[2] = {nullptr, nullptr};
+  shmem_waiter_t waiter;
+  // Decoded round of a compressed link
+  std::vector<char> round_buf;
+
+  // Flits of the packet being received, and packets completed this round
+  std::vector<uint64_t> assembling;
+  std::vector<std::shared_ptr<const packet_t>> arrived;
+
+  // Packets waiting to go out, in release order
+  struct queued_t {
+    std::shared_ptr<const packet_t> packet;
+    uint64_t release;
+  };
+  std::deque<queued_t> queue;
+  size_t queued_flits = 0;
+  size_t head_sent = 0; // flits of the head packet already sent
+
+  uint64_t rx_packets = 0, rx_flits = 0;
+  uint64_t tx_packets = 0, tx_flits = 0;
+  uint64_t drops = 0;
+};
+
+class nic_switch_t::barrier_t {
+public:
+  barrier_t(unsigned count, const std::atomic<bool> &stop)
+      : count(count), stop(stop) {}
+
+  // Returns false if the switch is stopped while waiting
+  bool wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t gen = generation;
+    if (++arrived == count) {
+      arrived = 0;
+      generation++;
+      cv.notify_all();
+      return true;
+    }
+    cv.wait(lock, [&] { return generation != gen || stop.load(); });
+    return generation != gen;
+  }
+
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cv.notify_all();
+  }
+
+private:
+  const unsigned count;
+  const std::atomic<bool> &stop;
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned arrived = 0;
+  uint64_t generation = 0;
+};
+
+bool parse_nic_switch_ports(const std::string &spec,
+                            std::vector<nic_switch_port_config_t> &ports) {
+  for (auto &item : split_list(spec)) {
+    nic_switch_port_config_t port;
+    size_t colon = item.find(':');
+    port.name = item.substr(0, colon);
+    if (colon != std::string::npos) {
+      char *endp;
+      port.delay = strtoul(item.c_str() + colon + 1, &endp, 0);
+      if (*endp || colon + 1 == item.size()) {
+        fprintf(stderr, "Bad switch port delay in \"%s\"\n", item.c_str());
+        return false;
+      }
+    }
+    if (port.name.empty()) {
+      fprintf(stderr, "Empty switch port name in \"%s\"\n", spec.c_str());
+      return false;
+    }
+    ports.push_back(port);
+  }
+  return true;
+}
+
+nic_switch_t::nic_switch_t(const nic_switch_config_t &config)
+    : config(config) {
+  if (config.link_latency == 0 ||
+      config.link_latency % NIC_BIGTOKEN_FLITS != 0) {
+    fprintf(stderr,
+            "Switch link latency (%u) must be a non-zero multiple of %d\n",
+            config.link_latency,
+            NIC_BIGTOKEN_FLITS);
+    abort();
+  }
+  if (config.ports.size() < 2) {
+    fprintf(stderr, "A switch needs at least two ports\n");
+    abort();
+  }
+  if (config.ring_depth < 2) {
+    fprintf(stderr, "Switch ring depth must be at least 2\n");
+    abort();
+  }
+  round_bytes = config.link_latency / NIC_BIGTOKEN_FLITS * NIC_BIGTOKEN_BYTES;
+
+  char name[257];
+  for (size_t i = 0; i < config.ports.size(); i++) {
+    auto port = std::make_unique<port_t>();
+    port->index = i;
+    port->config = config.ports[i];
+    const char *portname = port->config.name.c_str();
+    if (config.ring_depth > 2 || config.compress) {
+      size_t slot_bytes =
+          config.compress
+              ? bigtoken_max_encoded(round_bytes / NIC_BIGTOKEN_BYTES)
+              : round_bytes;
+      if (config.compress)
+        port->round_buf.resize(round_bytes);
+      snprintf(name, sizeof(name), "/port_nts%s_ring", portname);
+      port->rx_ring = std::make_unique<shmem_ring_t>(
+          name, config.ring_depth, slot_bytes, config.placement);
+      snprintf(name, sizeof(name), "/port_stn%s_ring", portname);
+      port->tx_ring = std::make_unique<shmem_ring_t>(
+          name, config.ring_depth, slot_bytes, config.placement);
+    } else {
+      size_t buf_bytes = round_bytes + NIC_SWITCH_FLAG_BYTES;
+      for (int j = 0; j < 2; j++) {
+        snprintf(name, sizeof(name), "/port_nts%s_%d", portname, j);
+        port->rx_bufs[j] = (char *)shmem_region_map(
+            name, buf_bytes, config.placement, true, &buf_map_bytes);
+        snprintf(name, sizeof(name), "/port_stn%s_%d", portname, j);
+        port->tx_bufs[j] = (char *)shmem_region_map(
+            name, buf_bytes, config.placement, true, &buf_map_bytes);
+      }
+    }
+    ports.push_back(std::move(port));
+  }
+
+  groups = split_worker_groups(
+      ports, config.threads, NIC_SWITCH_PORTS_PER_THREAD);
+
+  printf("[INFO] Switch: %zu ports, %u cycle%s links on %s, %u cycle "
+         "switching, %zu worker threads\n",
+         ports.size(),
+         config.link_latency,
+         config.compress ? " compressed" : "",
+         config.placement.describe().c_str(),
+         config.switch_latency,
+         groups.size());
+
+  barrier = std::make_unique<barrier_t>(groups.size(), stop);
+  for (unsigned g = 0; g < groups.size(); g++)
+    workers.emplace_back(&nic_switch_t::run, this, g);
+}
+
+nic_switch_t::~nic_switch_t() {
+  shutdown();
+  for (auto &port : ports) {
+    for (int j = 0; j < 2; j++) {
+      if (port->rx_bufs[j])
+        munmap(port->rx_bufs[j], buf_map_bytes);
+      if (port->tx_bufs[j])
+        munmap(port->tx_bufs[j], buf_map_bytes);
+    }
+  }
+}
+
+void nic_switch_t::shutdown() {
+  stop = true;
+  barrier->cancel();
+  for (auto &t : workers)
+    t.join();
+  workers.clear();
+}
+
+/* One worker per port group. Every round all groups receive, then the
+ * first one forwards what arrived, then all of them send. */
+void nic_switch_t::run(unsigned group) {
+  for (uint64_t round = 0;; round++) {
+    for (port_t *port : groups[group])
+      if (!receive(*port, round))
+        return;
+    if (!barrier->wait())
+      return;
+    if (group == 0) {
+      forward();
+      rounds_done = round + 1;
+    }
+    if (!barrier->wait())
+      return;
+    for (port_t *port : groups[group])
+      if (!send(*port, round))
+        return;
+  }
+}
+
+/* Take one round from the NIC and collect the packets it completes. */
+bool nic_switch_t::receive(port_t &port, uint64_t round) {
+  char *buf;
+  if (port.rx_ring) {
+    buf = port.rx_ring->peek(port.waiter, &stop);
+    if (!buf)
+      return false;
+    if (config.compress) {
+      if (!bigtoken_decode(nic_bigtoken_format,
+                           buf,
+                           port.rx_ring->slot_bytes(),
+                           port.round_buf.data(),
+                           round_bytes / NIC_BIGTOKEN_BYTES)) {
+        fprintf(stderr,
+                "Switch port %s: malformed round; is the NIC running with "
+                "+nic-compress?\n",
+                port.config.name.c_str());
+        abort();
+      }
+      // The slot is no longer needed
+      port.rx_ring->release();
+      buf = port.round_buf.data();
+    }
+  } else {
+    buf = port.rx_bufs[round % 2];
+    if (!port.waiter.wait((uint8_t *)buf + round_bytes, &stop))
+      return false;
+  }
+
+  uint64_t base = (round + 1) * config.link_latency + port.config.delay;
+  for (uint32_t t = 0; t < round_bytes / NIC_BIGTOKEN_BYTES; t++) {
+    const uint64_t *bigtoken = (const uint64_t *)(buf + t * NIC_BIGTOKEN_BYTES);
+    if (!(bigtoken[0] & NIC_BIGTOKEN_VALID_MASK))
+      continue;
+    for (int i = 0; i < NIC_BIGTOKEN_FLITS; i++) {
+      if (!nic_flit_valid(bigtoken, i))
+        continue;
+      port.assembling.push_back(nic_flit_data(bigtoken, i));
+      if (!nic_flit_last(bigtoken, i))
+        continue;
+      auto packet = std::make_shared<packet_t>();
+      packet->flits.swap(port.assembling);
+      packet->arrival = base + t * NIC_BIGTOKEN_FLITS + i;
+      packet->in_port = port.index;
+      port.rx_packets++;
+      port.rx_flits += packet->flits.size();
+      port.arrived.push_back(std::move(packet));
+    }
+  }
+
+  if (port.rx_ring) {
+    if (!config.compress)
+      port.rx_ring->release();
+  } else {
+    __atomic_store_n((uint8_t *)buf + round_bytes, 0, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+void nic_switch_t::enqueue(port_t &port,
+                           const std::shared_ptr<const packet_t> &packet) {
+  if (port.queued_flits + packet->flits.size() > config.max_queue_flits) {
+    port.drops++;
+    return;
+  }
+  uint64_t release =
+      packet->arrival + config.switch_latency + port.config.delay;
+  port.queue.push_back({packet, release});
+  port.queued_flits += packet->flits.size();
+}
+
+/* Route the packets that arrived this round, oldest first. The flits carry
+ * the frame after two bytes of padding: the destination MAC address is in
+ * bits 63:16 of the first flit and the source in bits 47:0 of the second,
+ * first octet lowest. */
+void nic_switch_t::forward() {
+  std::vector<std::shared_ptr<const packet_t>> arrived;
+  for (auto &port : ports) {
+    arrived.insert(arrived.end(), port->arrived.begin(), port->arrived.end());
+    port->arrived.clear();
+  }
+  std::stable_sort(arrived.begin(), arrived.end(), [](auto &a, auto &b) {
+    return a->arrival < b->arrival;
+  });
+
+  for (auto &packet : arrived) {
+    port_t &in = *ports[packet->in_port];
+    if (packet->flits.size() < 2) {
+      in.drops++;
+      continue;
+    }
+    uint64_t dst = (packet->flits[0] >> 16) & MAC_MASK;
+    uint64_t src = packet->flits[1] & MAC_MASK;
+    if (!(src & 1))
+      mac_table[src] = packet->in_port;
+
+    auto it = (dst & 1) ? mac_table.end() : mac_table.find(dst);
+    if (it != mac_table.end()) {
+      if (it->second != packet->in_port)
+        enqueue(*ports[it->second], packet);
+      continue;
+    }
+    flooded++;
+    for (auto &port : ports)
+      if (port->index != packet->in_port)
+        enqueue(*port, packet);
+  }
+}
+
+/* Fill one round for the NIC with flits of released packets. */
+bool nic_switch_t::send(port_t &port, uint64_t round) {
+  char *buf, *slot = nullptr;
+  if (port.tx_ring) {
+    buf = slot = port.tx_ring->reserve(port.waiter, &stop);
+    if (!buf)
+      return false;
+    if (config.compress)
+      buf = port.round_buf.data();
+  } else {
+    // The NIC has pushed round - 2 before sending the round just received
+    buf = port.tx_bufs[round % 2];
+  }
+
+  uint64_t cycle = round * config.link_latency;
+  for (uint32_t t = 0; t < round_bytes / NIC_BIGTOKEN_BYTES; t++) {
+    uint64_t *bigtoken = (uint64_t *)(buf + t * NIC_BIGTOKEN_BYTES);
+    nic_bigtoken_clear(bigtoken);
+    for (int i = 0; i < NIC_BIGTOKEN_FLITS; i++, cycle++) {
+      if (port.queue.empty() || port.queue.front().release > cycle) {
+        bigtoken[1 + i] = 0;
+        continue;
+      }
+      const packet_t &packet = *port.queue.front().packet;
+      bool last = ++port.head_sent == packet.flits.size();
+      nic_flit_set(bigtoken, i, packet.flits[port.head_sent - 1], last);
+      port.tx_flits++;
+      if (last) {
+        port.queued_flits -= packet.flits.size();
+        port.head_sent = 0;
+        port.tx_packets++;
+        port.queue.pop_front();
+      }
+    }
+  }
+
+  if (config.compress)
+    bigtoken_encode(
+        nic_bigtoken_format, buf, round_bytes / NIC_BIGTOKEN_BYTES, slot);
+  if (port.tx_ring)
+    port.tx_ring->publish();
+  else
+    shmem_flag_signal((uint8_t *)buf + round_bytes);
+  return true;
+}
+
+void nic_switch_t::print_stats(FILE *out) const {
+  fprintf(out,
+          "[INFO] Switch: %" PRIu64 " rounds, %zu MAC addresses learned, "
+          "%" PRIu64 " packets flooded\n",
+          rounds(),
+          mac_table.size(),
+          flooded);
+  for (auto &port : ports) {
+    fprintf(out,
+            "[INFO] Switch port %u (%s): received %" PRIu64
+            " packets (%" PRIu64 " flits), sent %" PRIu64 " packets (%" PRIu64
+            " flits), dropped %" PRIu64 "\n",
+            port->index,
+            port->config.name.c_str(),
+            port->rx_packets,
+            port->rx_flits,
+            port->tx_packets,
+            port->tx_flits,
+            port->drops);
+  }
+}
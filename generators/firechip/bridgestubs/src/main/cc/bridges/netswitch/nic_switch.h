@@ -0,0 +1,114 @@
+// See LICENSE for license details
+
+#ifndef __NIC_SWITCH_H
+#define __NIC_SWITCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bridges/shmem_region.h"
+
+struct nic_switch_port_config_t {
+  // +shmemportname of the NIC on this port
+  std::string name;
+  // Extra cycles of cable on this port, added both ways
+  uint32_t delay = 0;
+};
+
+struct nic_switch_config_t {
+  std::vector<nic_switch_port_config_t> ports;
+  // Must match +linklatency, +nic-ring-depth and +nic-compress of every NIC
+  uint32_t link_latency = 0;
+  uint32_t ring_depth = 2;
+  bool compress = false;
+  // Backing of the port links; hugepage_dir must match the NICs
+  shmem_placement_t placement;
+  // Cycles from the last flit of a packet arriving to its first flit leaving
+  uint32_t switch_latency = 10;
+  // Worker threads; 0 picks one per NIC_SWITCH_PORTS_PER_THREAD ports
+  unsigned threads = 0;
+  // Packets that would grow an output queue beyond this many flits are
+  // dropped
+  size_t max_queue_flits = 1 << 16;
+};
+
+// Parse "name[:delay],name[:delay],...". Returns false (and prints why) on
+// bad input.
+bool parse_nic_switch_ports(const std::string &spec,
+                            std::vector<nic_switch_port_config_t> &ports);
+
+/**
+ * Ethernet switch for SimpleNIC simulations on a single host. Each port is
+ * the shared-memory link of one simplenic_t (ping-pong buffers or rings,
+ * see +nic-ring-depth and +nic-compress) in a simulator on the same
+ * machine. A NIC blocks its simulator until the switch has served it, so
+ * a switch takes at most one NIC per simulator process, e.g. the NIC of the
+ * simulator running it.
+ *
+ * Time advances in rounds of link_latency cycles, in lockstep with the
+ * NICs. A flit a NIC sends in cycle c reaches the switch in cycle
+ * c + link_latency + delay(in); once the whole packet is in, it is
+ * forwarded after switch_latency + delay(out) cycles, and the NIC on the
+ * far side sees it another link_latency cycles later. Output ports send one
+ * flit per cycle and never interleave packets.
+ *
+ * Forwarding learns source MAC addresses; frames to unknown or multicast
+ * destinations are flooded to every other port. Ports are split into
+ * groups, each served by one worker thread; forwarding decisions are made
+ * in port order between the receive and send phases of a round, so a run
+ * is deterministic regardless of the thread count.
+ */
+class nic_switch_t {
+public:
+  // Maps the port links and starts the worker threads
+  explicit nic_switch_t(const nic_switch_config_t &config);
+  // Stops the workers, which may be waiting on NICs that have exited
+  ~nic_switch_t();
+
+  nic_switch_t(const nic_switch_t &) = delete;
+  nic_switch_t &operator=(const nic_switch_t &) = delete;
+
+  // Stop and join the workers. Safe to call more than once.
+  void shutdown();
+
+  // Per-port packet counts; only consistent once the switch is shut down
+  void print_stats(FILE *out) const;
+
+  // Rounds forwarded so far
+  uint64_t rounds() const { return rounds_done.load(); }
+
+private:
+  struct packet_t;
+  struct port_t;
+  class barrier_t;
+
+  void run(unsigned group);
+  bool receive(port_t &port, uint64_t round);
+  void forward();
+  void enqueue(port_t &port, const std::shared_ptr<const packet_t> &packet);
+  bool send(port_t &port, uint64_t round);
+
+  nic_switch_config_t config;
+  uint32_t round_bytes;
+  size_t buf_map_bytes = 0; // of each ping-pong buffer
+  std::vector<std::unique_ptr<port_t>> ports;
+  std::vector<std::vector<port_t *>> groups;
+
+  // Port each source MAC address was last seen on
+  std::unordered_map<uint64_t, uint32_t> mac_table;
+  uint64_t flooded = 0;
+
+  std::atomic<uint64_t> rounds_done{0};
+  std::atomic<bool> stop{false};
+  std::unique_ptr<barrier_t> barrier;
+  std::vector<std::thread> workers;
+};
+
+#endif // __NIC_SWITCH_H
@@ -0,0 +1,50 @@
+// See LICENSE for license details
+
+#ifndef __NIC_BIGTOKEN_H
+#define __NIC_BIGTOKEN_H
+
+#include <stdint.h>
+
+/**
+ * Layout of the 64-byte big tokens simplenic_t moves between the FPGA and
+ * the switch (BIGToken in SimpleNICBridge.scala). Each carries seven
+ * cycles of the NIC link:
+ *
+ *   word 0       bits 42:0 token counter, then for each flit i a
+ *                (valid, ready, last) triple at bits 43 + 3i .. 45 + 3i
+ *   words 1-7    flit data, one 64-bit word per cycle
+ */
+#define NIC_BIGTOKEN_BYTES 64
+#define NIC_BIGTOKEN_FLITS 7
+
+// Valid bits of all seven flits in word 0
+#define NIC_BIGTOKEN_VALID_MASK (0x49249ULL << 43)
+
+static inline bool nic_flit_valid(const uint64_t *bigtoken, int flit) {
+  return (bigtoken[0] >> (43 + flit * 3)) & 1;
+}
+
+static inline bool nic_flit_last(const uint64_t *bigtoken, int flit) {
+  return (bigtoken[0] >> (45 + flit * 3)) & 1;
+}
+
+static inline uint64_t nic_flit_data(const uint64_t *bigtoken, int flit) {
+  return bigtoken[1 + flit];
+}
+
+// Clear the valid/last bits of all flits and mark every cycle ready
+static inline void nic_bigtoken_clear(uint64_t *bigtoken) {
+  bigtoken[0] = 0;
+  for (int i = 0; i < NIC_BIGTOKEN_FLITS; i++)
+    bigtoken[0] |= (uint64_t)1 << (44 + i * 3);
+}
+
+static inline void
+nic_flit_set(uint64_t *bigtoken, int flit, uint64_t data, bool last) {
+  bigtoken[0] |= (uint64_t)1 << (43 + flit * 3);
+  if (last)
+    bigtoken[0] |= (uint64_t)1 << (45 + flit * 3);
+  bigtoken[1 + flit] = data;
+}
+
+#endif // __NIC_BIGTOKEN_H
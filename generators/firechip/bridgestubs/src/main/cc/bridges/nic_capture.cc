@@ -0,0 +1,203 @@
+// See LICENSE for license details
+
+#include "nic_capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bridges/nic_bigtoken.h"
+
+#define CAPTURE_RX (1ULL << 63)
+#define CAPTURE_LAST (1ULL << 62)
+// Flits were dropped before this one
+#define CAPTURE_GAP (1ULL << 61)
+#define CAPTURE_CYCLE_MASK (CAPTURE_GAP - 1)
+
+// Bytes of padding ahead of the Ethernet header in the first flit
+#define NIC_FRAME_PAD 2
+
+// How long the writer sleeps when the queue is empty
+#define CAPTURE_POLL_US 1000
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define LINKTYPE_ETHERNET 1
+
+static size_t pad4(size_t len) { return (len + 3) & ~(size_t)3; }
+
+static void append(std::vector<uint8_t> &buf, const void *data, size_t len) {
+  buf.insert(buf.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+  buf.resize(pad4(buf.size()));
+}
+
+static void append_option(std::vector<uint8_t> &buf,
+                          uint16_t code,
+                          const void *data,
+                          uint16_t len) {
+  uint16_t hdr[2] = {code, len};
+  append(buf, hdr, sizeof(hdr));
+  append(buf, data, len);
+}
+
+nic_capture_t::nic_capture_t(const std::string &filename,
+                             const std::string &ifname,
+                             uint32_t clock_mhz,
+                             size_t queue_flits)
+    : filename(filename), clock_mhz(clock_mhz) {
+  if (clock_mhz == 0) {
+    fprintf(stderr, "NIC capture clock must be non-zero\n");
+    abort();
+  }
+  file = fopen(filename.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "Could not open NIC capture file: %s\n", filename.c_str());
+    abort();
+  }
+  setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+  size_t entries = 1;
+  while (entries < queue_flits)
+    entries <<= 1;
+  queue.resize(entries);
+  mask = entries - 1;
+
+  // Section header: byte-order magic, version 1.0, unknown section length
+  struct {
+    uint32_t magic = 0x1A2B3C4D;
+    uint16_t major = 1, minor = 0;
+    int64_t section_len = -1;
+  } shb;
+  write_block(PCAPNG_SHB, &shb, sizeof(shb));
+
+  // One Ethernet interface with picosecond timestamps
+  std::vector<uint8_t> idb;
+  uint16_t linktype[2] = {LINKTYPE_ETHERNET, 0};
+  uint32_t snaplen = 0;
+  append(idb, linktype, sizeof(linktype));
+  append(idb, &snaplen, sizeof(snaplen));
+  uint8_t tsresol = 12;
+  append_option(idb, 2, ifname.data(), ifname.size()); // if_name
+  append_option(idb, 9, &tsresol, 1);                  // if_tsresol
+  append_option(idb, 0, nullptr, 0);
+  write_block(PCAPNG_IDB, idb.data(), idb.size());
+
+  writer = std::thread(&nic_capture_t::run, this);
+}
+
+nic_capture_t::~nic_capture_t() { finish(); }
+
+void nic_capture_t::finish() {
+  if (!file)
+    return;
+  stop = true;
+  writer.join();
+  fclose(file);
+  file = nullptr;
+}
+
+void nic_capture_t::record(bool rx,
+                           const char *bigtokens,
+                           uint32_t count,
+                           uint64_t cycle) {
+  uint64_t start = head.load(std::memory_order_relaxed);
+  uint64_t limit = tail.load(std::memory_order_acquire) + queue.size();
+  uint64_t pos = start;
+  uint64_t flags = (rx ? CAPTURE_RX : 0) | (lost ? CAPTURE_GAP : 0);
+
+  for (uint32_t t = 0; t < count; t++) {
+    const uint64_t *bigtoken =
+        (const uint64_t *)(bigtokens + t * NIC_BIGTOKEN_BYTES);
+    if (!(bigtoken[0] & NIC_BIGTOKEN_VALID_MASK))
+      continue;
+    for (int i = 0; i < NIC_BIGTOKEN_FLITS; i++) {
+      if (!nic_flit_valid(bigtoken, i))
+        continue;
+      if (pos == limit) {
+        // Leave the queue as it was; the writer learns of the hole from
+        // the next round that fits
+        lost = true;
+        _dropped_rounds++;
+        return;
+      }
+      uint64_t flit_cycle = cycle + t * NIC_BIGTOKEN_FLITS + i;
+      flit_t &flit = queue[pos++ & mask];
+      flit.cycle = flit_cycle | flags |
+                   (nic_flit_last(bigtoken, i) ? CAPTURE_LAST : 0);
+      flit.data = nic_flit_data(bigtoken, i);
+      flags &= ~CAPTURE_GAP;
+    }
+  }
+  if (pos != start) {
+    lost = false;
+    head.store(pos, std::memory_order_release);
+  }
+}
+
+void nic_capture_t::write_block(uint32_t type, const void *body, size_t len) {
+  uint32_t total = 12 + pad4(len);
+  static const uint8_t zeros[4] = {};
+  fwrite(&type, 4, 1, file);
+  fwrite(&total, 4, 1, file);
+  fwrite(body, 1, len, file);
+  fwrite(zeros, 1, pad4(len) - len, file);
+  fwrite(&total, 4, 1, file);
+}
+
+void nic_capture_t::write_frame(bool rx, const frame_t &frame) {
+  size_t bytes = frame.flits.size() * sizeof(uint64_t);
+  if (bytes <= NIC_FRAME_PAD)
+    return;
+  bytes -= NIC_FRAME_PAD;
+
+  unsigned __int128 ps = (unsigned __int128)frame.cycle * 1000000 / clock_mhz;
+  struct {
+    uint32_t interface = 0;
+    uint32_t ts_high, ts_low;
+    uint32_t captured, original;
+  } epb;
+  epb.ts_high = (uint64_t)ps >> 32;
+  epb.ts_low = (uint32_t)ps;
+  epb.captured = epb.original = bytes;
+
+  std::vector<uint8_t> body;
+  append(body, &epb, sizeof(epb));
+  append(body, (const uint8_t *)frame.flits.data() + NIC_FRAME_PAD, bytes);
+  uint32_t direction = rx ? 1 : 2; // epb_flags: inbound / outbound
+  append_option(body, 2, &direction, sizeof(direction));
+  append_option(body, 0, nullptr, 0);
+  write_block(PCAPNG_EPB, body.data(), body.size());
+  _packets++;
+}
+
+void nic_capture_t::run() {
+  while (true) {
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    uint64_t end = head.load(std::memory_order_acquire);
+    if (pos == end) {
+      if (stop)
+        break;
+      usleep(CAPTURE_POLL_US);
+      continue;
+    }
+    for (; pos != end; pos++) {
+      const flit_t &flit = queue[pos & mask];
+      if (flit.cycle & CAPTURE_GAP) {
+        frames[0].flits.clear();
+        frames[1].flits.clear();
+      }
+      bool rx = flit.cycle & CAPTURE_RX;
+      frame_t &frame = frames[rx];
+      if (frame.flits.empty())
+        frame.cycle = flit.cycle & CAPTURE_CYCLE_MASK;
+      frame.flits.push_back(flit.data);
+      if (flit.cycle & CAPTURE_LAST) {
+        write_frame(rx, frame);
+        frame.flits.clear();
+      }
+    }
+    tail.store(pos, std::memory_order_release);
+  }
+  fflush(file);
+}
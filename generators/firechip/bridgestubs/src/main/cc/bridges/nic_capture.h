@@ -0,0 +1,82 @@
+// See LICENSE for license details
+
+#ifndef __NIC_CAPTURE_H
+#define __NIC_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Packet capture for simplenic_t. The driver thread hands over every round
+ * of big tokens; only their valid flits are copied into a single-producer,
+ * single-consumer queue. A background thread reassembles frames from the
+ * last bits and writes them to a pcapng file, timestamped with the NIC
+ * cycle of their first flit.
+ *
+ * The driver never waits for the writer: a round that does not fit in the
+ * queue is dropped, and the frames it cut short are discarded.
+ */
+class nic_capture_t {
+public:
+  // clock_mhz converts cycles to pcapng timestamps (picosecond resolution)
+  nic_capture_t(const std::string &filename,
+                const std::string &ifname,
+                uint32_t clock_mhz,
+                size_t queue_flits = 1 << 20);
+  ~nic_capture_t();
+
+  nic_capture_t(const nic_capture_t &) = delete;
+  nic_capture_t &operator=(const nic_capture_t &) = delete;
+
+  // Queue the valid flits of count big tokens whose first flit is in cycle
+  // cycle. rx is true for traffic towards the NIC.
+  void record(bool rx, const char *bigtokens, uint32_t count, uint64_t cycle);
+
+  // Write out everything queued and close the file. Safe to call more than
+  // once; no more rounds may be recorded afterwards.
+  void finish();
+
+  // Frames written; final once finished
+  uint64_t packets() const { return _packets; }
+  uint64_t dropped_rounds() const { return _dropped_rounds; }
+
+private:
+  // cycle also carries the flags below in its top bits
+  struct flit_t {
+    uint64_t cycle;
+    uint64_t data;
+  };
+
+  struct frame_t {
+    std::vector<uint64_t> flits;
+    uint64_t cycle = 0;
+  };
+
+  void run();
+  void write_block(uint32_t type, const void *body, size_t len);
+  void write_frame(bool rx, const frame_t &frame);
+
+  std::string filename;
+  FILE *file;
+  uint32_t clock_mhz;
+
+  std::vector<flit_t> queue;
+  size_t mask;
+  alignas(64) std::atomic<uint64_t> head{0}; // written by the driver thread
+  alignas(64) std::atomic<uint64_t> tail{0}; // written by the writer thread
+  bool lost = false;         // a round was dropped since the last one queued
+  uint64_t _dropped_rounds = 0;
+
+  frame_t frames[2]; // being reassembled, tx and rx
+  uint64_t _packets = 0;
+
+  std::atomic<bool> stop{false};
+  std::thread writer;
+};
+
+#endif // __NIC_CAPTURE_H
@@ -0,0 +1,100 @@
+// See LICENSE for license details
+
+#include "shmem_region.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bridges/host_placement.h"
+
+#define SMALLPAGE_BYTES 4096
+
+std::string shmem_placement_t::describe() const {
+  std::string out = hugepage_dir.empty() ? "4K pages" : "2MB pages";
+  if (numa_node >= 0)
+    out += " on NUMA node " + std::to_string(numa_node);
+  return out;
+}
+
+static std::string region_path(const std::string &name,
+                               const shmem_placement_t &placement) {
+  return placement.hugepage_dir + name;
+}
+
+void *shmem_region_map(const std::string &name,
+                       size_t bytes,
+                       const shmem_placement_t &placement,
+                       bool resize,
+                       size_t *map_bytes) {
+  bool huge = !placement.hugepage_dir.empty();
+  size_t page = huge ? HUGEPAGE_BYTES : SMALLPAGE_BYTES;
+  size_t len = (bytes + page - 1) / page * page;
+
+  int fd;
+  if (huge) {
+    fd = open(region_path(name, placement).c_str(), O_RDWR | O_CREAT, S_IRWXU);
+  } else {
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT, S_IRWXU);
+  }
+  if (fd < 0) {
+    perror(region_path(name, placement).c_str());
+    abort();
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat");
+    abort();
+  }
+  if ((size_t)st.st_size != len) {
+    if (st.st_size != 0 && !resize) {
+      fprintf(stderr,
+              "Shared-memory object %s is %zu bytes, expected %zu: do both "
+              "sides use the same configuration?\n",
+              region_path(name, placement).c_str(),
+              (size_t)st.st_size,
+              len);
+      abort();
+    }
+    if (ftruncate(fd, len)) {
+      perror("ftruncate");
+      abort();
+    }
+  }
+
+  // Shared hugetlbfs mappings reserve their pages here, so a short pool
+  // fails now rather than with SIGBUS on first touch
+  void *data = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    if (huge)
+      fprintf(stderr,
+              "Not enough free hugepages in %s for %s? See "
+              "/proc/sys/vm/nr_hugepages\n",
+              placement.hugepage_dir.c_str(),
+              name.c_str());
+    abort();
+  }
+
+  // The policy is shared by every mapping of the object, so pages the peer
+  // faults in later land on the same node
+  if (placement.numa_node >= 0 &&
+      !bind_numa_node(data, len, placement.numa_node))
+    abort();
+  prefault(data, len, page);
+
+  *map_bytes = len;
+  return data;
+}
+
+void shmem_region_unlink(const std::string &name,
+                         const shmem_placement_t &placement) {
+  if (placement.hugepage_dir.empty())
+    shm_unlink(name.c_str());
+  else
+    unlink(region_path(name, placement).c_str());
+}
@@ -0,0 +1,45 @@
+// See LICENSE for license details
+
+#ifndef __SHMEM_REGION_H
+#define __SHMEM_REGION_H
+
+#include <stddef.h>
+
+#include <string>
+
+/**
+ * Where the shared-memory objects linking simulators and switches live.
+ * By default they are POSIX shm objects (/dev/shm, 4K pages, placed on
+ * whichever NUMA node first touches them). With hugepage_dir set they are
+ * files of the same name in that hugetlbfs mount instead, so a round spans
+ * a handful of TLB entries; with numa_node set their pages are bound to that
+ * node. Every process mapping an object must use the same hugepage_dir.
+ */
+struct shmem_placement_t {
+  // hugetlbfs mount, e.g. /dev/hugepages; empty for POSIX shm
+  std::string hugepage_dir;
+  // NUMA node to bind the pages to, or -1 to leave them where they fault
+  int numa_node = -1;
+
+  // e.g. "2MB pages on NUMA node 1"
+  std::string describe() const;
+};
+
+/**
+ * Map the shared-memory object name ("/something"), creating it if need be,
+ * and fault in its pages. The object is rounded up to whole pages of its
+ * backing. An existing object of another size is resized if resize is set
+ * and is an error otherwise. Returns the mapping, whose length is stored in
+ * map_bytes. Aborts on failure.
+ */
+void *shmem_region_map(const std::string &name,
+                       size_t bytes,
+                       const shmem_placement_t &placement,
+                       bool resize,
+                       size_t *map_bytes);
+
+// Remove the object from its namespace; existing mappings stay valid
+void shmem_region_unlink(const std::string &name,
+                         const shmem_placement_t &placement);
+
+#endif // __SHMEM_REGION_H
@@ -0,0 +1,132 @@
+// See LICENSE for license details
+
+#include "shmem_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define SHMEM_RING_MAGIC "FSRING01"
+#define SHMEM_RING_PAGE 4096
+
+struct shmem_ring_t::header_t {
+  char magic[8];
+  uint32_t depth;
+  uint32_t slot_bytes;
+  // Each index on its own cache line so the two sides do not contend
+  alignas(64) shmem_counter_t head;
+  alignas(64) shmem_counter_t tail;
+};
+
+static_assert(sizeof(shmem_counter_t) == 8, "counter must fit a futex pair");
+
+shmem_ring_t::shmem_ring_t(const std::string &name,
+                           uint32_t depth,
+                           size_t slot_bytes,
+                           const shmem_placement_t &placement)
+    : name(name), placement(placement), _depth(depth), _slot_bytes(slot_bytes) {
+  if (depth == 0 || slot_bytes == 0 || slot_bytes > UINT32_MAX) {
+    fprintf(stderr,
+            "Invalid shared-memory ring %s: %u slots of %zu bytes\n",
+            name.c_str(),
+            depth,
+            slot_bytes);
+    abort();
+  }
+  slot_stride = (slot_bytes + SHMEM_RING_PAGE - 1) & ~(SHMEM_RING_PAGE - 1);
+
+  // A size mismatch means the two sides disagree on depth or slot size
+  void *data = shmem_region_map(name,
+                                SHMEM_RING_PAGE + slot_stride * depth,
+                                placement,
+                                false,
+                                &map_bytes);
+  header = (header_t *)data;
+  slots = (char *)data + SHMEM_RING_PAGE;
+
+  // Whichever side maps the ring first fills in the geometry; both write
+  // the same values, so a race between them is harmless
+  if (__atomic_load_n(&header->magic[0], __ATOMIC_ACQUIRE) == 0) {
+    header->depth = depth;
+    header->slot_bytes = slot_bytes;
+    memcpy(header->magic + 1, SHMEM_RING_MAGIC + 1, sizeof(header->magic) - 1);
+    __atomic_store_n(&header->magic[0], SHMEM_RING_MAGIC[0], __ATOMIC_RELEASE);
+  } else if (memcmp(header->magic, SHMEM_RING_MAGIC, sizeof(header->magic)) ||
+             header->depth != depth || header->slot_bytes != slot_bytes) {
+    fprintf(stderr,
+            "Shared-memory ring %s holds %u slots of %u bytes, expected %u of "
+            "%zu\n",
+            name.c_str(),
+            header->depth,
+            header->slot_bytes,
+            depth,
+            slot_bytes);
+    abort();
+  }
+  head_slot = header->head.value % depth;
+  tail_slot = header->tail.value % depth;
+}
+
+shmem_ring_t::~shmem_ring_t() {
+  munmap(header, map_bytes);
+  // The peer may already have removed it
+  shmem_region_unlink(name, placement);
+}
+
+char *shmem_ring_t::slot(uint32_t pos) const {
+  return slots + pos * slot_stride;
+}
+
+uint32_t shmem_ring_t::occupancy() const {
+  return __atomic_load_n(&header->head.value, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&header->tail.value, __ATOMIC_ACQUIRE);
+}
+
+char *shmem_ring_t::try_reserve() {
+  uint32_t head = header->head.value;
+  if (head - __atomic_load_n(&header->tail.value, __ATOMIC_ACQUIRE) >= _depth)
+    return nullptr;
+  return slot(head_slot);
+}
+
+char *shmem_ring_t::reserve(shmem_waiter_t &waiter,
+                            const std::atomic<bool> *stop) {
+  uint32_t head = header->head.value;
+  while (true) {
+    uint32_t tail = __atomic_load_n(&header->tail.value, __ATOMIC_ACQUIRE);
+    if (head - tail < _depth)
+      return slot(head_slot);
+    if (!waiter.wait_change(&header->tail, tail, stop))
+      return nullptr;
+  }
+}
+
+void shmem_ring_t::publish() {
+  head_slot = head_slot + 1 == _depth ? 0 : head_slot + 1;
+  shmem_counter_store(&header->head, header->head.value + 1);
+}
+
+char *shmem_ring_t::try_peek() {
+  uint32_t tail = header->tail.value;
+  if (__atomic_load_n(&header->head.value, __ATOMIC_ACQUIRE) == tail)
+    return nullptr;
+  return slot(tail_slot);
+}
+
+char *shmem_ring_t::peek(shmem_waiter_t &waiter,
+                         const std::atomic<bool> *stop) {
+  uint32_t tail = header->tail.value;
+  while (true) {
+    uint32_t head = __atomic_load_n(&header->head.value, __ATOMIC_ACQUIRE);
+    if (head != tail)
+      return slot(tail_slot);
+    if (!waiter.wait_change(&header->head, head, stop))
+      return nullptr;
+  }
+}
+
+void shmem_ring_t::release() {
+  tail_slot = tail_slot + 1 == _depth ? 0 : tail_slot + 1;
+  shmem_counter_store(&header->tail, header->tail.value + 1);
+}
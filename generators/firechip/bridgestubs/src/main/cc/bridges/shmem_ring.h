@@ -0,0 +1,80 @@
+// See LICENSE for license details
+
+#ifndef __SHMEM_RING_H
+#define __SHMEM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "bridges/shmem_region.h"
+#include "bridges/shmem_sync.h"
+
+/**
+ * Single-producer, single-consumer ring of fixed-size slots in a
+ * shared-memory object (see shmem_region.h), used to hand rounds of tokens
+ * between processes. The object holds a one-page header followed by depth
+ * page-aligned slots:
+ *
+ *   magic, depth, slot_bytes
+ *   head   slots published by the producer
+ *   tail   slots released by the consumer
+ *
+ * head and tail only ever increase and wrap at 2^32, which need not be a
+ * multiple of depth, so each side keeps its own slot position. Either
+ * side may create the object, and both must agree on depth and slot_bytes.
+ * The ring is removed from its namespace when either side is destroyed,
+ * so a later run starts from empty indices.
+ */
+class shmem_ring_t {
+public:
+  shmem_ring_t(const std::string &name,
+               uint32_t depth,
+               size_t slot_bytes,
+               const shmem_placement_t &placement = {});
+  ~shmem_ring_t();
+
+  shmem_ring_t(const shmem_ring_t &) = delete;
+  shmem_ring_t &operator=(const shmem_ring_t &) = delete;
+
+  // Producer: the slot to fill next, or nullptr if the ring is full. The
+  // same slot is returned until it is published.
+  char *try_reserve();
+  // Producer: as try_reserve, but wait for the consumer to free a slot.
+  // Returns nullptr only if stop is set while waiting.
+  char *reserve(shmem_waiter_t &waiter,
+                const std::atomic<bool> *stop = nullptr);
+  void publish();
+
+  // Consumer: the oldest published slot, or nullptr if the ring is empty
+  char *try_peek();
+  // Consumer: as try_peek, but wait for the producer to publish a slot.
+  // Returns nullptr only if stop is set while waiting.
+  char *peek(shmem_waiter_t &waiter, const std::atomic<bool> *stop = nullptr);
+  void release();
+
+  // Published slots not yet released
+  uint32_t occupancy() const;
+  uint32_t depth() const { return _depth; }
+  size_t slot_bytes() const { return _slot_bytes; }
+
+private:
+  struct header_t;
+
+  char *slot(uint32_t pos) const;
+
+  std::string name;
+  shmem_placement_t placement;
+  uint32_t _depth;
+  size_t _slot_bytes;
+  size_t slot_stride;
+  size_t map_bytes;
+  header_t *header;
+  char *slots;
+  // Slot of head (producer) and tail (consumer), counted modulo depth
+  uint32_t head_slot;
+  uint32_t tail_slot;
+};
+
+#endif // __SHMEM_RING_H
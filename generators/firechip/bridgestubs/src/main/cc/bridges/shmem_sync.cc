@@ -0,0 +1,132 @@
+// See LICENSE for license details
+
+#include "shmem_sync.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Shortest spin before sleeping, so a peer that is just about done is not
+// missed by a syscall
+#define SHMEM_MIN_SPIN_NS 1000
+// First futex_wait timeout; doubled on every timeout up to the maximum
+#define SHMEM_FIRST_SLEEP_NS 10000
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Not FUTEX_PRIVATE_FLAG: the word is shared with other processes
+static long futex(volatile uint32_t *word,
+                  int op,
+                  uint32_t val,
+                  const struct timespec *timeout) {
+  return syscall(SYS_futex, (uint32_t *)word, op, val, timeout, nullptr, 0);
+}
+
+shmem_waiter_t::shmem_waiter_t(uint32_t spin_us, uint32_t max_sleep_us)
+    : max_spin_ns(spin_us * 1000ULL),
+      max_sleep_ns(std::max<uint64_t>(max_sleep_us, 1) * 1000ULL) {}
+
+/* Wait until ready() holds. word is the futex word that changes when it
+ * might, and sleeper a byte the producer checks before waking it. */
+template <typename Ready>
+void shmem_waiter_t::wait_until(volatile uint32_t *word,
+                                volatile uint8_t *sleeper,
+                                Ready ready_fn) {
+  if (ready_fn())
+    return;
+  _stats.waits++;
+
+  // Spin for about twice as long as recent waits took: a peer that keeps up
+  // is caught without a syscall, while one that is slow is barely spun on
+  uint64_t start = now_ns();
+  uint64_t spin_budget =
+      std::min(max_spin_ns, 2 * avg_wait_ns + SHMEM_MIN_SPIN_NS);
+  uint64_t now = start;
+  bool ready = false;
+  while (!ready && now - start < spin_budget) {
+    for (int i = 0; i < 64 && !ready; i++) {
+      ready = ready_fn();
+      cpu_relax();
+    }
+    now = now_ns();
+  }
+  _stats.spin_ns += now - start;
+
+  // Sleep on the word. Announce the sleeper first so the producer knows to
+  // wake it; if the word changes in between, it no longer matches and
+  // futex_wait returns straight away.
+  bool slept = !ready;
+  uint64_t timeout_ns = std::min<uint64_t>(SHMEM_FIRST_SLEEP_NS, max_sleep_ns);
+  while (!ready) {
+    __atomic_store_n(sleeper, 1, __ATOMIC_SEQ_CST);
+    uint32_t expected = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    if (!ready_fn()) {
+      struct timespec ts = {(time_t)(timeout_ns / 1000000000ULL),
+                            (long)(timeout_ns % 1000000000ULL)};
+      futex(word, FUTEX_WAIT, expected, &ts);
+      _stats.sleeps++;
+      timeout_ns = std::min(timeout_ns * 2, max_sleep_ns);
+    }
+    ready = ready_fn();
+  }
+  uint64_t end = slept ? now_ns() : now;
+  if (slept) {
+    __atomic_store_n(sleeper, 0, __ATOMIC_RELAXED);
+    _stats.sleep_ns += end - now;
+  }
+
+  avg_wait_ns = (avg_wait_ns * 7 + (end - start)) / 8;
+}
+
+static inline bool stopped(const std::atomic<bool> *stop) {
+  return stop && stop->load(std::memory_order_relaxed);
+}
+
+bool shmem_waiter_t::wait(volatile uint8_t *flag,
+                          const std::atomic<bool> *stop) {
+  auto ready = [flag] { return __atomic_load_n(flag, __ATOMIC_ACQUIRE) != 0; };
+  wait_until((volatile uint32_t *)flag, flag + 1, [&] {
+    return ready() || stopped(stop);
+  });
+  return ready();
+}
+
+bool shmem_waiter_t::wait_change(volatile shmem_counter_t *counter,
+                                 uint32_t seen,
+                                 const std::atomic<bool> *stop) {
+  auto ready = [counter, seen] {
+    return __atomic_load_n(&counter->value, __ATOMIC_ACQUIRE) != seen;
+  };
+  wait_until(&counter->value,
+             (volatile uint8_t *)&counter->sleepers,
+             [&] { return ready() || stopped(stop); });
+  return ready();
+}
+
+void shmem_flag_signal(volatile uint8_t *flag) {
+  __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(flag + 1, __ATOMIC_SEQ_CST))
+    futex((volatile uint32_t *)flag, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+void shmem_counter_store(volatile shmem_counter_t *counter, uint32_t value) {
+  __atomic_store_n(&counter->value, value, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n((volatile uint8_t *)&counter->sleepers, __ATOMIC_SEQ_CST))
+    futex(&counter->value, FUTEX_WAKE, INT_MAX, nullptr);
+}
@@ -0,0 +1,75 @@
+// See LICENSE for license details
+
+#ifndef __SHMEM_SYNC_H
+#define __SHMEM_SYNC_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+/**
+ * Handoff flag shared between processes through a shared-memory buffer. The
+ * flag byte is the first byte of an aligned 32-bit word, followed by a byte
+ * the consumer sets while it is asleep on the word:
+ *
+ *   byte 0     ready flag, set by the producer and cleared by the consumer
+ *   byte 1     set while a consumer may be blocked in futex_wait
+ *   bytes 2-3  unused
+ *
+ * Producers that only write byte 0 (e.g. an older switch) still work: the
+ * consumer never sleeps for longer than its maximum sleep time.
+ */
+struct shmem_flag_stats_t {
+  uint64_t waits = 0;  // waits that found the flag clear
+  uint64_t sleeps = 0; // futex_wait calls
+  uint64_t spin_ns = 0;
+  uint64_t sleep_ns = 0;
+};
+
+/**
+ * Counter shared between processes, e.g. the head or tail index of a ring.
+ * Only one process writes value; a process waiting for it to move announces
+ * itself in sleepers so the writer knows to wake it.
+ */
+struct shmem_counter_t {
+  uint32_t value;
+  uint32_t sleepers;
+};
+
+class shmem_waiter_t {
+public:
+  // spin_us bounds how long a wait spins before sleeping; the actual spin
+  // time adapts to how long recent waits took. max_sleep_us bounds a single
+  // futex_wait.
+  shmem_waiter_t(uint32_t spin_us = 50, uint32_t max_sleep_us = 1000);
+
+  // Block until the flag byte at flag (4-byte aligned) is non-zero. Returns
+  // false instead if stop is set first, which is noticed within one sleep.
+  bool wait(volatile uint8_t *flag, const std::atomic<bool> *stop = nullptr);
+
+  // Block until the counter no longer holds seen, or stop is set
+  bool wait_change(volatile shmem_counter_t *counter,
+                   uint32_t seen,
+                   const std::atomic<bool> *stop = nullptr);
+
+  const shmem_flag_stats_t &stats() const { return _stats; }
+
+private:
+  template <typename Ready>
+  void wait_until(volatile uint32_t *word,
+                  volatile uint8_t *sleeper,
+                  Ready ready);
+
+  uint64_t max_spin_ns;
+  uint64_t max_sleep_ns;
+  uint64_t avg_wait_ns = 0; // moving average of recent wait times
+  shmem_flag_stats_t _stats;
+};
+
+// Set the flag byte and wake a consumer sleeping on it
+void shmem_flag_signal(volatile uint8_t *flag);
+
+// Publish a new counter value and wake anyone waiting for it to change
+void shmem_counter_store(volatile shmem_counter_t *counter, uint32_t value);
+
+#endif // __SHMEM_SYNC_H
@@ -3,10 +3,14 @@
 #include "simplenic.h"
 
 #include <cassert>
+#include <cinttypes>
 #include <cstdio>
 #include <cstring>
 
+#include <algorithm>
+
 #include <iostream>
+#include <set>
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -24,7 +28,8 @@ char simplenic_t::KIND;
 
 #define BUFWIDTH streaming_bridge_driver_t::STREAM_WIDTH_BYTES
 #define BUFBYTES (SIMLATENCY_BT * BUFWIDTH)
-#define EXTRABYTES 1
+// The ready flag is followed by the rest of its futex word (see shmem_sync.h)
+#define EXTRABYTES 4
 
 #define FLIT_BITS 64
 #define PACKET_MAX_FLITS 190
@@ -45,6 +50,24 @@ static void simplify_frac(int n, int d, int *nn, int *dd) {
   *dd = d / a;
 }
 
+// +shmemportname of the NICs in this simulator, and of the remote ports of
+// the switches it runs. A NIC blocks the driver thread in tick() until the
+// switch has served it, so a switch here cannot serve two NICs here: one of
+// them would wait on the other's tick forever.
+static std::set<std::string> local_nic_ports;
+static std::set<std::string> local_switch_ports;
+
+static void check_nic_switch_port(int simplenicno, const std::string &port) {
+  if (local_nic_ports.count(port) && local_switch_ports.count(port)) {
+    fprintf(stderr,
+            "simplenic%d: switch port %s is another NIC in this simulator; "
+            "only one NIC per simulator process may be on a +nic-switch\n",
+            simplenicno,
+            port.c_str());
+    abort();
+  }
+}
+
 #define niclog_printf(...)                                                     \
   if (this->niclog) {                                                          \
     fprintf(this->niclog, __VA_ARGS__);                                        \
@@ -66,7 +89,16 @@ simplenic_t::simplenic_t(simif_t &sim,
   const char *niclogfile = nullptr;
   const char *shmemportname = nullptr;
   int netbw = MAX_BANDWIDTH, netburst = 8;
-
+  uint32_t spin_us = 50, sleep_us = 1000;
+  int ring_depth = 2;
+  bool compress = false;
+  const char *switchports = nullptr;
+  const char *capturefile = nullptr;
+  uint32_t capture_mhz = 3200;
+  const char *numanode = nullptr;
+  nic_switch_config_t switch_config;
+
+  this->simplenicno = simplenicno;
   this->loopback = false;
   this->niclog = nullptr;
   this->mac_lendian = 0;
@@ -83,6 +115,21 @@ simplenic_t::simplenic_t(simif_t &sim,
   std::string netburst_arg = std::string("+netburst") + num_equals;
   std::string linklatency_arg = std::string("+linklatency") + num_equals;
   std::string shmemportname_arg = std::string("+shmemportname") + num_equals;
+  std::string nicspin_arg = std::string("+nic-spin-us") + num_equals;
+  std::string nicsleep_arg = std::string("+nic-sleep-us") + num_equals;
+  std::string nicringdepth_arg = std::string("+nic-ring-depth") + num_equals;
+  std::string niccompress_arg =
+      std::string("+nic-compress") + std::to_string(simplenicno);
+  std::string nichugepages_arg = std::string("+nic-hugepages") + num_equals;
+  std::string nicnumanode_arg = std::string("+nic-numa-node") + num_equals;
+  std::string nicswitch_arg = std::string("+nic-switch") + num_equals;
+  std::string niccapture_arg = std::string("+niccapture") + num_equals;
+  std::string niccapturemhz_arg =
+      std::string("+niccapture-mhz") + num_equals;
+  std::string nicswitchlat_arg =
+      std::string("+nic-switch-latency") + num_equals;
+  std::string nicswitchthreads_arg =
+      std::string("+nic-switch-threads") + num_equals;
 
   for (auto &arg : args) {
     if (arg.find(niclog_arg) == 0) {
@@ -131,8 +178,73 @@ simplenic_t::simplenic_t(simif_t &sim,
       shmemportname =
           const_cast<char *>(arg.c_str()) + shmemportname_arg.length();
     }
+    if (arg.find(nicspin_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + nicspin_arg.length();
+      spin_us = atoi(str);
+    }
+    if (arg.find(nicsleep_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + nicsleep_arg.length();
+      sleep_us = atoi(str);
+    }
+    if (arg.find(nicringdepth_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + nicringdepth_arg.length();
+      ring_depth = atoi(str);
+    }
+    if (arg.find(niccompress_arg) == 0) {
+      compress = true;
+    }
+    if (arg.find(nichugepages_arg) == 0) {
+      placement.hugepage_dir =
+          const_cast<char *>(arg.c_str()) + nichugepages_arg.length();
+    }
+    if (arg.find(nicnumanode_arg) == 0) {
+      numanode = const_cast<char *>(arg.c_str()) + nicnumanode_arg.length();
+    }
+    if (arg.find(nicswitch_arg) == 0) {
+      switchports = const_cast<char *>(arg.c_str()) + nicswitch_arg.length();
+    }
+    if (arg.find(niccapture_arg) == 0) {
+      capturefile = const_cast<char *>(arg.c_str()) + niccapture_arg.length();
+    }
+    if (arg.find(niccapturemhz_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + niccapturemhz_arg.length();
+      capture_mhz = atoi(str);
+    }
+    if (arg.find(nicswitchlat_arg) == 0) {
+      char *str = const_cast<char *>(arg.c_str()) + nicswitchlat_arg.length();
+      switch_config.switch_latency = atoi(str);
+    }
+    if (arg.find(nicswitchthreads_arg) == 0) {
+      char *str =
+          const_cast<char *>(arg.c_str()) + nicswitchthreads_arg.length();
+      switch_config.threads = atoi(str);
+    }
   }
 
+  // Spin for at most spin_us waiting on the switch, then sleep on the
+  // shared flag
+  this->waiter = shmem_waiter_t(spin_us, sleep_us);
+
+  if (ring_depth < 2) {
+    fprintf(stderr,
+            "+nic-ring-depth%d must be at least 2, got %d\n",
+            simplenicno,
+            ring_depth);
+    abort();
+  }
+  if (loopback && ring_depth != 2) {
+    printf("[INFO] simplenic%d: +nic-ring-depth is ignored in loopback mode\n",
+           simplenicno);
+    ring_depth = 2;
+  }
+  if (loopback && compress) {
+    printf("[INFO] simplenic%d: +nic-compress is ignored in loopback mode\n",
+           simplenicno);
+    compress = false;
+  }
+  this->ring_depth = ring_depth;
+  this->compress = compress;
+
   if (stream_from_cpu_depth < SIMLATENCY_BT) {
     // Workaround: pick a smaller latency, or up-size the queue.
     std::cerr << "CPU-to-FPGA stream undersized for requested link latency."
@@ -171,61 +283,189 @@ simplenic_t::simplenic_t(simif_t &sim,
     }
   }
 
+  // Resolved here so that "auto" sees the CPUs of the driver thread
+  if (numanode) {
+    placement.numa_node = parse_numa_node(numanode);
+    if (placement.numa_node < 0)
+      abort();
+  }
+  printf("[INFO] simplenic%d: link buffers on %s\n",
+         simplenicno,
+         placement.describe().c_str());
+
+  if (capturefile) {
+    capture = std::make_unique<nic_capture_t>(
+        capturefile, "simplenic" + std::to_string(simplenicno), capture_mhz);
+  }
+
   char name[257];
-  int shmemfd;
+
+  for (int j = 0; j < 2; j++) {
+    pcis_read_bufs[j] = nullptr;
+    pcis_write_bufs[j] = nullptr;
+  }
 
   if (!loopback) {
+    assert(shmemportname != nullptr);
+    local_nic_ports.insert(shmemportname);
+    check_nic_switch_port(simplenicno, shmemportname);
+  }
+
+  if (!loopback && (ring_depth > 2 || compress)) {
+    assert(shmemportname != nullptr);
+    // An encoded round may be a little larger than a raw one
+    size_t slot_bytes =
+        compress ? bigtoken_max_encoded(SIMLATENCY_BT) : BUFBYTES;
+    if (compress)
+      round_buf.resize(BUFBYTES);
+
+    sprintf(name, "/port_nts%s_ring", shmemportname);
+    printf("opening/creating %d-round shmem ring\n%s\n", ring_depth, name);
+    tx_ring = std::make_unique<shmem_ring_t>(
+        name, ring_depth, slot_bytes, placement);
+
+    sprintf(name, "/port_stn%s_ring", shmemportname);
+    printf("opening/creating %d-round shmem ring\n%s\n", ring_depth, name);
+    rx_ring = std::make_unique<shmem_ring_t>(
+        name, ring_depth, slot_bytes, placement);
+  } else if (!loopback) {
     assert(shmemportname != nullptr);
     for (int j = 0; j < 2; j++) {
       printf("Using non-slot-id associated shmemportname:\n");
       sprintf(name, "/port_nts%s_%d", shmemportname, j);
 
       printf("opening/creating shmem region\n%s\n", name);
-      shmemfd = shm_open(name, O_RDWR | O_CREAT, S_IRWXU);
-      ftruncate(shmemfd, BUFBYTES + EXTRABYTES);
-      pcis_read_bufs[j] = (char *)mmap(nullptr,
-                                       BUFBYTES + EXTRABYTES,
-                                       PROT_READ | PROT_WRITE,
-                                       MAP_SHARED,
-                                       shmemfd,
-                                       0);
+      pcis_read_bufs[j] = (char *)shmem_region_map(
+          name, BUFBYTES + EXTRABYTES, placement, true, &port_map_bytes);
 
       printf("Using non-slot-id associated shmemportname:\n");
       sprintf(name, "/port_stn%s_%d", shmemportname, j);
 
       printf("opening/creating shmem region\n%s\n", name);
-      shmemfd = shm_open(name, O_RDWR | O_CREAT, S_IRWXU);
-      ftruncate(shmemfd, BUFBYTES + EXTRABYTES);
-      pcis_write_bufs[j] = (char *)mmap(nullptr,
-                                        BUFBYTES + EXTRABYTES,
-                                        PROT_READ | PROT_WRITE,
-                                        MAP_SHARED,
-                                        shmemfd,
-                                        0);
+      pcis_write_bufs[j] = (char *)shmem_region_map(
+          name, BUFBYTES + EXTRABYTES, placement, true, &port_map_bytes);
     }
   } else {
+    // A single page-aligned buffer serves every round in both directions
+    bool hugepages = !placement.hugepage_dir.empty();
+    char *loopback_buf =
+        (char *)placed_alloc(BUFBYTES + EXTRABYTES, hugepages);
+    if (!loopback_buf) {
+      fprintf(stderr,
+              "simplenic%d: could not allocate %zu bytes for loopback\n",
+              simplenicno,
+              (size_t)(BUFBYTES + EXTRABYTES));
+      abort();
+    }
+    if (placement.numa_node >= 0)
+      bind_numa_node(loopback_buf, BUFBYTES + EXTRABYTES, placement.numa_node);
+    memset(loopback_buf, 0, BUFBYTES + EXTRABYTES);
     for (int j = 0; j < 2; j++) {
-      pcis_read_bufs[j] = (char *)malloc(BUFBYTES + EXTRABYTES);
-      pcis_write_bufs[j] = pcis_read_bufs[j];
+      pcis_read_bufs[j] = loopback_buf;
+      pcis_write_bufs[j] = loopback_buf;
     }
   }
 
   printf("BUFBYTES %d\n", BUFBYTES);
+
+  // Serve the links of the listed NICs, typically including this one, from
+  // switch threads in this simulator
+  if (switchports) {
+    if (!parse_nic_switch_ports(switchports, switch_config.ports))
+      abort();
+    for (auto &port : switch_config.ports) {
+      if (loopback || port.name != shmemportname) {
+        local_switch_ports.insert(port.name);
+        check_nic_switch_port(simplenicno, port.name);
+      }
+    }
+    switch_config.link_latency = this->LINKLATENCY;
+    switch_config.ring_depth = ring_depth;
+    switch_config.compress = compress;
+    switch_config.placement = placement;
+    netswitch = std::make_unique<nic_switch_t>(switch_config);
+  }
 }
 
 simplenic_t::~simplenic_t() {
+  if (netswitch) {
+    netswitch->shutdown();
+    netswitch->print_stats(stdout);
+  }
+  if (rounds && loopback) {
+    double secs =
+        std::chrono::duration<double>(last_round - first_round).count();
+    printf("[INFO] simplenic%d: loopback: %" PRIu64
+           " rounds in %.3f s (%.0f rounds/s, %.2f M link cycles/s, "
+           "%.1f MB/s through the host)\n",
+           this->simplenicno,
+           rounds,
+           secs,
+           secs > 0 ? rounds / secs : 0.0,
+           secs > 0 ? rounds * LINKLATENCY / secs / 1e6 : 0.0,
+           secs > 0 ? 2.0 * rounds * BUFBYTES / secs / 1e6 : 0.0);
+  } else if (rounds) {
+    double secs =
+        std::chrono::duration<double>(last_round - first_round).count();
+    printf("[INFO] simplenic%d: ring depth %u: %" PRIu64
+           " rounds in %.3f s (%.0f rounds/s, %.2f M link cycles/s)\n",
+           this->simplenicno,
+           this->ring_depth,
+           rounds,
+           secs,
+           secs > 0 ? rounds / secs : 0.0,
+           secs > 0 ? rounds * LINKLATENCY / secs / 1e6 : 0.0);
+    printf("[INFO] simplenic%d: stalled %" PRIu64
+           " times (%.3f s) on a full link to the switch and %" PRIu64
+           " times (%.3f s) waiting for the switch; %.2f rounds ready on "
+           "average, %u at most\n",
+           this->simplenicno,
+           tx_stalls,
+           tx_stall_ns / 1e9,
+           rx_stalls,
+           rx_stall_ns / 1e9,
+           (double)rx_backlog_sum / rounds,
+           rx_backlog_max);
+  }
+  if (compress && rounds) {
+    uint64_t raw = rounds * BUFBYTES;
+    printf("[INFO] simplenic%d: compressed link rounds to %.1f%% (sent %" PRIu64
+           " of %" PRIu64 " bytes) and %.1f%% (received %" PRIu64 " bytes)\n",
+           this->simplenicno,
+           100.0 * link_bytes_sent / raw,
+           link_bytes_sent,
+           raw,
+           100.0 * link_bytes_received / raw,
+           link_bytes_received);
+  }
+  const shmem_flag_stats_t &stats = this->waiter.stats();
+  if (stats.waits) {
+    printf("[INFO] simplenic%d: waited on the switch %" PRIu64
+           " times: %.3f s spinning, %.3f s in %" PRIu64 " sleeps\n",
+           this->simplenicno,
+           stats.waits,
+           stats.spin_ns / 1e9,
+           stats.sleep_ns / 1e9,
+           stats.sleeps);
+  }
+  if (capture) {
+    capture->finish();
+    printf("[INFO] simplenic%d: captured %" PRIu64 " frames, dropped %" PRIu64
+           " rounds that did not fit in the capture queue\n",
+           this->simplenicno,
+           capture->packets(),
+           capture->dropped_rounds());
+  }
   if (this->niclog)
     fclose(this->niclog);
   if (loopback) {
-    for (auto &pcis_read_buf : pcis_read_bufs)
-      if (pcis_read_buf)
-        free(pcis_read_buf);
+    free(pcis_read_bufs[0]);
   } else {
     for (int j = 0; j < 2; j++) {
       if (pcis_read_bufs[j])
-        munmap(pcis_read_bufs[j], BUFBYTES + EXTRABYTES);
+        munmap(pcis_read_bufs[j], port_map_bytes);
       if (pcis_write_bufs[j])
-        munmap(pcis_write_bufs[j], BUFBYTES + EXTRABYTES);
+        munmap(pcis_write_bufs[j], port_map_bytes);
     }
   }
 }
@@ -244,8 +484,17 @@ void simplenic_t::init() {
   // In lieu of reading "count", check that the stream is empty by doing a pull.
   // To make this work under alveo we'd almost definitely need to call flush
   // first.
-  auto bytes_received = this->pull(
-      stream_to_cpu_idx, pcis_read_bufs[0], SIMLATENCY_BT * BUFWIDTH, 0);
+  // With a ring there are no fixed round buffers to check into and seed
+  // the FPGA from, so use an all-idle round instead
+  std::vector<char> idle_round;
+  char *check_buf = pcis_read_bufs[0];
+  char *seed_buf = pcis_write_bufs[1];
+  if (tx_ring) {
+    idle_round.resize(BUFBYTES);
+    check_buf = seed_buf = idle_round.data();
+  }
+  auto bytes_received =
+      this->pull(stream_to_cpu_idx, check_buf, SIMLATENCY_BT * BUFWIDTH, 0);
   if ((bytes_received != 0)) {
     printf("FAIL. Exactly 1 tokens should be present in the cpu-bound stream "
            "on init");
@@ -261,8 +510,8 @@ void simplenic_t::init() {
   // If we cannot enqueue the full payload, the stream is likely undersized
   // for our desired latency or the FPGA has not been properly reset /
   // reprogrammed.
-  auto token_bytes_produced = this->push(
-      stream_from_cpu_idx, pcis_write_bufs[1], token_bytes_to_send, 0);
+  auto token_bytes_produced =
+      this->push(stream_from_cpu_idx, seed_buf, token_bytes_to_send, 0);
 
   if (token_bytes_produced != token_bytes_to_send) {
     printf("FAIL. Could not enqueue big tokens to support the desired sim "
@@ -275,17 +524,77 @@ void simplenic_t::init() {
 
 // #define TOKENVERIFY
 
+/* Loopback fast path: each round pulled from the FPGA is pushed straight
+ * back as the round it receives next, with no switch to hand it to and so
+ * no flags, rings or waiting. The streams only move data through host
+ * memory, so the one buffer is the least staging there can be. */
+void simplenic_t::tick_loopback() {
+  char *buf = pcis_read_bufs[0];
+  const uint32_t round_bytes = BUFBYTES;
+
+  while (true) {
+    uint32_t pulled = pull(stream_to_cpu_idx, buf, round_bytes, round_bytes);
+    if (pulled == 0)
+      return;
+    if (pulled != round_bytes) {
+      printf("ERR MISMATCH! on reading tokens out. actually read %d bytes, "
+             "wanted %d bytes.\n",
+             pulled,
+             round_bytes);
+      exit(1);
+    }
+    if (rounds == 0)
+      first_round = stats_clock::now();
+    if (capture) {
+      capture->record(false, buf, SIMLATENCY_BT, rounds * this->LINKLATENCY);
+      capture->record(
+          true, buf, SIMLATENCY_BT, (rounds + 1) * this->LINKLATENCY);
+    }
+
+    uint32_t pushed = push(stream_from_cpu_idx, buf, round_bytes, round_bytes);
+    if (pushed != round_bytes) {
+      printf("ERR MISMATCH! on writing tokens in. actually wrote in %d bytes, "
+             "wanted %d bytes.\n",
+             pushed,
+             round_bytes);
+      exit(1);
+    }
+
+    rounds++;
+    last_round = stats_clock::now();
+  }
+}
+
 void simplenic_t::tick() {
   /* #define DEBUG_NIC_PRINT */
 
+  if (loopback) {
+    tick_loopback();
+    return;
+  }
+
   while (true) { // break when we don't have 5k tokens
     uint32_t tokens_this_round = SIMLATENCY_BT;
 
+    char *send_buf = pcis_read_bufs[currentround];
+    char *slot = nullptr;
+    if (tx_ring && !(slot = tx_ring->try_reserve())) {
+      // The switch is ring_depth rounds behind
+      auto start = stats_clock::now();
+      slot = tx_ring->reserve(this->waiter);
+      tx_stalls++;
+      tx_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         stats_clock::now() - start)
+                         .count();
+    }
+    if (tx_ring)
+      send_buf = compress ? round_buf.data() : slot;
+
     uint32_t token_bytes_obtained_from_fpga = 0;
     auto requested_token_bytes = BUFWIDTH * tokens_this_round;
     token_bytes_obtained_from_fpga =
         pull(stream_to_cpu_idx,
-             pcis_read_bufs[currentround],
+             send_buf,
              requested_token_bytes,
              requested_token_bytes // Copy only if the stream can provide
                                    // exactly as many bytes as we want
@@ -294,14 +603,27 @@ void simplenic_t::tick() {
     if (token_bytes_obtained_from_fpga == 0) {
       return;
     }
+    if (rounds == 0)
+      first_round = stats_clock::now();
+    if (capture)
+      capture->record(false,
+                      send_buf,
+                      tokens_this_round,
+                      rounds * this->LINKLATENCY);
+
     // read into read_buffer
-    pcis_read_bufs[currentround][BUFBYTES] = 1;
+    if (compress) {
+      link_bytes_sent += bigtoken_encode(
+          nic_bigtoken_format, send_buf, tokens_this_round, slot);
+      tx_ring->publish();
+    } else if (tx_ring) {
+      tx_ring->publish();
+    } else {
+      shmem_flag_signal((uint8_t *)send_buf + BUFBYTES);
+    }
 
 #ifdef DEBUG_NIC_PRINT
-    niclog_printf("send pcis_read_bufs[%d][%d]: %d\n",
-                  currentround,
-                  BUFBYTES,
-                  pcis_read_bufs[currentround][BUFBYTES]);
+    niclog_printf("send round %d\n", currentround);
 #endif
 
 
@@ -310,8 +632,7 @@ void simplenic_t::tick() {
     // incrementing for each sent token. verify that we are not losing
     // tokens over PCIS
     for (int i = 0; i < tokens_this_round; i++) {
-      uint64_t TOKENLRV_AND_COUNT =
-          *(((uint64_t *)pcis_read_bufs[currentround]) + i * 8);
+      uint64_t TOKENLRV_AND_COUNT = *(((uint64_t *)send_buf) + i * 8);
       uint8_t LAST;
       for (int token_in_bigtoken = 0; token_in_bigtoken < 7;
            token_in_bigtoken++) {
@@ -319,16 +640,15 @@ void simplenic_t::tick() {
           LAST = (TOKENLRV_AND_COUNT >> (45 + token_in_bigtoken * 3)) & 0x1;
           niclog_printf("sending to other node, valid data chunk: "
                         "%016lx, last %x, sendcycle: %016ld\n",
-                        *((((uint64_t *)pcis_read_bufs[currentround]) + i * 8) +
-                          1 + token_in_bigtoken),
+                        *((((uint64_t *)send_buf) + i * 8) + 1 +
+                          token_in_bigtoken),
                         LAST,
                         timeelapsed_cycles + i * 7 + token_in_bigtoken);
         }
       }
 
       //            *((uint64_t*)(pcis_read_buf + i*64)) |= 0x4924900000000000;
-      uint32_t thistoken =
-          *((uint32_t *)(pcis_read_bufs[currentround] + i * 64));
+      uint32_t thistoken = *((uint32_t *)(send_buf + i * 64));
       if (thistoken != next_token_from_fpga) {
         niclog_printf("FAIL! Token lost on FPGA interface.\n");
         exit(1);
@@ -353,14 +673,56 @@ void simplenic_t::tick() {
     timeelapsed_cycles += LINKLATENCY;
 #endif
 
-    if (!loopback) {
-      volatile uint8_t *polladdr =
-          (uint8_t *)(pcis_write_bufs[currentround] + BUFBYTES);
-      while (*polladdr == 0) {
-        ;
+    char *recv_buf = pcis_write_bufs[currentround];
+    uint32_t backlog = 1;
+    bool ready = true;
+    if (rx_ring) {
+      backlog = rx_ring->occupancy();
+      ready = (recv_buf = rx_ring->try_peek()) != nullptr;
+    } else {
+      backlog = recv_buf[BUFBYTES] ? 1 : 0;
+      ready = backlog != 0;
+    }
+    if (!ready) {
+      auto start = stats_clock::now();
+      if (rx_ring) {
+        recv_buf = rx_ring->peek(this->waiter);
+      } else {
+        this->waiter.wait((uint8_t *)(recv_buf + BUFBYTES));
       }
+      rx_stalls++;
+      rx_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         stats_clock::now() - start)
+                         .count();
+    }
+    rx_backlog_sum += backlog;
+    rx_backlog_max = std::max(rx_backlog_max, backlog);
+
+    char *slot_in = recv_buf;
+    if (compress) {
+      recv_buf = round_buf.data();
+      if (!bigtoken_decode(nic_bigtoken_format,
+                           slot_in,
+                           rx_ring->slot_bytes(),
+                           recv_buf,
+                           tokens_this_round)) {
+        fprintf(stderr,
+                "simplenic%d: malformed round from the switch; is it "
+                "running with compression (+nic-compress%d)?\n",
+                this->simplenicno,
+                this->simplenicno);
+        abort();
+      }
+      link_bytes_received += bigtoken_encoded_size(slot_in, tokens_this_round);
     }
 
+    // The FPGA was seeded with one round, so this one plays a round later
+    if (capture)
+      capture->record(true,
+                      recv_buf,
+                      tokens_this_round,
+                      (rounds + 1) * this->LINKLATENCY);
+
 #ifdef DEBUG_NIC_PRINT
     niclog_printf("done recv round %d\n", currentround);
 #endif
@@ -369,8 +731,7 @@ void simplenic_t::tick() {
     // this does not do tokenverify - it's just printing tokens
     // there should not be tokenverify on this interface
     for (int i = 0; i < tokens_this_round; i++) {
-      uint64_t TOKENLRV_AND_COUNT =
-          *(((uint64_t *)pcis_write_bufs[currentround]) + i * 8);
+      uint64_t TOKENLRV_AND_COUNT = *(((uint64_t *)recv_buf) + i * 8);
       uint8_t LAST;
       for (int token_in_bigtoken = 0; token_in_bigtoken < 7;
            token_in_bigtoken++) {
@@ -379,8 +740,7 @@ void simplenic_t::tick() {
           niclog_printf(
               "from other node, valid data chunk: %016lx, "
               "last %x, recvcycle: %016ld\n",
-              *((((uint64_t *)pcis_write_bufs[currentround]) + i * 8) + 1 +
-                token_in_bigtoken),
+              *((((uint64_t *)recv_buf) + i * 8) + 1 + token_in_bigtoken),
               LAST,
               timeelapsed_cycles + i * 7 + token_in_bigtoken);
         }
@@ -389,10 +749,14 @@ void simplenic_t::tick() {
 #endif
     uint32_t token_bytes_sent_to_fpga = 0;
     token_bytes_sent_to_fpga = push(stream_from_cpu_idx,
-                                    pcis_write_bufs[currentround],
+                                    recv_buf,
                                     BUFWIDTH * tokens_this_round,
                                     BUFWIDTH * tokens_this_round);
-    pcis_write_bufs[currentround][BUFBYTES] = 0;
+    if (rx_ring) {
+      rx_ring->release();
+    } else {
+      slot_in[BUFBYTES] = 0;
+    }
     if (token_bytes_sent_to_fpga != tokens_this_round * BUFWIDTH) {
       printf("ERR MISMATCH! on writing tokens in. actually wrote in %d bytes, "
              "wanted %d bytes.\n",
@@ -402,6 +766,8 @@ void simplenic_t::tick() {
       exit(1);
     }
 
+    rounds++;
+    last_round = stats_clock::now();
     currentround = (currentround + 1) % 2;
   }
 }
@@ -3,8 +3,17 @@
 #ifndef __SIMPLENIC_H
 #define __SIMPLENIC_H
 
+#include <chrono>
+#include <memory>
 #include <vector>
 
+#include "bridges/bigtoken_codec.h"
+#include "bridges/host_placement.h"
+#include "bridges/netswitch/nic_switch.h"
+#include "bridges/nic_capture.h"
+#include "bridges/shmem_region.h"
+#include "bridges/shmem_ring.h"
+#include "bridges/shmem_sync.h"
 #include "core/bridge_driver.h"
 #include "core/stream_engine.h"
 
@@ -41,6 +50,8 @@ public:
   void finish() override {}
 
 private:
+  void tick_loopback();
+
   const SIMPLENICBRIDGEMODULE_struct mmio_addrs;
   uint64_t mac_lendian;
   char *pcis_read_bufs[2];
@@ -54,11 +65,50 @@ private:
   // IMPORTANT: this must be a multiple of 7
   int LINKLATENCY;
   FILE *niclog;
+  // Rounds go straight back to the FPGA through one buffer, see
+  // tick_loopback()
   bool loopback;
+  int simplenicno;
+
+  // Waits for the switch to hand over each round of tokens
+  shmem_waiter_t waiter;
 
   // checking for token loss
   int currentround = 0;
 
+  // Rounds that may be in flight in each direction. Two keeps the
+  // ping-pong /port_nts/stn<name>_<round> buffers; deeper or compressed
+  // links use a shmem_ring_t per direction so the NIC and the switch can
+  // drift apart by up to ring_depth rounds.
+  uint32_t ring_depth;
+  std::unique_ptr<shmem_ring_t> tx_ring; // NIC to switch
+  std::unique_ptr<shmem_ring_t> rx_ring; // switch to NIC
+
+  // Rounds cross the rings run-length encoded (+nic-compress), staged in
+  // round_buf on their way to and from the FPGA
+  bool compress;
+  std::vector<char> round_buf;
+  uint64_t link_bytes_sent = 0, link_bytes_received = 0;
+
+  // Backing of the link buffers (+nic-hugepages, +nic-numa-node)
+  shmem_placement_t placement;
+  size_t port_map_bytes = 0; // of each ping-pong buffer
+
+  // pcapng capture of the link (+niccapture)
+  std::unique_ptr<nic_capture_t> capture;
+
+  // Switch hosted in this process for the other NICs (+nic-switch)
+  std::unique_ptr<nic_switch_t> netswitch;
+
+  // Link statistics, reported on teardown
+  using stats_clock = std::chrono::steady_clock;
+  stats_clock::time_point first_round, last_round;
+  uint64_t rounds = 0;
+  uint64_t tx_stalls = 0, tx_stall_ns = 0; // waiting for a free tx slot
+  uint64_t rx_stalls = 0, rx_stall_ns = 0; // waiting for the switch
+  uint64_t rx_backlog_sum = 0;             // rounds ready when receiving
+  uint32_t rx_backlog_max = 0;
+
   // only for TOKENVERIFY
   const int stream_to_cpu_idx;
   const int stream_from_cpu_idx;
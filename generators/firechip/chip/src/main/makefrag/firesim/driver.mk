@@ -50,7 +50,7 @@ DRIVER_CC += \
 		$(wildcard \
 			$(addprefix \
 				$(firechip_bridgestubs_lib_dir)/, \
-				$(addsuffix .cc,bridges/* bridges/tracerv/* bridges/cospike/*) \
+				$(addsuffix .cc,bridges/* bridges/tracerv/* bridges/cospike/* bridges/blockdev/* bridges/netswitch/*) \
 			) \
 		)
 TARGET_CXX_FLAGS += \
@@ -369,4 +369,26 @@ class CTCFireSimConfig extends Config(
   new FireSimRocketConfig
 )
 
+// One CTC port per chip of an nChips system joined by firesim-ctc-router:
+// port p, at (0x10 * (p + 1)) << 32 as in tests/multi-ctc-test.c, leads to
+// chip p. Run chip c with +ctcchip=c +ctcrouter<c>=1.
+class WithRoutedCTC(nChips: Int) extends Config(
+  new testchipip.ctc.WithCTC((0 until nChips).map(p =>
+    new testchipip.ctc.CTCParams(onchipAddr = 0x1000000000L * (p + 1), offchipAddr = 0x0L, size = ((1L << 32) - 1), noPhy=true)))
+)
+
+class CTCRouter4FireSimConfig extends Config(
+  new WithCTCBridge ++
+  new WithRoutedCTC(4) ++
+  new chipyard.iobinders.WithCTCPunchthrough ++
+  new FireSimRocketConfig
+)
+
+class CTCRouter8FireSimConfig extends Config(
+  new WithCTCBridge ++
+  new WithRoutedCTC(8) ++
+  new chipyard.iobinders.WithCTCPunchthrough ++
+  new FireSimRocketConfig
+)
+
 
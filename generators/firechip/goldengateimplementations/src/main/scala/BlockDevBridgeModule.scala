@@ -14,8 +14,92 @@ import firesim.lib.bridgeutils._
 
 import firechip.bridgeinterfaces._
 
+// One 512-bit stream beat of block device data: up to seven 64-bit data beats
+// with their tags. Data word i sits at bits [64i+63:64i]; the top word holds
+// the entry count (bits 455:448) and tag i (bits 463+8i:456+8i).
+object BlockDevStreamBeat {
+  val entries = 7
+}
+
+class BlockDevStreamBeat extends Bundle {
+  val tags = Vec(BlockDevStreamBeat.entries, UInt(8.W))
+  val count = UInt(8.W)
+  val data = Vec(BlockDevStreamBeat.entries, UInt(64.W))
+}
+
+// Packs write data from the target into stream beats. A partially filled
+// beat is sent once no new data has arrived for flushCycles host cycles.
+class BlockDevDataToHostAdapter(blockDevExternal: BlockDeviceConfig, flushCycles: Int) extends Module {
+  val io = IO(new Bundle {
+    val data_in = Flipped(Decoupled(new BlockDeviceData(blockDevExternal)))
+    val pcie_out = Decoupled(UInt(512.W))
+    val beats = Output(UInt(32.W))
+  })
+
+  require(io.data_in.bits.tag.getWidth <= 8, "Stream beats carry 8-bit tags")
+
+  val beat = Reg(new BlockDevStreamBeat)
+  val count = RegInit(0.U(4.W))
+  val idleCycles = RegInit(0.U(log2Ceil(flushCycles + 1).W))
+  val full = count === BlockDevStreamBeat.entries.U
+  val flush = count =/= 0.U && (full || idleCycles === flushCycles.U)
+
+  io.data_in.ready := !flush
+  when (io.data_in.fire) {
+    beat.data(count) := io.data_in.bits.data
+    beat.tags(count) := io.data_in.bits.tag
+    count := count + 1.U
+    idleCycles := 0.U
+  } .elsewhen (count =/= 0.U && !flush) {
+    idleCycles := idleCycles + 1.U
+  }
+
+  val out = WireInit(beat)
+  out.count := count
+  io.pcie_out.valid := flush
+  io.pcie_out.bits := out.asUInt
+
+  // Lets the driver tell whether there is anything to pull
+  val beatsSent = RegInit(0.U(32.W))
+  when (io.pcie_out.fire) {
+    count := 0.U
+    idleCycles := 0.U
+    beatsSent := beatsSent + 1.U
+  }
+  io.beats := beatsSent
+}
+
+// Unpacks read response beats from the driver. The driver never sends an
+// empty beat.
+class HostToBlockDevDataAdapter(blockDevExternal: BlockDeviceConfig) extends Module {
+  val io = IO(new Bundle {
+    val pcie_in = Flipped(Decoupled(UInt(512.W)))
+    val data_out = Decoupled(new BlockDeviceData(blockDevExternal))
+  })
+
+  val beat = io.pcie_in.bits.asTypeOf(new BlockDevStreamBeat)
+  val idx = RegInit(0.U(3.W))
+  val last = idx === beat.count - 1.U
+
+  io.data_out.valid := io.pcie_in.valid
+  io.data_out.bits.data := beat.data(idx)
+  io.data_out.bits.tag := beat.tags(idx)
+  io.pcie_in.ready := io.data_out.ready && last
+
+  when (io.data_out.fire) {
+    idx := Mux(last, 0.U, idx + 1.U)
+  }
+}
+
 class BlockDevBridgeModule(blockDevExternal: BlockDeviceConfig)(implicit p: Parameters)
-extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
+extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p)
+    with StreamToHostCPU
+    with StreamFromHostCPU {
+  // Stream mixin parameters. Data moves over the streams, only requests,
+  // write acks and configuration use MMIO.
+  val fromHostCPUQueueDepth = 512
+  val toHostCPUQueueDepth   = 512
+
   lazy val module = new BridgeModuleImp(this) {
     // TODO use HasBlockDeviceParameters
     val dataBytes = 512
@@ -195,22 +279,18 @@ extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
     genROReg(reqBuf.io.deq.bits.tag, "bdev_req_tag")
     Pulsify(genWORegInit(reqBuf.io.deq.ready, "bdev_req_ready", false.B), pulseLength = 1)
 
-    // Functional data queue (to CPU)
-    genROReg(dataBuf.io.deq.valid, "bdev_data_valid")
-    genROReg(dataBuf.io.deq.bits.data(63, 32), "bdev_data_data_upper")
-    genROReg(dataBuf.io.deq.bits.data(31, 0), "bdev_data_data_lower")
-    genROReg(dataBuf.io.deq.bits.tag, "bdev_data_tag")
-    Pulsify(genWORegInit(dataBuf.io.deq.ready, "bdev_data_ready", false.B), pulseLength = 1)
-
-    // Read reponse buffer MMIO IF (from CPU)
-    val rRespDataRegUpper = genWOReg(Wire(UInt((dataBitsPerBeat/2).W)),"bdev_rresp_data_upper")
-    val rRespDataRegLower = genWOReg(Wire(UInt((dataBitsPerBeat/2).W)),"bdev_rresp_data_lower")
-    val rRespTag          = genWOReg(Wire(UInt(tagBits.W)            ),"bdev_rresp_tag")
-    Pulsify(                genWORegInit(rRespBuf.io.enq.valid  ,"bdev_rresp_valid", false.B), pulseLength = 1)
-    genROReg(rRespBuf.io.enq.ready, "bdev_rresp_ready")
+    // Functional data queue (to CPU), packed into stream beats
+    val dataToHost = Module(new BlockDevDataToHostAdapter(blockDevExternal, flushCycles = 64))
+    dataToHost.io.data_in <> dataBuf.io.deq
+    streamEnq <> dataToHost.io.pcie_out
+    genROReg(dataToHost.io.beats, "bdev_data_beats")
+    // Beats the driver has pulled so far; any not yet pulled need service
+    val dataBeatsPulled = genWORegInit(Wire(UInt(32.W)), "bdev_data_beats_pulled", 0.U)
 
-    rRespBuf.io.enq.bits.data := Cat(rRespDataRegUpper, rRespDataRegLower)
-    rRespBuf.io.enq.bits.tag := rRespTag
+    // Read reponse buffer (from CPU), unpacked from stream beats
+    val dataFromHost = Module(new HostToBlockDevDataAdapter(blockDevExternal))
+    dataFromHost.io.pcie_in <> streamDeq
+    rRespBuf.io.enq <> dataFromHost.io.data_out
 
     // Write acknowledgement buffer MMIO IF (from CPU) -- we only need the tag from SW
     val wAckTag          = genWOReg(Wire(UInt(tagBits.W))            ,"bdev_wack_tag")
@@ -219,7 +299,8 @@ extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
     wAckBuf.io.enq.bits := wAckTag
 
     // Indicates to the CPU-hosted component that we need to be serviced
-    genROReg(reqBuf.io.deq.valid || dataBuf.io.deq.valid, "bdev_reqs_pending")
+    genROReg(reqBuf.io.deq.valid || dataBuf.io.deq.valid ||
+             dataToHost.io.beats =/= dataBeatsPulled, "bdev_reqs_pending")
     genROReg(~wAckStallN, "bdev_wack_stalled")
     genROReg(~rRespStallN, "bdev_rresp_stalled")
 
@@ -231,7 +312,15 @@ extends BridgeModule[HostPortIO[BlockDevBridgeTargetIO]]()(p) {
           sb,
           "blockdev_t",
           "blockdev",
-          Seq(UInt32(nTrackers), UInt32(latencyBits))
+          Seq(
+            UInt32(toHostStreamIdx),
+            UInt32(toHostCPUQueueDepth),
+            UInt32(fromHostStreamIdx),
+            UInt32(fromHostCPUQueueDepth),
+            UInt32(nTrackers),
+            UInt32(latencyBits),
+          ),
+          hasStreams = true
       )
     }
   }
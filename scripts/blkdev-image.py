@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+
+# Convert FireSim block device images between the formats the blockdev
+# bridge driver understands (see bridges/blockdev/sparse_image.h and
+# compressed_image.h):
+#
+#   raw         plain image, any file that matches neither magic below
+#   sparse      only written chunks are stored, writable
+#   compressed  zlib-compressed chunks, read-only
+#   striped     chunks spread round-robin over several raw files, given to
+#               +blkdev as a comma-separated list
+
+import argparse
+import struct
+import sys
+import zlib
+
+HEADER_BYTES = 4096
+SPARSE_MAGIC = b"FSSPARS1"
+COMPRESSED_MAGIC = b"FSZIMG01"
+SECTOR = 512
+
+def read_header(f):
+  f.seek(0)
+  magic, size, chunk_bytes, nchunks = struct.unpack("<8sQQQ", f.read(32))
+  return magic, size, chunk_bytes, nchunks
+
+def write_header(f, magic, size, chunk_bytes, nchunks):
+  f.seek(0)
+  f.write(struct.pack("<8sQQQ", magic, size, chunk_bytes, nchunks).ljust(HEADER_BYTES, b"\0"))
+
+def read_chunks(path):
+  """Yield (size, chunk_bytes) then every chunk of any supported image."""
+  with open(path, "rb") as f:
+    magic = f.read(8)
+    if magic == SPARSE_MAGIC:
+      _, size, chunk_bytes, nchunks = read_header(f)
+      f.seek(HEADER_BYTES)
+      chunk_map = struct.unpack("<%dQ" % nchunks, f.read(8 * nchunks))
+      yield size, chunk_bytes
+      for i, off in enumerate(chunk_map):
+        length = min(chunk_bytes, size - i * chunk_bytes)
+        if off:
+          f.seek(off)
+          yield f.read(length)
+        else:
+          yield bytes(length)
+    elif magic == COMPRESSED_MAGIC:
+      _, size, chunk_bytes, nchunks = read_header(f)
+      f.seek(HEADER_BYTES)
+      index = struct.unpack("<%dQ" % (nchunks + 1), f.read(8 * (nchunks + 1)))
+      yield size, chunk_bytes
+      for i in range(nchunks):
+        length = min(chunk_bytes, size - i * chunk_bytes)
+        f.seek(index[i])
+        stored = f.read(index[i + 1] - index[i])
+        if not stored:
+          yield bytes(length)
+        elif len(stored) == length:
+          yield stored
+        else:
+          yield zlib.decompress(stored)
+    else:
+      f.seek(0, 2)
+      size = f.tell() & ~(SECTOR - 1)
+      f.seek(0)
+      yield size, None
+      while f.tell() < size:
+        yield f.read(min(1 << 20, size - f.tell()))
+
+def rechunk(chunks, chunk_bytes):
+  """Regroup a stream of byte strings into chunk_bytes pieces."""
+  buf = bytearray()
+  for c in chunks:
+    buf += c
+    while len(buf) >= chunk_bytes:
+      yield bytes(buf[:chunk_bytes])
+      del buf[:chunk_bytes]
+  if buf:
+    yield bytes(buf)
+
+def nchunks_for(size, chunk_bytes):
+  return (size + chunk_bytes - 1) // chunk_bytes
+
+def to_raw(src, dst, chunk_bytes):
+  chunks = read_chunks(src)
+  size, _ = next(chunks)
+  with open(dst, "wb") as out:
+    for c in chunks:
+      if any(c):
+        out.write(c)
+      else:
+        out.seek(len(c), 1)
+    out.truncate(size)
+
+def to_sparse(src, dst, chunk_bytes):
+  chunks = read_chunks(src)
+  size, _ = next(chunks)
+  nchunks = nchunks_for(size, chunk_bytes)
+  chunk_map = [0] * nchunks
+  with open(dst, "wb") as out:
+    write_header(out, SPARSE_MAGIC, size, chunk_bytes, nchunks)
+    end = HEADER_BYTES + 8 * nchunks
+    for i, c in enumerate(rechunk(chunks, chunk_bytes)):
+      if any(c):
+        chunk_map[i] = end
+        out.seek(end)
+        out.write(c.ljust(chunk_bytes, b"\0"))
+        end += chunk_bytes
+    out.seek(HEADER_BYTES)
+    out.write(struct.pack("<%dQ" % nchunks, *chunk_map))
+
+def to_compressed(src, dst, chunk_bytes):
+  chunks = read_chunks(src)
+  size, _ = next(chunks)
+  nchunks = nchunks_for(size, chunk_bytes)
+  index = [HEADER_BYTES + 8 * (nchunks + 1)]
+  with open(dst, "wb") as out:
+    write_header(out, COMPRESSED_MAGIC, size, chunk_bytes, nchunks)
+    out.seek(index[0])
+    for c in rechunk(chunks, chunk_bytes):
+      if not any(c):
+        stored = b""
+      else:
+        stored = zlib.compress(c, 9)
+        if len(stored) >= len(c):
+          stored = c
+      out.write(stored)
+      index.append(index[-1] + len(stored))
+    out.seek(HEADER_BYTES)
+    out.write(struct.pack("<%dQ" % (nchunks + 1), *index))
+
+def to_striped(src, dsts, chunk_bytes):
+  chunks = read_chunks(src)
+  size, _ = next(chunks)
+  outs = [open(d, "wb") for d in dsts]
+  for i, c in enumerate(rechunk(chunks, chunk_bytes)):
+    outs[i % len(outs)].write(c.ljust(chunk_bytes, b"\0"))
+  # Every file has to hold the same number of chunks
+  per_file = (nchunks_for(size, chunk_bytes) + len(outs) - 1) // len(outs)
+  for out in outs:
+    out.truncate(per_file * chunk_bytes)
+    out.close()
+
+def from_striped(srcs, dst, chunk_bytes):
+  ins = [open(s, "rb") for s in srcs]
+  with open(dst, "wb") as out:
+    i = 0
+    while True:
+      c = ins[i % len(ins)].read(chunk_bytes)
+      if len(c) < chunk_bytes:
+        break
+      out.write(c)
+      i += 1
+  for f in ins:
+    f.close()
+
+def create_sparse(dst, size, chunk_bytes):
+  nchunks = nchunks_for(size, chunk_bytes)
+  with open(dst, "wb") as out:
+    write_header(out, SPARSE_MAGIC, size, chunk_bytes, nchunks)
+    out.write(bytes(8 * nchunks))
+
+def parse_size(s):
+  units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30, "T": 1 << 40}
+  if s[-1].upper() in units:
+    return int(s[:-1]) * units[s[-1].upper()]
+  return int(s)
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Convert FireSim blockdev images between raw, sparse and compressed formats")
+  parser.add_argument("--chunk-size", type=parse_size, default=64 << 10, help="chunk size for sparse and compressed images (default 64K)")
+  sub = parser.add_subparsers(dest="cmd", required=True)
+  for fmt in ["raw", "sparse", "compressed"]:
+    p = sub.add_parser(fmt, help="convert an image of any format to %s" % fmt)
+    p.add_argument("src")
+    p.add_argument("dst")
+  p = sub.add_parser("stripe", help="split an image of any format over several raw files")
+  p.add_argument("src")
+  p.add_argument("dsts", nargs="+")
+  p = sub.add_parser("unstripe", help="join striped files back into one raw image")
+  p.add_argument("dst")
+  p.add_argument("srcs", nargs="+")
+  p = sub.add_parser("create-sparse", help="create an empty sparse image")
+  p.add_argument("dst")
+  p.add_argument("size", type=parse_size, help="size in bytes, with an optional K/M/G/T suffix")
+  args = parser.parse_args()
+
+  if args.chunk_size <= 0 or args.chunk_size % SECTOR:
+    sys.exit("chunk size must be a multiple of %d bytes" % SECTOR)
+
+  if args.cmd == "stripe":
+    to_striped(args.src, args.dsts, args.chunk_size)
+  elif args.cmd == "unstripe":
+    from_striped(args.srcs, args.dst, args.chunk_size)
+  elif args.cmd == "create-sparse":
+    if args.size % SECTOR:
+      sys.exit("size must be a multiple of %d bytes" % SECTOR)
+    create_sparse(args.dst, args.size, args.chunk_size)
+  else:
+    {"raw": to_raw, "sparse": to_sparse, "compressed": to_compressed}[args.cmd](args.src, args.dst, args.chunk_size)
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <riscv-pk/encoding.h>
+
+#include "mmio.h"
+#include "blkdev.h"
+
+/*
+ * Streams TEST_BYTES through the block device with every tracker busy, first
+ * writing then reading back, and reports the achieved bandwidth in bytes per
+ * target cycle. That only depends on the target, so the driver prints the
+ * host MB/s of each direction when the simulation ends ("[INFO] blockdev0:
+ * ... MB/s"); run the same binary against two driver builds or image
+ * backends and compare those lines.
+ */
+
+#define TEST_BYTES (8UL << 20)
+#define MAX_SECTORS 16
+
+static unsigned long buf[MAX_SECTORS * BLKDEV_SECTOR_SIZE / sizeof(unsigned long)];
+
+static unsigned long run(int write, unsigned int nsectors, unsigned int req_len)
+{
+	unsigned long total = TEST_BYTES >> BLKDEV_SECTOR_SHIFT;
+	unsigned long issued = 0, completed = 0;
+	unsigned int offset = 0;
+	unsigned long start, end;
+
+	start = rdcycle();
+	while (completed < total) {
+		while (issued < total && reg_read8(BLKDEV_NREQUEST) > 0) {
+			if (offset + req_len > nsectors)
+				offset = 0;
+			blkdev_send_request((unsigned long) buf, offset, req_len, write);
+			offset += req_len;
+			issued += req_len;
+		}
+		for (int n = reg_read8(BLKDEV_NCOMPLETE); n > 0; n--) {
+			reg_read8(BLKDEV_COMPLETE);
+			completed += req_len;
+		}
+	}
+	end = rdcycle();
+
+	return end - start;
+}
+
+int main(void)
+{
+	unsigned int nsectors = blkdev_nsectors();
+	unsigned int req_len = blkdev_max_req_len();
+	unsigned long cycles;
+
+	if (req_len > MAX_SECTORS)
+		req_len = MAX_SECTORS;
+	if (nsectors < req_len) {
+		printf("Disk too small: %u sectors\n", nsectors);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Transferring %lu bytes in %u-sector requests\n",
+			TEST_BYTES, req_len);
+
+	cycles = run(1, nsectors, req_len);
+	printf("write: %lu cycles, %lu bytes/kcycle\n",
+			cycles, TEST_BYTES * 1000 / cycles);
+
+	cycles = run(0, nsectors, req_len);
+	printf("read: %lu cycles, %lu bytes/kcycle\n",
+			cycles, TEST_BYTES * 1000 / cycles);
+
+	return 0;
+}
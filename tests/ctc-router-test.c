@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <riscv-pk/encoding.h>
+#include "marchid.h"
+
+/*
+ * Writes and reads back a buffer in the memory of every chip of an
+ * NCHIPS-chip system connected through firesim-ctc-router, reporting the
+ * cycles each remote chip takes. CTC port d leads to chip d, so chip d is at
+ * CTC_OFFSET(d) on every chip, its own port looping back. Every chip writes
+ * the same values, so they can all run this at once.
+ */
+
+#ifndef NCHIPS
+#define NCHIPS 4
+#endif
+
+#define CTC_OFFSET(d) ((0x10L * ((d) + 1)) << 32)
+
+uint32_t src[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+uint32_t dest[10];
+uint32_t test[10];
+
+int rw_mem(int chip) {
+  uint32_t* offchip_addr = (uint32_t*)((uintptr_t)dest + CTC_OFFSET(chip));
+
+  size_t write_start = rdcycle();
+
+  // Using inline ASM because CTC requires 32b transactions
+  for (int i = 0; i < 10; i++) {
+      asm volatile(
+          "lw  t0, 0(%1)\n"
+          "sw  t0, 0(%0)\n"
+          :
+          : "r"(offchip_addr + i),
+            "r"(src + i)
+          : "t0", "memory"
+      );
+  }
+
+  size_t write_end = rdcycle();
+  size_t read_start = rdcycle();
+
+  for (int i = 0; i < 10; i++) {
+    asm volatile(
+        "lw  t0, 0(%0)\n"
+        "sw  t0, 0(%1)\n"
+        :
+        : "r"(offchip_addr + i),
+          "r"(test + i)
+        : "t0", "memory"
+    );
+  }
+
+  size_t read_end = rdcycle();
+
+  for (int i = 0; i < sizeof(src) / 4; i++) {
+    if (src[i] != test[i]) {
+      printf("Chip %d: remote write/read failed at index %d %x %x\n", chip, i, src[i], test[i]);
+      exit(1);
+    }
+  }
+
+  printf("Chip %d: wrote %ld bytes in %ld cycles, read them in %ld cycles\n",
+         chip, sizeof(src), write_end - write_start, read_end - read_start);
+
+  return 0;
+}
+
+int main(void) {
+
+  printf("Testing %d chips through the CTC router\n", NCHIPS);
+  for (int chip = 0; chip < NCHIPS; chip++)
+    rw_mem(chip);
+
+  return 0;
+}